@@ -0,0 +1,348 @@
+/**
+ * Microbenchmarks for the lexer, parser and file-processing builtins.
+ *
+ * Built and run by "make bench". Every case prints one JSON object per line
+ * on stdout, so results can be appended to a log and compared over time:
+ *
+ *   {"suite":"lexer","case":"tokenize","params":{"bytes":1024,"density":0.1},
+ *    "iterations":5000,"mean_ns":812.4,"min_ns":790,"bytes_per_op":1024,"mb_per_s":1260.3}
+ *
+ * Usage: custom-shell-bench [--filter S] [--min-time SEC] [--max-size N[K|M|G]]
+ *                           [--max-files N] [--dir D]
+ *   --filter     only run cases whose "suite/case" contains S
+ *   --min-time   time spent per case, at least one iteration (default 0.5)
+ *   --max-size   largest corpus for wc/grep/cat, out of 1M, 16M, 256M, 1G
+ *                and 10G (default 256M)
+ *   --max-files  largest tree for ls -l/rm -r/cp -r, from 1000 in steps of
+ *                10x (default 10000)
+ *   --dir        where corpora and trees are generated (default /tmp)
+ *
+ * Corpora are read warm: each is generated once and left in the page cache.
+ */
+#include "lexer.h"
+#include "parser.h"
+#include "commands.h"
+#include "listing.h"
+#include "workpool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Params = std::vector<std::pair<const char*, double>>;
+
+struct Config {
+    std::string filter;
+    double minTime = 0.5;
+    uint64_t maxSize = 256ull << 20;
+    size_t maxFiles = 10000;
+    std::string dir = "/tmp";
+};
+
+Config config;
+
+bool selected(const char* suite, const char* name) {
+    if (config.filter.empty()) return true;
+    std::string id = std::string(suite) + "/" + name;
+    return id.find(config.filter) != std::string::npos;
+}
+
+void report(const char* suite, const char* name, const Params& params, size_t iterations,
+            double totalNs, double minNs, uint64_t bytes) {
+    double mean = totalNs / iterations;
+    printf("{\"suite\":\"%s\",\"case\":\"%s\",\"params\":{", suite, name);
+    for (size_t i = 0; i < params.size(); ++i) {
+        printf("%s\"%s\":%.15g", i ? "," : "", params[i].first, params[i].second);
+    }
+    printf("},\"iterations\":%zu,\"mean_ns\":%.1f,\"min_ns\":%.0f,\"bytes_per_op\":%llu,\"mb_per_s\":%.1f}\n",
+           iterations, mean, minNs, static_cast<unsigned long long>(bytes),
+           bytes ? bytes / (mean / 1e9) / (1 << 20) : 0.0);
+    fflush(stdout);
+}
+
+/**
+ * Run body until minTime has been spent in it, calling prepare (untimed)
+ * before every iteration, and report the mean and best iteration.
+ */
+template <typename Prepare, typename Body>
+void measure(const char* suite, const char* name, const Params& params, uint64_t bytes,
+             Prepare prepare, Body body) {
+    if (!selected(suite, name)) return;
+
+    double totalNs = 0;
+    double minNs = 0;
+    size_t iterations = 0;
+
+    while (iterations == 0 || totalNs < config.minTime * 1e9) {
+        prepare();
+        auto start = Clock::now();
+        body();
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+        totalNs += ns;
+        minNs = iterations == 0 ? ns : std::min(minNs, ns);
+        ++iterations;
+    }
+
+    report(suite, name, params, iterations, totalNs, minNs, bytes);
+}
+
+template <typename Body>
+void measure(const char* suite, const char* name, const Params& params, uint64_t bytes, Body body) {
+    measure(suite, name, params, bytes, [] {}, body);
+}
+
+/* --- Lexer and parser --- */
+
+/**
+ * A valid command line of about `bytes` bytes where roughly `density` of
+ * the tokens are operators, cycling through |, &&, ||, ; and >.
+ */
+std::string commandLine(size_t bytes, double density) {
+    static const char* ops[] = {"|", "&&", "||", ";", ">"};
+    const size_t wordsPerOp = density > 0 ? std::max<size_t>(1, static_cast<size_t>((1 - density) / density)) : SIZE_MAX;
+
+    std::string line = "cmd";
+    size_t words = 1;
+    size_t op = 0;
+    while (line.size() < bytes) {
+        if (words >= wordsPerOp) {
+            line += " ";
+            line += ops[op++ % 5];
+            line += " cmd";
+            words = 1;
+        } else {
+            line += " arg" + std::to_string(line.size() % 1000);
+            ++words;
+        }
+    }
+    return line;
+}
+
+void benchLexerParser() {
+    for (size_t bytes : {64, 1024, 16384, 262144}) {
+        for (double density : {0.0, 0.1, 0.33}) {
+            const std::string line = commandLine(bytes, density);
+            const Params params = {{"bytes", static_cast<double>(line.size())}, {"density", density}};
+
+            measure("lexer", "tokenize", params, line.size(), [&] {
+                std::vector<Token> tokens = Lexer::tokenize(line);
+                if (tokens.empty()) abort();
+            });
+
+            const std::vector<Token> tokens = Lexer::tokenize(line);
+            measure("parser", "parse", params, line.size(), [&] {
+                AST ast = Parser::parse(tokens);
+                if (ast.root() == AST::kNone) abort();
+            });
+        }
+    }
+}
+
+/* --- wc, grep and cat over generated corpora --- */
+
+bool writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Log-like text: ~70-byte lines, one in 50 an ERROR; a 1 MiB block repeated
+bool makeCorpus(const std::string& path, uint64_t size) {
+    static std::string block = [] {
+        std::string b;
+        unsigned seed = 12345;
+        for (size_t i = 0; b.size() < (1 << 20); ++i) {
+            seed = seed * 1103515245 + 12345;
+            b += "2024-01-01 12:" + std::to_string(10 + i % 50) + ":" + std::to_string(10 + seed % 50) +
+                 (i % 50 == 0 ? " ERROR" : " INFO") + " worker-" + std::to_string(seed % 64) +
+                 " request id=" + std::to_string(seed % 1000000) + " took " + std::to_string(seed % 500) + "ms\n";
+        }
+        b.resize(1 << 20);
+        b.back() = '\n';
+        return b;
+    }();
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return false;
+
+    bool ok = true;
+    for (uint64_t written = 0; ok && written < size; written += block.size()) {
+        ok = writeAll(fd, block.data(), std::min<uint64_t>(block.size(), size - written));
+    }
+    return close(fd) == 0 && ok;
+}
+
+void benchText(IOContext& io) {
+    // Generating a corpus is the slow part; skip it when no case would use it
+    bool any = false;
+    for (const char* name : {"wc", "wc-l", "grep-literal", "grep-regex", "cat"}) {
+        any = any || selected("text", name);
+    }
+    if (!any) return;
+
+    for (uint64_t size : {1ull << 20, 16ull << 20, 256ull << 20, 1ull << 30, 10ull << 30}) {
+        if (size > config.maxSize) break;
+
+        const std::string path = config.dir + "/custom-shell-bench-" + std::to_string(size >> 20) + "M.txt";
+        if (!makeCorpus(path, size)) {
+            fprintf(stderr, "bench: cannot create %s: %s\n", path.c_str(), strerror(errno));
+            return;
+        }
+        const Params params = {{"bytes", static_cast<double>(size)}};
+
+        measure("text", "wc", params, size, [&] { Commands::wcCommand({path}, io); });
+        measure("text", "wc-l", params, size, [&] { Commands::wcCommand({"-l", path}, io); });
+        measure("text", "grep-literal", params, size, [&] { Commands::grepCommand({"-c", "ERROR", path}, io); });
+        measure("text", "grep-regex", params, size, [&] { Commands::grepCommand({"-c", "id=12[0-9]*5 ", path}, io); });
+        measure("text", "cat", params, size, [&] { Commands::catCommand({path}, io); });
+
+        unlink(path.c_str());
+    }
+}
+
+/* --- ls -l, cp -r and rm -r over generated trees --- */
+
+// files spread over directories of 100 entries each, every file 100 bytes
+bool makeTree(const std::string& root, size_t files) {
+    if (mkdir(root.c_str(), 0755) == -1) return false;
+
+    const std::string content(99, 'x');
+    for (size_t d = 0; d * 100 < files; ++d) {
+        std::string dir = root + "/d" + std::to_string(d);
+        if (mkdir(dir.c_str(), 0755) == -1) return false;
+
+        for (size_t f = d * 100; f < std::min(files, (d + 1) * 100); ++f) {
+            std::string path = dir + "/f" + std::to_string(f);
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1) return false;
+            bool ok = writeAll(fd, (content + "\n").data(), 100);
+            if (close(fd) == -1 || !ok) return false;
+        }
+    }
+    return true;
+}
+
+// A flat directory, as ls -l sees it
+bool makeFlat(const std::string& root, size_t files) {
+    if (mkdir(root.c_str(), 0755) == -1) return false;
+    for (size_t f = 0; f < files; ++f) {
+        std::string path = root + "/f" + std::to_string(f);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) return false;
+        close(fd);
+    }
+    return true;
+}
+
+void removeTree(const std::string& path, IOContext& io) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        Commands::rmCommand({"-r", path}, io);
+    }
+}
+
+void benchTrees(IOContext& io) {
+    if (!selected("tree", "ls-l") && !selected("tree", "cp-r") && !selected("tree", "rm-r")) return;
+
+    const std::string base = config.dir + "/custom-shell-bench-tree";
+    const std::string copy = base + "-copy";
+
+    for (size_t files = 1000; files <= config.maxFiles; files *= 10) {
+        const Params params = {{"files", static_cast<double>(files)}, {"threads", static_cast<double>(WorkPool::defaultThreads())}};
+
+        removeTree(base, io);
+        removeTree(copy, io);
+
+        if (!makeFlat(base, files)) {
+            fprintf(stderr, "bench: cannot create %s: %s\n", base.c_str(), strerror(errno));
+            return;
+        }
+        // Measure listing itself, not the directory cache
+        DirCache::setEnabled(false);
+        measure("tree", "ls-l", params, 0, [&] { Commands::lsCommand({"-l", base}, io); });
+        DirCache::setEnabled(true);
+        removeTree(base, io);
+
+        if (!makeTree(base, files)) {
+            fprintf(stderr, "bench: cannot create %s: %s\n", base.c_str(), strerror(errno));
+            return;
+        }
+        measure("tree", "cp-r", params, files * 100,
+                [&] { removeTree(copy, io); },
+                [&] { Commands::cpCommand({"-r", base, copy}, io); });
+        measure("tree", "rm-r", params, 0,
+                [&] { if (access(copy.c_str(), F_OK) == -1) Commands::cpCommand({"-r", base, copy}, io); },
+                [&] { Commands::rmCommand({"-r", copy}, io); });
+
+        removeTree(base, io);
+        removeTree(copy, io);
+    }
+}
+
+uint64_t parseSize(const char* text) {
+    char* end = nullptr;
+    uint64_t n = strtoull(text, &end, 10);
+    switch (end ? *end : '\0') {
+        case 'k': case 'K': return n << 10;
+        case 'm': case 'M': return n << 20;
+        case 'g': case 'G': return n << 30;
+        default:            return n;
+    }
+}
+
+int usage() {
+    fprintf(stderr, "usage: custom-shell-bench [--filter S] [--min-time SEC] [--max-size N[K|M|G]] "
+                    "[--max-files N] [--dir D]\n");
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return usage();
+        const char* value = argv[++i];
+
+        if (arg == "--filter") config.filter = value;
+        else if (arg == "--min-time") config.minTime = atof(value);
+        else if (arg == "--max-size") config.maxSize = parseSize(value);
+        else if (arg == "--max-files") config.maxFiles = strtoul(value, nullptr, 10);
+        else if (arg == "--dir") config.dir = value;
+        else return usage();
+    }
+
+    // Commands write here; only their cost is of interest
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devNull == -1) {
+        perror("bench: /dev/null");
+        return 1;
+    }
+    OutputSink sink(devNull);
+    IOContext io;
+    io.out = &sink;
+
+    benchLexerParser();
+    benchText(io);
+    benchTrees(io);
+
+    sink.flush();
+    close(devNull);
+    return 0;
+}
@@ -1,9 +1,16 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
-#include <memory>
+#include <cstdint>
 #include <ostream> 
 
+/**
+ * A parsed command line stored flat: nodes live in one vector and refer to
+ * each other by index, and every word of every command is packed into one
+ * character buffer. A parse therefore costs a handful of allocations, and
+ * dropping the AST frees all of it at once.
+ */
 class AST {
 public:
     enum class NodeType {
@@ -11,19 +18,81 @@ public:
         Operator
     };
 
-    NodeType node{};
+    // Resolved by the parser so the executor never compares operator strings
+    enum class OpType {
+        Pipe,
+        RedirectOut,
+        RedirectIn,
+        Append,
+        And,
+        Or,
+        Seq,
+        Background
+    };
+
+    using NodeId = uint32_t;
+
+    // Right child of a trailing "&"
+    static constexpr NodeId kNone = UINT32_MAX;
+
+    struct Node {
+        NodeType type;
+        OpType op;
+
+        // Operator: left and right child. Command: first word and word count,
+        // where the first word is the command name
+        uint32_t first;
+        uint32_t second;
+    };
+
+    // Build with room for about `tokens` tokens and `chars` bytes of words
+    void reserve(size_t tokens, size_t chars);
+
+    uint32_t addWord(std::string_view word);
+    NodeId addCommand(uint32_t firstWord, uint32_t wordCount);
+    NodeId addOperator(OpType op, NodeId lhs, NodeId rhs);
+
+    void setRoot(NodeId id) { root_ = id; }
+    NodeId root() const { return root_; }
 
-    std::string command;
-    std::vector<std::string> args;
+    const Node& node(NodeId id) const { return nodes_[id]; }
+    NodeType type(NodeId id) const { return nodes_[id].type; }
+    OpType op(NodeId id) const { return nodes_[id].op; }
+    NodeId left(NodeId id) const { return nodes_[id].first; }
+    NodeId right(NodeId id) const { return nodes_[id].second; }
 
-    std::string op;
-    std::unique_ptr<AST> left;
-    std::unique_ptr<AST> right;
+    std::string_view command(NodeId id) const { return word(nodes_[id].first); }
+    size_t argCount(NodeId id) const { return nodes_[id].second - 1; }
+    std::string_view arg(NodeId id, size_t i) const { return word(nodes_[id].first + 1 + i); }
 
-    static AST makeCommandNode(std::string cmd, std::vector<std::string> arguments);
-    static AST makeOperatorNode(const std::string& op, AST lhs, AST rhs);
-    void print(std::ostream& os, int indent = 0);
+    // Copy a command's arguments out as owned strings, for builtins
+    std::vector<std::string> args(NodeId id) const;
+
+    size_t size() const { return nodes_.size(); }
+
+    static const char* opSymbol(OpType op);
+    void print(std::ostream& os) const;
+
+    // Single-line source form of a subtree, e.g. for the job table
+    std::string text(NodeId id) const;
+
+    // Flat binary form for caching parsed scripts; deserialize validates every index
+    void serialize(std::string& out) const;
+    static bool deserialize(std::string_view& in, AST& out);
 
 private:
-    void indent(std::ostream& os, int n);
+    struct Word {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    std::string_view word(uint32_t i) const { return std::string_view(text_.data() + words_[i].offset, words_[i].length); }
+
+    void print(std::ostream& os, NodeId id, int indent) const;
+    static void indent(std::ostream& os, int n);
+
+    std::vector<Node> nodes_;
+    std::vector<Word> words_;
+    std::string text_;
+    NodeId root_ = 0;
 };
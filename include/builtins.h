@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include "commands.h"
+#include "stream.h"
+
+/**
+ * Name -> handler lookup for builtin commands.
+ *
+ * The core builtins live in a table whose perfect hash is generated at
+ * compile time (see builtins.cpp), so a lookup costs one hash of the name
+ * and a single string comparison. Commands added at runtime through add()
+ * (plugins, optional features) are consulted only when that misses.
+ */
+class Builtins {
+public:
+    using Handler = CommandResult (*)(const std::vector<std::string>& args, IOContext& io);
+
+    Builtins() = delete;
+
+    // Handler for name, or nullptr when it is not a builtin
+    static Handler find(std::string_view name);
+
+    // Register an extra builtin; false if the name is already taken
+    static bool add(const std::string& name, Handler handler);
+};
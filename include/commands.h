@@ -1,44 +1,59 @@
 #pragma once
 #include <vector>
 #include <string>
-#include <regex>
+#include <string_view>
+#include <functional>
+#include "stream.h"
+
+struct GrepScan;
 
 struct CommandResult {
     int status;
     std::string output;
     std::string error;
+    bool noNewline = false; // emit output as-is, without the trailing newline
 };
 
 class Commands {
 public:
     Commands() = delete;
 
-    static CommandResult helpCommand(const std::vector<std::string>& args);
-    static CommandResult echoCommand(const std::vector<std::string>& args);
-    static CommandResult pauseCommand(const std::vector<std::string>& args);
-    static CommandResult lsCommand(const std::vector<std::string>& args);
-    static CommandResult dirCommand(const std::vector<std::string>& args);
-    static CommandResult cdCommand(const std::vector<std::string>& args);
-    static CommandResult pwdCommand(const std::vector<std::string>& args);
-    static CommandResult clrCommand(const std::vector<std::string>& args);
-    static CommandResult quitCommand(const std::vector<std::string>& args);
-    static CommandResult environCommand(const std::vector<std::string>& args);
-    static CommandResult catCommand(const std::vector<std::string>& args);
-    static CommandResult wcCommand(const std::vector<std::string>& args);
-    static CommandResult mkdirCommand(const std::vector<std::string>& args);
-    static CommandResult rmCommand(const std::vector<std::string>& args);
-    static CommandResult rmdirCommand(const std::vector<std::string>& args);
-    static CommandResult touchCommand(const std::vector<std::string>& args);
-    static CommandResult cpCommand(const std::vector<std::string>& args);
-    static CommandResult chownCommand(const std::vector<std::string>& args);
-    static CommandResult grepCommand(const std::vector<std::string>& args);
-    static CommandResult mvCommand(const std::vector<std::string>& args);
-    static CommandResult chmodCommand(const std::vector<std::string>& args);
+    static CommandResult helpCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult echoCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult pauseCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult lsCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult dirCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult cdCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult pwdCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult clrCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult quitCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult environCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult catCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult wcCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult mkdirCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult rmCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult rmdirCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult touchCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult cpCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult chownCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult grepCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult mvCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult chmodCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult cacheCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult jobsCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult waitCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult fgCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult hashCommand(const std::vector<std::string>& args, IOContext& io);
+    static CommandResult findCommand(const std::vector<std::string>& args, IOContext& io);
     
 private:
-    static std::string formatLsLongListing(const std::string& name, const struct stat& info);
     static std::string formatRmdirErrorMsg(const std::string& path);
-    static bool matchesPattern(const std::string& line, const std::regex& re, bool printOnlyMatch, std::string& outMatch);
+    static void scanRegion(const char* p, const char* end, GrepScan& scan);
+    static void reportLine(std::string_view line, size_t matchStart, size_t matchLen, GrepScan& scan);
+    static bool scanInput(InputSource& src, GrepScan& scan, OutputSink& out);
+    static void flushGrepOutput(GrepScan& scan, OutputSink& out);
+    static std::string grepParallel(const std::function<bool(std::string&)>& nextFile, bool multipleFiles,
+                                    GrepScan& scan, size_t threads, OutputSink& out);
     static std::string stripTrailingNewline(const std::string& s);
-    static bool isFileEmpty(const std::string& filename);
+    static bool parseJobSpec(const std::string& spec, int& id);
 }; 
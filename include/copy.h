@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+ * File copy engine shared by cp and mv.
+ *
+ * Each copy tries the cheapest mechanism first and falls through on
+ * "not supported" errors:
+ *   1. reflink (FICLONE), sharing extents on CoW filesystems
+ *   2. copy_file_range, copying inside the kernel
+ *   3. sendfile
+ *   4. a pread/pwrite loop with a large buffer (CUSTOM_SHELL_COPY_BUFFER bytes,
+ *      default 1 MiB)
+ * Sparse sources are copied extent by extent (SEEK_DATA/SEEK_HOLE) so holes
+ * stay holes; dense destinations are preallocated with fallocate.
+ */
+class CopyEngine {
+public:
+    CopyEngine() = delete;
+
+    enum class Status {
+        Ok,
+        OpenSourceFailed,
+        CreateDestFailed,
+        ReadFailed,
+        WriteFailed,
+        SameFile
+    };
+
+    static constexpr size_t kDefaultBufferSize = 1 << 20;
+
+    // errno is left describing the failure whenever the result is not Ok
+    static Status copyFile(const std::string& src, const std::string& dest, mode_t mode = 0644);
+    static Status copyFile(int srcFd, const std::string& dest, mode_t mode = 0644);
+    static Status copyFd(int srcFd, int destFd, const struct stat& srcInfo);
+
+    /**
+     * Recursively copy the directory src to dest (created if missing) with a
+     * TreeWalker of `threads` workers (0 = one per core). Directories are
+     * created before their children are scheduled; files are copied with copyFd.
+     * Symlinks are recreated, not followed. Returns one message per failure.
+     */
+    static std::vector<std::string> copyTree(const std::string& src, const std::string& dest, size_t threads = 0);
+
+    static size_t bufferSize();
+
+private:
+    // In-kernel paths still worth trying for the current file
+    enum class Method {
+        CopyFileRange,
+        Sendfile,
+        Buffered
+    };
+
+    static Status copyRange(int srcFd, int destFd, off_t& offset, off_t length, Method& method);
+    static Status copyStream(int srcFd, int destFd);
+    static Status copyBuffered(int srcFd, int destFd, off_t& offset, off_t length);
+};
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+
+/**
+ * Line/word counting kernels used by wc.
+ *
+ * Vectorised implementations (AVX2, SSE2) are picked once at startup from
+ * what the CPU supports, with a scalar fallback for everything else.
+ * CUSTOM_SHELL_SIMD=scalar|sse2|avx2 forces a particular kernel.
+ *
+ * Words are maximal runs of bytes other than ' ', '\t', '\n' and '\r'.
+ */
+class CountKernel {
+public:
+    CountKernel() = delete;
+
+    // Number of '\n' bytes in data
+    static size_t countLines(const char* data, size_t len);
+
+    /**
+     * Add the newlines and word starts in data to lines/words.
+     * inWord carries word state across chunks: pass false before the first
+     * chunk and the same variable for every following one.
+     */
+    static void countLinesWords(const char* data, size_t len, size_t& lines, size_t& words, bool& inWord);
+
+    // Name of the kernel in use ("avx2", "sse2" or "scalar")
+    static const char* name();
+};
@@ -1,32 +1,43 @@
 #pragma once
 #include "ast.h"
 #include "commands.h"
+#include "stream.h"
+#include <string>
+#include <string_view>
+#include <vector>
 
 class Executor {
 public:
     Executor() = delete;
 
-    static CommandResult executeCommand(const AST& node);
+    static CommandResult executeCommand(const AST& ast, IOContext& io);
 
 private:
-    static CommandResult execute(const AST& node);
-    static CommandResult runCommand(const AST& node);
+    static CommandResult execute(const AST& ast, AST::NodeId id, IOContext& io);
+    static CommandResult runCommand(const AST& ast, AST::NodeId id, IOContext& io);
+    static CommandResult runSimple(std::string_view name, const std::vector<std::string>& args, IOContext& io);
+    static CommandResult runTimed(const std::vector<std::string>& args, IOContext& io);
+    static void emit(CommandResult& result, IOContext& io);
+    static void collectPipeStages(const AST& ast, AST::NodeId id, std::vector<AST::NodeId>& stages);
 
-   /**
-     * TODO:
-     * The following operators are intentionally left unimplemented and are
-     * provided as placeholders for future work.
-     *
-     * Supporting these features requires a broader redesign of the shell's
-     * execution model so that all commands share consistent semantics for 
-     * stdin/stdout, process creation, and control flow.
+    /**
+     * Runs every stage of a pipeline concurrently, each on its own thread,
+     * connected by pipe(2) so memory stays bounded by the kernel pipe buffer.
      */
-    static CommandResult handlePipe(const AST& node);
-    static CommandResult handleRedirectOut(const AST& node);
-    static CommandResult handleRedirectIn(const AST& node);
-    static CommandResult handleAppend(const AST& node);
-    static CommandResult handleAnd(const AST& node);
-    static CommandResult handleOr(const AST& node);
-    static CommandResult handleSeq(const AST& node);
-    static CommandResult handleBackground(const AST& node);
+    static CommandResult handlePipe(const AST& ast, AST::NodeId id, IOContext& io);
+
+    // "&&", "||" and ";", evaluated iteratively with short-circuiting
+    static CommandResult handleList(const AST& ast, AST::NodeId id, IOContext& io);
+    static bool isListOp(AST::OpType op);
+    static int runListItem(const AST& ast, AST::NodeId id, IOContext& io);
+    static void reportError(const std::string& error, IOContext& io);
+
+    // Redirections hand the opened file to the command as its sink or input
+    static CommandResult handleRedirectOut(const AST& ast, AST::NodeId id, IOContext& io);
+    static CommandResult handleRedirectIn(const AST& ast, AST::NodeId id, IOContext& io);
+    static CommandResult handleAppend(const AST& ast, AST::NodeId id, IOContext& io);
+    static CommandResult redirectOutput(const AST& ast, AST::NodeId id, IOContext& io, int flags);
+    static CommandResult redirectTarget(const AST& ast, AST::NodeId id, std::string& path);
+
+    static CommandResult handleBackground(const AST& ast, AST::NodeId id, IOContext& io);
 };
@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include "commands.h"
+#include "stream.h"
+
+/**
+ * PATH lookups for external commands, cached like bash's "hash".
+ *
+ * The cache is dropped when $PATH changes. Each hit also re-stats the PATH
+ * directories up to the one holding the command, and drops the cache if
+ * any of their mtimes moved (a binary was added, removed or renamed there).
+ */
+class PathCache {
+public:
+    struct Entry {
+        std::string name;
+        std::string path;
+        size_t hits;
+    };
+
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t invalidations = 0;
+        size_t size = 0;
+    };
+
+    PathCache() = delete;
+
+    // Full path of an executable called name on $PATH, or "" if there is none
+    static std::string lookup(const std::string& name);
+
+    static std::vector<Entry> entries();
+    static Stats stats();
+    static void clear();
+};
+
+/**
+ * Runs programs that are not builtins, via posix_spawn (which glibc
+ * implements with CLONE_VFORK, so launch cost does not grow with the
+ * shell's heap). The command's stdin/stdout are wired to the IOContext.
+ */
+class ExternalCommand {
+public:
+    ExternalCommand() = delete;
+
+    // Returns the program's exit status (128 + signal if killed, 127 if not found)
+    static CommandResult run(std::string_view name, const std::vector<std::string>& args, IOContext& io);
+};
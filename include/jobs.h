@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+/**
+ * Background jobs started with "&".
+ *
+ * Each job is a forked copy of the shell running one command line. SIGCHLD
+ * is blocked and delivered through a non-blocking signalfd instead, so
+ * finished jobs are reaped by polling that descriptor between commands: a
+ * job is only waitpid()ed (with WNOHANG) after a SIGCHLD has been seen,
+ * and the shell never blocks on a job unless "wait" or "fg" asks it to.
+ */
+class JobTable {
+public:
+    struct Job {
+        int id;
+        pid_t pid;
+        std::string command;
+        bool done = false;
+        int status = 0;
+    };
+
+    JobTable() = delete;
+
+    // Block SIGCHLD and open the signalfd; call before any thread is started
+    static void init();
+
+    // In a freshly forked job: restore the signal mask and drop the signalfd
+    static void prepareChild();
+
+    // Track a started job; returns its job number
+    static int add(pid_t pid, std::string command);
+
+    // Collect finished jobs without blocking
+    static void reap();
+
+    // Snapshot of every job, reaping first
+    static std::vector<Job> list();
+
+    // "[N] Done ..." lines for jobs that finished since the last call; they are forgotten afterwards
+    static std::string takeFinished();
+
+    // Block until job id finishes, forget it and return true with its status; false if there is no such job
+    static bool wait(int id, int& status);
+
+    // Number of the most recently started job still tracked, or -1
+    static int mostRecent();
+
+    // "Running", "Done" or "Exit N" for a job
+    static std::string describe(const Job& job);
+};
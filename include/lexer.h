@@ -1,5 +1,5 @@
 #pragma once
-#include <string>
+#include <string_view>
 #include <vector>
 #include "token.h"
 
@@ -7,8 +7,6 @@ class Lexer {
 public:
     Lexer() = delete;
 
-    static std::vector<Token> tokenize(const std::string& input);
-
-private:
-    static void flushCurrent(std::vector<Token>& tokens, std::string& current);
+    // Tokens are slices of input; nothing is copied
+    static std::vector<Token> tokenize(std::string_view input);
 };
@@ -0,0 +1,158 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <ctime>
+#include <sys/types.h>
+#include "stream.h"
+
+/**
+ * Entries of one directory, in the order the kernel returned them. Names
+ * live back to back in a single buffer (each followed by a '\0', so
+ * name(i).data() can be handed to the *at() calls).
+ */
+struct DirListing {
+    struct Entry {
+        uint32_t nameOffset;
+        uint16_t nameLen;
+        unsigned char type; // DT_* from the directory entry, DT_UNKNOWN if not supplied
+        ino_t ino;
+    };
+
+    std::vector<char> names;
+    std::vector<Entry> entries;
+
+    std::string_view name(size_t i) const {
+        return std::string_view(names.data() + entries[i].nameOffset, entries[i].nameLen);
+    }
+
+    size_t size() const { return entries.size(); }
+    void clear();
+};
+
+/**
+ * Reads a whole directory. getdents64 is called directly with a 256 KiB
+ * buffer so large directories take a handful of syscalls;
+ * CUSTOM_SHELL_GETDENTS=0 falls back to readdir(3).
+ */
+class DirReader {
+public:
+    DirReader() = delete;
+
+    // false on error (errno set); dirFd is left open and positioned at the end
+    static bool read(int dirFd, DirListing& out);
+};
+
+/**
+ * The subset of file metadata ls needs, fetched with one dirfd-relative
+ * statx (fstatat where statx is unavailable). Symlinks are followed, like stat(2).
+ */
+struct FileMeta {
+    mode_t mode = 0;
+    nlink_t nlink = 0;
+    uid_t uid = 0;
+    gid_t gid = 0;
+    off_t size = 0;
+    time_t mtime = 0;
+
+    // false on error (errno set)
+    static bool at(int dirFd, const char* name, FileMeta& out);
+};
+
+/**
+ * Session-wide uid -> user name and gid -> group name caches, so a long
+ * listing does one getpwuid/getgrgid per distinct owner instead of per file.
+ * Unknown ids are cached as their decimal form.
+ */
+class IdNameCache {
+public:
+    IdNameCache() = delete;
+
+    static std::string_view user(uid_t uid);
+    static std::string_view group(gid_t gid);
+};
+
+/**
+ * Formats "ls -l" lines straight into a TextArena. The mtime column is
+ * reformatted only when the minute changes between consecutive entries.
+ */
+class LongFormatter {
+public:
+    void append(TextArena& out, const FileMeta& meta, std::string_view name);
+
+private:
+    time_t cachedMinute_ = -1;
+    char timeText_[32] = {};
+    size_t timeLen_ = 0;
+};
+
+/**
+ * Session-wide LRU cache of directory listings keyed by (dev, ino), so
+ * listing an unchanged directory again costs an fstat instead of a scan.
+ *
+ * An entry is dropped when the directory's mtime moves, or when an inotify
+ * watch on it reports an entry being created, deleted or renamed (which
+ * also covers filesystems with coarse timestamps). Capacity is 64
+ * directories; CUSTOM_SHELL_DIR_CACHE=0 (or "cache dir off") disables it.
+ */
+class DirCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t invalidations = 0;
+        size_t evictions = 0;
+        size_t size = 0;
+        size_t capacity = 0;
+        bool enabled = true;
+    };
+
+    DirCache() = delete;
+
+    // Listing of the open directory dirFd, or nullptr on error (errno set)
+    static std::shared_ptr<const DirListing> get(int dirFd);
+
+    static void setEnabled(bool enabled);
+    static Stats stats();
+
+    // Drop every entry (and watch) and reset the counters
+    static void clear();
+};
+
+/**
+ * Sorting and column layout for ls. A directory is ordered through an
+ * array of fixed-size records pointing into the listing's flat name
+ * buffer, so neither step allocates per entry.
+ */
+class ListingLayout {
+public:
+    enum class Order {
+        Name,  // byte order, locale-free
+        Mtime, // newest first (-t)
+        Size   // largest first (-S)
+    };
+
+    struct Record {
+        uint64_t key;    // primary sort key for Mtime/Size, 0 for Name
+        uint64_t prefix; // first 8 name bytes, big-endian, zero-padded
+        uint32_t nameOffset;
+        uint16_t nameLen;
+        uint32_t entry;  // caller's index (e.g. into a FileMeta array)
+    };
+
+    ListingLayout() = delete;
+
+    static Record record(const DirListing& listing, size_t i, uint64_t key, uint32_t entry);
+
+    // Keys for Mtime/Size that sort descending under an ascending compare
+    static uint64_t newestFirst(time_t mtime);
+    static uint64_t largestFirst(off_t size);
+
+    // Sort by key, then by name; ties in Mtime/Size fall back to name order
+    static void sort(std::vector<Record>& records, const char* names);
+
+    // GNU-style "ls -C": names run down then across, columns fit in width
+    static void columns(TextArena& out, const std::vector<Record>& records, const char* names, size_t width);
+};
@@ -0,0 +1,107 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <regex>
+#include <cstddef>
+#include <memory>
+
+/**
+ * Boyer-Moore-Horspool substring search, optionally ASCII case-folded.
+ * Single-byte needles use memchr.
+ */
+class LiteralSearcher {
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    LiteralSearcher() = default;
+    LiteralSearcher(const std::string& needle, bool foldCase);
+
+    // Offset of the first occurrence in [data, data + len), or npos
+    size_t find(const char* data, size_t len) const;
+
+    size_t size() const { return needle_.size(); }
+    bool empty() const { return needle_.empty(); }
+
+private:
+    bool equalAt(const char* data) const;
+
+    std::string needle_;
+    bool foldCase_ = false;
+    size_t shift_[256] = {};
+};
+
+/**
+ * Line matcher used by grep.
+ *
+ * The pattern is analysed once so that std::regex only runs where it has to:
+ *  - Literal:     no metacharacters; matched entirely by LiteralSearcher
+ *  - AnchoredStart/AnchoredEnd/Exact: "^lit", "lit$", "^lit$"; compared in place
+ *  - Prefiltered: a literal every match must contain (a literal prefix, or the
+ *                 whole pattern under -w); lines without it are never handed to
+ *                 the regex engine
+ *  - Regex:       everything else
+ */
+class Matcher {
+public:
+    static constexpr size_t npos = LiteralSearcher::npos;
+
+    enum class Kind {
+        Literal,
+        AnchoredStart,
+        AnchoredEnd,
+        Exact,
+        Prefiltered,
+        Regex
+    };
+
+    // Throws std::regex_error when the pattern does not compile
+    Matcher(const std::string& pattern, bool ignoreCase, bool wholeWord);
+
+    /**
+     * Offset of the first byte in [data, data + len) that may belong to a
+     * matching line, or npos when no line in the range can match. Kinds
+     * without a searchable literal always return 0.
+     */
+    size_t findCandidate(const char* data, size_t len) const;
+
+    // Decide one line (without its newline); reports the first match for -o
+    bool matchLine(std::string_view line, size_t& matchStart, size_t& matchLen) const;
+
+    Kind kind() const { return kind_; }
+
+private:
+    bool equalsLiteral(const char* data, size_t len) const;
+
+    Kind kind_ = Kind::Regex;
+    bool ignoreCase_ = false;
+    std::string literal_;
+    LiteralSearcher searcher_;
+    std::regex re_;
+};
+
+/**
+ * Session-wide LRU cache of compiled matchers keyed by (pattern, flags), so
+ * repeated greps skip std::regex construction. Invalid patterns are never
+ * cached. Capacity defaults to 64 entries; CUSTOM_SHELL_REGEX_CACHE=N
+ * overrides it (0 disables caching).
+ */
+class MatcherCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t size = 0;
+        size_t capacity = 0;
+    };
+
+    MatcherCache() = delete;
+
+    // Throws std::regex_error when the pattern does not compile
+    static std::shared_ptr<const Matcher> get(const std::string& pattern, bool ignoreCase, bool wholeWord);
+
+    static Stats stats();
+
+    // Drop every entry and reset the counters
+    static void clear();
+};
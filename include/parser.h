@@ -21,12 +21,17 @@
  * <END_OF_INPUT> ::= EOF token
  * 
  * Operator Precedence:
- * 4  ">", ">>", "<"
- * 3  "|"
- * 2  "&&"
- * 1  "||"
- * 0  ";", "&"
- * - All operators are left-associative e.g. a | b | c ::= (a | b) | c
+ * 5  ">", ">>", "<"
+ * 4  "|"
+ * 3  "&&"
+ * 2  "||"
+ * 1  "&"
+ * 0  ";"
+ * - Operators are left-associative e.g. a | b | c ::= (a | b) | c, except "&":
+ *   a & b & c ::= a & (b & c), i.e. start a, then run "b & c"
+ * - "&" binds tighter than ";" so that "a; b &" only puts b in the background
+ * - ";" and "&" may end the line: "a;" is just a, "a &" has no right-hand side
+ * - Operator, precedence and associativity come from a constexpr table indexed by TokenType
 */
 
 class Parser {
@@ -34,9 +39,8 @@ public:
     static AST parse(const std::vector<Token>& tokens);
 
 private:
-    static AST parseCmdLine(int& index, const std::vector<Token>& tokens);
-    static AST parseOpExpr(AST lhs, int min_prec, int& index, const std::vector<Token>& tokens);
-    static AST parseCmdAtomic(int& index, const std::vector<Token>& tokens);
+    static AST::NodeId parseCmdLine(AST& tree, int& index, const std::vector<Token>& tokens);
+    static AST::NodeId parseOpExpr(AST& tree, AST::NodeId lhs, int min_prec, int& index, const std::vector<Token>& tokens);
+    static AST::NodeId parseCmdAtomic(AST& tree, int& index, const std::vector<Token>& tokens);
     static bool isOperator(const Token& tok);
-    static int precedence(const std::string& op);
 };
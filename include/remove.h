@@ -0,0 +1,20 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/**
+ * Recursive remover used by rm -r.
+ *
+ * Drives a TreeWalker: entries other than directories are unlinked
+ * (unlinkat, relative to their directory's fd) as they are visited, and
+ * each directory is removed when the walker leaves it, by whichever worker
+ * finished its last child, so no thread ever waits on another.
+ */
+class TreeRemover {
+public:
+    TreeRemover() = delete;
+
+    // Remove the directory tree at path. Returns one message per failure
+    static std::vector<std::string> removeTree(const std::string& path, size_t threads = 0);
+};
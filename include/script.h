@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include "ast.h"
+
+/**
+ * Non-interactive execution: "custom-shell script.sh" and "custom-shell -c".
+ *
+ * The whole script is lexed and parsed before anything runs, into one plan
+ * per command line, so a syntax error anywhere stops the script before its
+ * first command. Blank lines and lines starting with '#' are skipped.
+ *
+ * When CUSTOM_SHELL_PLAN_CACHE names a directory, the parsed plans of a
+ * script file are stored there keyed by a hash of its contents, and later
+ * runs of the same script load them instead of parsing again.
+ */
+class Script {
+public:
+    struct Plan {
+        uint32_t line;
+        AST ast;
+    };
+
+    Script() = delete;
+
+    // Exit status of the last command, or 2 on a syntax error / 127 if unreadable
+    static int runFile(const std::string& path);
+    static int runString(std::string_view text, const std::string& name);
+
+    // Execute one parsed command line against stdout/stderr; returns its status
+    static int runPlan(const AST& ast);
+
+    // Print to stderr after flushing pending stdout, keeping the two in order
+    static void reportError(const std::string& message);
+
+private:
+    static bool parseAll(std::string_view text, const std::string& name, std::vector<Plan>& plans);
+    static int runAll(const std::vector<Plan>& plans);
+
+    static std::string cachePath(const char* dir, uint64_t hash);
+    static bool loadCache(const std::string& path, uint64_t hash, size_t size, std::vector<Plan>& plans);
+    static void storeCache(const std::string& path, uint64_t hash, size_t size, const std::vector<Plan>& plans);
+};
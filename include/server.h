@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+
+/**
+ * Resident server mode: "custom-shell --serve <socket>" and its thin client,
+ * "custom-shell --connect <socket> -c <commands>".
+ *
+ * The client sends its working directory, environment and command text and
+ * hands over its stdin, stdout and stderr with SCM_RIGHTS, so the server
+ * writes straight to the client's descriptors and nothing is relayed; once
+ * the command line has finished the server answers with its exit status.
+ *
+ * Every connection runs on its own thread, which unshare(CLONE_FS)s so that
+ * cd only moves that request, under a Session carrying the client's streams
+ * and environment. Compiled regexes, PATH lookups, owner names and directory
+ * listings stay warm from one request to the next. Background jobs ("&")
+ * are refused, since the server cannot be forked safely.
+ *
+ * Request: u32 magic, u32 payload length (with the three descriptors
+ * attached), then the payload: cwd '\0' commands '\0' ("NAME=value" '\0')...
+ * Reply: i32 exit status.
+ */
+class Server {
+public:
+    Server() = delete;
+
+    // Accept requests on socketPath until killed; returns only if it cannot listen
+    static int serve(const std::string& socketPath);
+
+    // Run commands on the server at socketPath; -1 if no server answers there
+    static int connect(const std::string& socketPath, const std::string& commands);
+
+private:
+    static void handle(int conn);
+};
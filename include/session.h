@@ -0,0 +1,55 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+class OutputSink;
+
+/**
+ * Standard streams and environment of the command line running on this
+ * thread.
+ *
+ * Interactive and script modes never install one and use the process's own
+ * descriptors and environ. In server mode (see server.h) every request
+ * thread installs the client's stdin/stdout/stderr and environment, and
+ * pipeline stage threads inherit the session of the thread that started
+ * them, so builtins, error messages and spawned programs all talk to the
+ * client. Lookups fall back to the process when no session is active.
+ */
+struct Session {
+    int in = STDIN_FILENO;
+    int err = STDERR_FILENO;
+    OutputSink* out = nullptr;    // becomes OutputSink::standardOutput() on this thread
+    std::vector<std::string> env; // "NAME=value" entries
+    bool quit = false;            // "quit" ends the request, not the server
+
+    // Installs a session on the current thread for the scope's lifetime
+    class Scope {
+    public:
+        explicit Scope(Session* session);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Session* previous_;
+    };
+
+    static Session* current();
+
+    // Like getenv(3), against the session's environment when there is one
+    static const char* getenv(const char* name);
+
+    // A null-terminated envp for posix_spawn and "environ"
+    static char** environment();
+
+    // Write "message\n" to the session's (or the process's) stderr
+    static void writeError(const std::string& message);
+
+    // Read up to a newline from the session's (or the process's) stdin
+    static void waitForNewline();
+
+private:
+    std::vector<char*> envp_;
+};
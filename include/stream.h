@@ -0,0 +1,197 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <sys/types.h>
+
+/**
+ * Buffered writer over a file descriptor.
+ *
+ * Builtins write their output here instead of accumulating it in
+ * CommandResult::output, so data moves between pipeline stages in bounded
+ * chunks. Once the reading side goes away (EPIPE) the sink is marked broken
+ * and every further write returns false so producers can stop early.
+ */
+class OutputSink {
+public:
+    static constexpr size_t kDefaultCapacity = 64 * 1024;
+
+    explicit OutputSink(int fd, size_t capacity = kDefaultCapacity);
+    ~OutputSink();
+
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    bool write(const char* data, size_t len);
+    bool write(const std::string& s);
+    bool put(char c);
+    bool flush();
+
+    /**
+     * Copy everything readable from inFd straight into the sink's descriptor,
+     * letting the kernel move the data (copy_file_range, splice or sendfile)
+     * and only falling back to a read/write loop when none of them applies.
+     * Returns the number of bytes copied, or -1 on a read error (errno set).
+     */
+    ssize_t copyFrom(int inFd);
+
+    /**
+     * Whether inFd is the regular file this sink writes to and holds data
+     * at or past offset (inFd's current offset when -1). Copying or
+     * filtering such an input into the sink can read back its own output
+     * and never reach the end, so cat and grep refuse it, as GNU's do.
+     */
+    bool feedsBack(int inFd, off_t offset = -1) const;
+
+    int fd() const { return fd_; }
+    bool broken() const { return broken_; }
+
+    /**
+     * The session-wide buffered sink over fd 1. It is only flushed at
+     * explicit points (before a prompt or a blocking read, before anything
+     * else writes to the terminal, on exit) or when its buffer fills, so
+     * output redirected to a file or pipe is written in large blocks.
+     */
+    static OutputSink& standardOutput();
+
+private:
+    bool writeAll(const char* data, size_t len);
+    ssize_t copyBuffered(int inFd, ssize_t copied);
+
+    int fd_;
+    std::vector<char> buffer_;
+    size_t used_ = 0;
+    bool broken_ = false;
+};
+
+/**
+ * Growable byte arena for output assembled from many small pieces.
+ * Grows geometrically and is never shrunk, so once warmed up, formatting a
+ * line costs a few memcpys; numbers are formatted in place.
+ */
+class TextArena {
+public:
+    void append(const char* data, size_t len);
+    void append(std::string_view s) { append(s.data(), s.size()); }
+    void put(char c);
+    void appendNumber(unsigned long long value);
+
+    const char* data() const { return buffer_.data(); }
+    size_t size() const { return used_; }
+    bool empty() const { return used_ == 0; }
+    void clear() { used_ = 0; }
+
+private:
+    char* reserve(size_t n);
+
+    std::vector<char> buffer_;
+    size_t used_ = 0;
+};
+
+/**
+ * Read-only mapping of a regular file from some offset to its end, with
+ * MADV_SEQUENTIAL and, for files of at least kHugePageMin bytes,
+ * MADV_HUGEPAGE. Move-only; unmapped on destruction.
+ */
+class MappedFile {
+public:
+    static constexpr size_t kHugePageMin = 2 * 1024 * 1024;
+
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    // false if fd is not a regular file, has nothing past offset, or mmap fails (errno set)
+    bool map(int fd, off_t offset = 0);
+
+    std::string_view view() const { return std::string_view(data_, size_); }
+    bool mapped() const { return base_ != nullptr; }
+
+    void reset();
+
+private:
+    void* base_ = nullptr;
+    size_t length_ = 0;      // of the whole mapping, from a page-aligned offset
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+/**
+ * The input layer shared by cat, wc, grep, cp and mv.
+ *
+ * Regular files holding at least mapThreshold() bytes past the current
+ * offset are mapped (see MappedFile) and handed out in windows; pipes,
+ * terminals, special files and small files are read into a large buffer
+ * that is recycled per thread. Either way the descriptor's offset ends up
+ * just past whatever was consumed, as if it had been read.
+ *
+ * CUSTOM_SHELL_MMAP_THRESHOLD=N sets the mapping threshold in bytes
+ * ("off" never maps); the default is 64 KiB.
+ */
+class InputSource {
+public:
+    static constexpr size_t kDefaultChunk = 256 * 1024;
+
+    // chunk: read size, and the window size over a mapped file
+    explicit InputSource(int fd, size_t chunk = kDefaultChunk);
+
+    /**
+     * Start with bytes already read from fd (see FileQueue), then continue
+     * from fd's offset; complete says preloaded is all there is. Only maps
+     * when nothing was preloaded.
+     */
+    InputSource(int fd, std::string_view preloaded, bool complete, size_t chunk = kDefaultChunk);
+    ~InputSource();
+
+    InputSource(const InputSource&) = delete;
+    InputSource& operator=(const InputSource&) = delete;
+
+    /**
+     * Next chunk of input: empty at EOF, false on error (errno set). The
+     * view stays valid until the next call.
+     */
+    bool next(std::string_view& chunk);
+
+    /**
+     * Like next(), but every chunk except the last ends with '\n'. A line
+     * longer than the buffer grows it rather than being split.
+     */
+    bool nextLines(std::string_view& chunk);
+
+    // Mirrors read(2) over next(): bytes available, 0 at EOF, -1 on error
+    ssize_t read(const char*& data);
+
+    bool mapped() const { return map_.mapped(); }
+
+    static size_t mapThreshold();
+
+private:
+    void mapIfLarge();
+    void acquireBuffer();
+
+    int fd_;
+    size_t chunk_;
+
+    MappedFile map_;
+    off_t mapOffset_ = 0; // file offset of map_.view().data()
+    size_t mapPos_ = 0;
+
+    std::vector<char> buffer_;
+    size_t begin_ = 0; // unconsumed bytes are buffer_[begin_, end_)
+    size_t end_ = 0;
+    bool eof_ = false;
+};
+
+/**
+ * Streams handed to every builtin.
+ *  - in:  fd to read from when no file operands are given, or -1 when the
+ *         command is not fed by a pipe/redirection
+ *  - out: sink for the command's output
+ */
+struct IOContext {
+    int in = -1;
+    OutputSink* out = nullptr;
+};
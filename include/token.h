@@ -1,5 +1,5 @@
 #pragma once
-#include <string>
+#include <string_view>
 
 enum class TokenType {
     WORD,           
@@ -15,7 +15,8 @@ enum class TokenType {
     END_OF_INPUT
 };
 
+// lexeme points into the lexed input, which must outlive the token
 struct Token {
     TokenType type;
-    std::string lexeme;
+    std::string_view lexeme;
 };
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * Opt-in latency tracing in Chrome trace-event format.
+ *
+ * With CUSTOM_SHELL_TRACE=<file>, the lex, parse, execute and output phases
+ * of every command line and each node of the AST walk are recorded as
+ * complete ("X") events, and written to <file> as JSON when the shell exits.
+ * Load it in chrome://tracing or Perfetto. Recording is thread-safe;
+ * pipeline stages show up on their own threads.
+ */
+class Trace {
+public:
+    Trace() = delete;
+
+    // Read CUSTOM_SHELL_TRACE and arrange for the trace to be written at exit
+    static void init();
+
+    static bool enabled() { return enabled_; }
+
+    // Microseconds on the monotonic clock
+    static uint64_t now();
+
+    static void record(const char* category, std::string name, std::string detail, uint64_t start, uint64_t end);
+
+    // Write the events collected so far; also run at exit
+    static void write();
+
+    /**
+     * Records the time from construction to destruction as one event. Costs
+     * a branch when tracing is off; name and detail are only copied when on.
+     */
+    class Span {
+    public:
+        Span(const char* category, std::string_view name, std::string_view detail = {});
+        ~Span();
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        const char* category_;
+        std::string name_;
+        std::string detail_;
+        uint64_t start_ = 0;
+    };
+
+private:
+    static bool enabled_;
+};
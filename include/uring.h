@@ -0,0 +1,121 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+
+#ifdef CUSTOM_SHELL_IO_URING
+#include <linux/io_uring.h>
+
+/**
+ * Minimal io_uring submission/completion ring over the raw syscalls (no
+ * liburing). Single-threaded: one owner fills SQEs and reaps CQEs.
+ */
+class IoRing {
+public:
+    IoRing() = default;
+    ~IoRing();
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    // false (errno set) when the kernel has no io_uring or it is disabled
+    bool init(unsigned entries);
+
+    // A zeroed SQE to fill in, or nullptr when the submission queue is full
+    struct io_uring_sqe* sqe();
+
+    // Submit queued SQEs; with wait, block until at least one completion is ready
+    bool submit(bool wait);
+
+    // Copy out and consume one completion, if any is ready
+    bool reap(struct io_uring_cqe& out);
+
+private:
+    int fd_ = -1;
+
+    void* sqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    void* cqRing_ = nullptr;
+    size_t cqRingSize_ = 0;
+    struct io_uring_sqe* sqes_ = nullptr;
+    size_t sqesSize_ = 0;
+
+    unsigned* sqHead_ = nullptr;
+    unsigned* sqTail_ = nullptr;
+    unsigned* sqArray_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqEntries_ = 0;
+    unsigned sqLocalTail_ = 0;
+    unsigned toSubmit_ = 0;
+
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    struct io_uring_cqe* cqes_ = nullptr;
+};
+
+#endif
+
+/**
+ * Opens, and starts reading, the file operands of cat, wc, grep and cp ahead
+ * of the one being processed.
+ *
+ * Up to depth() files are in flight at once. With io_uring (built with
+ * IO_URING=1 and not turned off with CUSTOM_SHELL_IO_URING=0) each is an
+ * OPENAT followed, for a small regular file, by a READ of the whole file or,
+ * for a large one, by a WILLNEED fadvise of its head; the kernel works on
+ * them while the caller processes the current file. Without io_uring upcoming
+ * regular files are opened and fadvised synchronously instead, so readahead
+ * still overlaps. Files come back in operand order, each exactly once.
+ *
+ * CUSTOM_SHELL_IO_DEPTH=N sets the depth (default 8, at most 256); 0 opens
+ * each file only once it is reached.
+ */
+class FileQueue {
+public:
+    static constexpr size_t kPrefetchBytes = 64 * 1024;
+
+    struct File {
+        const std::string* path = nullptr;
+        int fd = -1;                // now owned by the caller; -1 if the open failed
+        int error = 0;              // errno of the failed open
+        std::string_view preloaded; // leading bytes already read, valid until the next call
+        bool complete = false;      // preloaded is the whole file; otherwise fd is positioned after it
+    };
+
+    // prefetch: bytes to read ahead per file, 0 to only open
+    explicit FileQueue(const std::vector<std::string>& paths, size_t prefetch = kPrefetchBytes);
+    ~FileQueue();
+
+    FileQueue(const FileQueue&) = delete;
+    FileQueue& operator=(const FileQueue&) = delete;
+
+    // The next file in operand order; false once every path was handed out
+    bool next(File& file);
+
+    static size_t depth();
+    static bool uringEnabled();
+
+private:
+    struct Slot;
+    struct Ring;
+
+    void fill();
+    void openNow(size_t index);
+    bool pump(bool wait);
+
+    const std::vector<std::string>& paths_;
+    size_t prefetch_;
+    size_t depth_;
+    std::vector<Slot> slots_;
+    size_t nextOpen_ = 0;
+    size_t nextOut_ = 0;
+    std::unique_ptr<Ring> ring_;
+
+    // Rings are drained before they are given back, so one per thread is reused across commands
+    static thread_local std::unique_ptr<Ring> spareRing_;
+};
@@ -0,0 +1,100 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include "workpool.h"
+
+struct DirListing;
+
+/**
+ * Parallel directory tree walker shared by find, grep -r, rm -r, cp -r and
+ * chmod -R.
+ *
+ * Works relative to directory fds (openat), classifies entries by d_type
+ * (fstatat only when the filesystem reports DT_UNKNOWN) and never follows
+ * symlinks below the root. Each directory is read in one go with DirReader;
+ * its subdirectories and every kEntriesPerTask-sized slice of its entries
+ * become WorkPool tasks, so both deep and wide trees spread across workers.
+ * The walk is iterative, so depth is bounded only by maxDepth.
+ *
+ * Callbacks run concurrently on the pool's workers:
+ *  - visit: once per entry, the root included (pre-order); returning
+ *           false keeps the walker out of that directory
+ *  - leave: once per directory that was entered, after everything below
+ *           it has been visited and left (post-order)
+ */
+class TreeWalker {
+    struct Node;
+
+public:
+    static constexpr size_t kEntriesPerTask = 64;
+
+    struct Entry {
+        int dirFd;                  // directory holding the entry (AT_FDCWD for the root)
+        const char* name;           // name within dirFd (the path as given for the root)
+        const std::string& dirPath; // path of that directory as the user spelled it, "" for the root
+        unsigned char type;         // DT_DIR, DT_REG, DT_LNK, ...
+        size_t depth;               // 0 for the root
+
+        // Per-directory slot for callers, e.g. cp's destination fd. dirData
+        // belongs to the containing directory; for a directory entry, visit
+        // may fill childData, which its own entries then see as dirData.
+        const std::shared_ptr<void>& dirData;
+        std::shared_ptr<void>* childData;
+
+        Node* owner; // walker-internal: the directory's node, null for the root
+
+        // dirPath + "/" + name
+        std::string path() const;
+    };
+
+    struct Options {
+        size_t threads = 0;           // 0 = WorkPool::defaultThreads()
+        size_t maxDepth = SIZE_MAX;   // entries deeper than this are not visited
+        bool followRoot = true;       // stat (not lstat) the root
+    };
+
+    using VisitFn = std::function<bool(const Entry&)>;
+    using LeaveFn = std::function<void(const Entry&, bool failedBelow)>;
+
+    explicit TreeWalker(const Options& options);
+
+    void onVisit(VisitFn fn) { visit_ = std::move(fn); }
+    void onLeave(LeaveFn fn) { leave_ = std::move(fn); }
+
+    // Walk the tree at root; returns one message per failure
+    std::vector<std::string> run(const std::string& root);
+
+    /**
+     * Record "<what> '<path>': strerror(err)". Callable from callbacks; the
+     * failure also marks every directory above entry as failedBelow.
+     */
+    void fail(const Entry& entry, const std::string& what, int err);
+
+    // Same, for failures not tied to an entry
+    void fail(const std::string& what, const std::string& path, int err);
+
+    /**
+     * Order paths as a depth-first walk that visits each directory's entries
+     * in byte order: "a", "a/b", "a-c". Used to give parallel walks a stable output.
+     */
+    static void sortPaths(std::vector<std::string>& paths);
+
+private:
+    void start(const std::string& root);
+    void scan(const std::shared_ptr<Node>& node);
+    void visitSlice(const std::shared_ptr<Node>& node, const std::shared_ptr<const DirListing>& listing, size_t begin, size_t end);
+    void finish(std::shared_ptr<Node> node);
+
+    Options options_;
+    VisitFn visit_;
+    LeaveFn leave_;
+    WorkPool pool_;
+
+    std::mutex errorMutex_;
+    std::vector<std::string> errors_;
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <cstddef>
+
+/**
+ * Fixed-size, work-stealing thread pool.
+ *
+ * Each worker owns a deque. Tasks submitted from inside a task go to the
+ * submitting worker's own deque and are popped LIFO (depth-first, cache
+ * friendly); idle workers steal FIFO from the other end of their peers'
+ * deques, which hands them the largest remaining subtrees first.
+ */
+class WorkPool {
+public:
+    using Task = std::function<void()>;
+
+    // threads == 0 picks defaultThreads()
+    explicit WorkPool(size_t threads = 0);
+    ~WorkPool();
+
+    WorkPool(const WorkPool&) = delete;
+    WorkPool& operator=(const WorkPool&) = delete;
+
+    void submit(Task task);
+
+    // Block until every submitted task, including ones spawned by tasks, has
+    // finished; rethrows the first exception a task let escape
+    void wait();
+
+    size_t size() const { return threads_.size(); }
+
+    static size_t defaultThreads();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void workerLoop(size_t index);
+    bool popLocal(size_t index, Task& task);
+    bool steal(size_t index, Task& task);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable workAvailable_;
+    std::condition_variable allDone_;
+    size_t queued_ = 0;
+    size_t pending_ = 0;
+    size_t nextQueue_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr failure_;
+};
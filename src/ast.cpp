@@ -1,20 +1,50 @@
 #include "ast.h"
+#include <cstring>
 
-AST AST::makeCommandNode(std::string cmd, std::vector<std::string> arguments) {
-    AST node;
-    node.node = NodeType::Command;
-    node.command = std::move(cmd);
-    node.args = std::move(arguments);
-    return node;
+void AST::reserve(size_t tokens, size_t chars) {
+    nodes_.reserve(tokens);
+    words_.reserve(tokens);
+    text_.reserve(chars);
 }
 
-AST AST::makeOperatorNode(const std::string& op, AST lhs, AST rhs) {
-    AST node;
-    node.node = NodeType::Operator;
-    node.op = op;
-    node.left = std::make_unique<AST>(std::move(lhs));
-    node.right = std::make_unique<AST>(std::move(rhs));
-    return node;
+uint32_t AST::addWord(std::string_view word) {
+    words_.push_back({static_cast<uint32_t>(text_.size()), static_cast<uint32_t>(word.size())});
+    text_.append(word);
+    return static_cast<uint32_t>(words_.size() - 1);
+}
+
+AST::NodeId AST::addCommand(uint32_t firstWord, uint32_t wordCount) {
+    nodes_.push_back({NodeType::Command, OpType{}, firstWord, wordCount});
+    return static_cast<NodeId>(nodes_.size() - 1);
+}
+
+AST::NodeId AST::addOperator(OpType op, NodeId lhs, NodeId rhs) {
+    nodes_.push_back({NodeType::Operator, op, lhs, rhs});
+    return static_cast<NodeId>(nodes_.size() - 1);
+}
+
+std::vector<std::string> AST::args(NodeId id) const {
+    std::vector<std::string> out;
+    const size_t n = argCount(id);
+    out.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        out.emplace_back(arg(id, i));
+    }
+    return out;
+}
+
+const char* AST::opSymbol(OpType op) {
+    switch (op) {
+        case OpType::Pipe:        return "|";
+        case OpType::RedirectOut: return ">";
+        case OpType::RedirectIn:  return "<";
+        case OpType::Append:      return ">>";
+        case OpType::And:         return "&&";
+        case OpType::Or:          return "||";
+        case OpType::Seq:         return ";";
+        case OpType::Background:  return "&";
+    }
+    return "?";
 }
 
 void AST::indent(std::ostream& os, int n) {
@@ -23,22 +53,122 @@ void AST::indent(std::ostream& os, int n) {
     }
 }
 
-void AST::print(std::ostream& os, int indentLvl) {
+void AST::print(std::ostream& os) const {
+    if (!nodes_.empty()) {
+        print(os, root_, 0);
+    }
+}
+
+void AST::print(std::ostream& os, NodeId id, int indentLvl) const {
     indent(os, indentLvl);
 
-    if (node == NodeType::Command) {
-        os << "Command: " << command;
-        for (const std::string& a : args) {
-            os << " [" << a << "]";
+    if (type(id) == NodeType::Command) {
+        os << "Command: " << command(id);
+        for (size_t i = 0; i < argCount(id); ++i) {
+            os << " [" << arg(id, i) << "]";
         }
         os << "\n";
-    } else if (node == NodeType::Operator) {
-        os << "Operator: '" << op << "'\n";
-        if (left)  {
-            left->print(os, indentLvl + 1);
+    } else {
+        os << "Operator: '" << opSymbol(op(id)) << "'\n";
+        print(os, left(id), indentLvl + 1);
+        if (right(id) != kNone) {
+            print(os, right(id), indentLvl + 1);
+        }
+    }
+}
+
+std::string AST::text(NodeId id) const {
+    if (type(id) == NodeType::Command) {
+        std::string out(command(id));
+        for (size_t i = 0; i < argCount(id); ++i) {
+            out += ' ';
+            out += arg(id, i);
         }
-        if (right) {
-            right->print(os, indentLvl + 1);
+        return out;
+    }
+
+    std::string out = text(left(id));
+    out += ' ';
+    out += opSymbol(op(id));
+    if (right(id) != kNone) {
+        out += ' ';
+        out += text(right(id));
+    }
+    return out;
+}
+
+/* --- Serialization --- */
+
+namespace {
+
+void putU32(std::string& out, uint32_t v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+bool getU32(std::string_view& in, uint32_t& v) {
+    if (in.size() < sizeof(v)) return false;
+    memcpy(&v, in.data(), sizeof(v));
+    in.remove_prefix(sizeof(v));
+    return true;
+}
+
+template <typename T>
+bool getArray(std::string_view& in, std::vector<T>& v, uint32_t count) {
+    if (in.size() / sizeof(T) < count) return false;
+    v.resize(count);
+    memcpy(v.data(), in.data(), count * sizeof(T));
+    in.remove_prefix(count * sizeof(T));
+    return true;
+}
+
+} // namespace
+
+void AST::serialize(std::string& out) const {
+    putU32(out, root_);
+    putU32(out, nodes_.size());
+    putU32(out, words_.size());
+    putU32(out, text_.size());
+    out.append(reinterpret_cast<const char*>(nodes_.data()), nodes_.size() * sizeof(Node));
+    out.append(reinterpret_cast<const char*>(words_.data()), words_.size() * sizeof(Word));
+    out.append(text_);
+}
+
+bool AST::deserialize(std::string_view& in, AST& out) {
+    uint32_t root, nodeCount, wordCount, textLen;
+    if (!getU32(in, root) || !getU32(in, nodeCount) || !getU32(in, wordCount) || !getU32(in, textLen)) {
+        return false;
+    }
+
+    AST ast;
+    if (!getArray(in, ast.nodes_, nodeCount) || !getArray(in, ast.words_, wordCount) || in.size() < textLen) {
+        return false;
+    }
+    ast.text_.assign(in.data(), textLen);
+    in.remove_prefix(textLen);
+
+    if (root >= nodeCount) {
+        return false;
+    }
+
+    for (const Word& w : ast.words_) {
+        if (w.offset > textLen || w.length > textLen - w.offset) return false;
+    }
+
+    // The parser always adds children before their parent
+    for (NodeId id = 0; id < nodeCount; ++id) {
+        const Node& n = ast.nodes_[id];
+        if (n.type == NodeType::Command) {
+            if (n.second == 0 || n.first > wordCount || n.second > wordCount - n.first) return false;
+        } else if (n.type == NodeType::Operator) {
+            bool trailing = n.op == OpType::Background && n.second == kNone;
+            if (n.first >= id || (n.second >= id && !trailing) ||
+                static_cast<unsigned>(n.op) > static_cast<unsigned>(OpType::Background)) return false;
+        } else {
+            return false;
         }
     }
+
+    ast.root_ = root;
+    out = std::move(ast);
+    return true;
 }
@@ -0,0 +1,146 @@
+#include "builtins.h"
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+struct Entry {
+    std::string_view name;
+    Builtins::Handler handler;
+};
+
+// To add a core builtin, list it here; the hash below adapts on its own
+constexpr Entry kBuiltins[] = {
+    {"help",    Commands::helpCommand},
+    {"echo",    Commands::echoCommand},
+    {"pause",   Commands::pauseCommand},
+    {"ls",      Commands::lsCommand},
+    {"dir",     Commands::dirCommand},
+    {"cd",      Commands::cdCommand},
+    {"pwd",     Commands::pwdCommand},
+    {"clr",     Commands::clrCommand},
+    {"quit",    Commands::quitCommand},
+    {"environ", Commands::environCommand},
+    {"cat",     Commands::catCommand},
+    {"wc",      Commands::wcCommand},
+    {"mkdir",   Commands::mkdirCommand},
+    {"rm",      Commands::rmCommand},
+    {"rmdir",   Commands::rmdirCommand},
+    {"touch",   Commands::touchCommand},
+    {"cp",      Commands::cpCommand},
+    {"chown",   Commands::chownCommand},
+    {"grep",    Commands::grepCommand},
+    {"mv",      Commands::mvCommand},
+    {"chmod",   Commands::chmodCommand},
+    {"cache",   Commands::cacheCommand},
+    {"jobs",    Commands::jobsCommand},
+    {"wait",    Commands::waitCommand},
+    {"fg",      Commands::fgCommand},
+    {"hash",    Commands::hashCommand},
+    {"find",    Commands::findCommand},
+};
+
+constexpr size_t kCount = sizeof(kBuiltins) / sizeof(kBuiltins[0]);
+constexpr unsigned kSlotBits = 6;
+constexpr size_t kSlots = size_t{1} << kSlotBits;
+constexpr uint8_t kEmpty = 0xFF;
+
+static_assert(kCount < kSlots, "builtin table needs more slots");
+
+// Seeded FNV-1a
+constexpr uint32_t hashName(std::string_view name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : name) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// The top bits: FNV's low bits only depend on the low bits of its input
+constexpr size_t slotOf(std::string_view name, uint32_t seed) {
+    return hashName(name, seed) >> (32 - kSlotBits);
+}
+
+constexpr bool collisionFree(uint32_t seed) {
+    bool used[kSlots] = {};
+    for (const Entry& e : kBuiltins) {
+        size_t slot = slotOf(e.name, seed);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+// First seed under which every builtin lands in its own slot
+constexpr uint32_t findSeed() {
+    for (uint32_t seed = 0; seed < 4096; ++seed) {
+        if (collisionFree(seed)) return seed;
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t kSeed = findSeed();
+static_assert(kSeed != UINT32_MAX, "no perfect hash seed found; raise kSlotBits");
+
+struct SlotTable {
+    uint8_t index[kSlots];
+};
+
+constexpr SlotTable buildSlots() {
+    SlotTable table{};
+    for (uint8_t& slot : table.index) {
+        slot = kEmpty;
+    }
+    for (size_t i = 0; i < kCount; ++i) {
+        table.index[slotOf(kBuiltins[i].name, kSeed)] = static_cast<uint8_t>(i);
+    }
+    return table;
+}
+
+constexpr SlotTable kSlotTable = buildSlots();
+
+struct Registry {
+    std::mutex mutex;
+    std::unordered_map<std::string, Builtins::Handler> handlers;
+};
+
+Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+Builtins::Handler findCore(std::string_view name) {
+    uint8_t slot = kSlotTable.index[slotOf(name, kSeed)];
+    if (slot != kEmpty && kBuiltins[slot].name == name) {
+        return kBuiltins[slot].handler;
+    }
+    return nullptr;
+}
+
+} // namespace
+
+Builtins::Handler Builtins::find(std::string_view name) {
+    if (Handler h = findCore(name)) {
+        return h;
+    }
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (r.handlers.empty()) {
+        return nullptr;
+    }
+    auto it = r.handlers.find(std::string(name));
+    return it == r.handlers.end() ? nullptr : it->second;
+}
+
+bool Builtins::add(const std::string& name, Handler handler) {
+    if (name.empty() || !handler || findCore(name)) {
+        return false;
+    }
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.handlers.emplace(name, handler).second;
+}
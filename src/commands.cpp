@@ -1,4 +1,15 @@
 #include "commands.h"
+#include "copy.h"
+#include "remove.h"
+#include "count.h"
+#include "matcher.h"
+#include "jobs.h"
+#include "external.h"
+#include "listing.h"
+#include "walk.h"
+#include "uring.h"
+#include "session.h"
+#include "workpool.h"
 #include <limits>
 #include <string>
 #include <dirent.h>
@@ -8,19 +19,82 @@
 #include <string.h>
 #include <iostream>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/ioctl.h>
 #include <pwd.h>
 #include <grp.h>
 #include <ctime>   
 #include <regex>
 #include <utime.h>
+#include <stdexcept>
+#include <memory>
+#include <algorithm>
+#include <string_view>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <condition_variable>
 #include <ctime>
 
+// Bytes of input grep scans between output flushes
+static constexpr size_t kGrepWindow = 1 << 20;
+
+/**
+ * Per-invocation grep state shared by scanFd, scanRegion and reportLine
+ */
+struct GrepScan {
+    const Matcher* matcher = nullptr;
+    bool invert = false;
+    bool lineNumbers = false;
+    bool countOnly = false;
+    bool onlyMatching = false;
+    int maxCount = -1;
+
+    const std::string* label = nullptr;
+    long lineNumber = 1;
+    int totalMatches = 0;
+    bool limitReached = false;
+
+    TextArena out;
+
+    // Arena offset after each reported line, so a caller can keep only the first N
+    bool recordEnds = false;
+    std::vector<size_t> ends;
+};
+
+// Input handed to one parallel grep task; larger files are split on line boundaries
+static constexpr size_t kGrepChunk = 4 << 20;
+
+// Files the serial grep loop opens (and prefetches) as one FileQueue
+static constexpr size_t kGrepBatch = 1024;
+
+namespace {
+
+/**
+ * One unit of parallel grep work: a whole file read through InputSource, or
+ * a line-aligned slice of a large file that is mapped once for all of its
+ * slices. The scan's lineNumber is the number of the unit's first line.
+ */
+struct GrepJob {
+    std::string path;
+    int fd = -1;                           // whole-file jobs; closed once scanned
+    std::shared_ptr<const MappedFile> map; // slice jobs; dropped once scanned
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    GrepScan scan;
+    std::string error;
+    bool done = false;
+};
+
+} // namespace
+
 /**
  * @brief Display a list of all supported shell commands
  * @param args Must be empty
  * @return Status code and a help message on success
  */
-CommandResult Commands::helpCommand(const std::vector<std::string>& args) {
+CommandResult Commands::helpCommand(const std::vector<std::string>& args, IOContext&) {
     if (!args.empty()) {
         return {1, "", "help: this command takes no arguments"};
     }
@@ -29,25 +103,35 @@ CommandResult Commands::helpCommand(const std::vector<std::string>& args) {
         "Available Commands:\n"
         "  cd [dir]                                 Change directory.\n"
         "  clr                                      Clear the screen.\n"
-        "  dir [-a] [-A] [-l] [path]                List directory contents.\n"
+        "  dir [-a] [-A] [-l] [-t|-S] [-1] [path]   List directory contents.\n"
         "  environ                                  Display environment variables.\n"
         "  echo [text]                              Print text.\n"
         "  help                                     Show help.\n"
         "  pause                                    Pause shell.\n"
         "  quit                                     Exit shell.\n"
-        "  chmod <mode> <file>                      Change permissions.\n"
+        "  chmod [-R] <mode> <file>                 Change permissions (recursively).\n"
         "  chown <owner> <file>                     Change ownership.\n"
-        "  ls [-a] [-A] [-l] [path]                 List directory contents.\n"
+        "  ls [-a] [-A] [-l] [-t|-S] [-1] [path]    List directory contents.\n"
         "  pwd                                      Print working directory.\n"
         "  cat <file>...                            Print file contents.\n"
         "  mkdir [-p] <dir>...                      Create (optionally, nested) directories.\n"
         "  rmdir [-p] <dir>                         Remove directory.\n"
-        "  rm [-r] <path>                           Remove file or directory.\n"
-        "  cp <src>... <dst>                        Copy.\n"
+        "  rm [-r] [-j N] <path>...                 Remove files or directory trees.\n"
+        "  cp [-r] [-j N] <src>... <dst>            Copy (recursively, with N threads).\n"
         "  mv <src> <dst>                           Move.\n"
         "  touch <file>                             Create empty file.\n"
         "  grep [OPTIONS] <pattern> <file>          Search text.\n"
-        "  wc [-l] [-w] [-c]                        Count lines/words/chars.";
+        "  find [path...] [-name|-type|-size|-mtime|-maxdepth|-j <arg>]...\n"
+        "                                           Search directory trees.\n"
+        "  wc [-l] [-w] [-c]                        Count lines/words/chars.\n"
+        "  cache [clear | dir on|off]               Show (or reset) shell cache statistics.\n"
+        "  <command> &                              Run a command line in the background.\n"
+        "  time <command> [args]...                 Run a command and report its time and memory use.\n"
+        "  jobs                                     List background jobs.\n"
+        "  wait [%N]...                             Wait for background jobs to finish.\n"
+        "  fg [%N]                                  Wait for a background job in the foreground.\n"
+        "  hash [-r] [name]...                      Show, add to or reset remembered program locations.\n"
+        "  Any other command is run as a program found on $PATH.";
 
     return {0, out, ""};
 }
@@ -57,7 +141,7 @@ CommandResult Commands::helpCommand(const std::vector<std::string>& args) {
  * @param args A vector of strings to print
  * @return Status code and the formatted output text
  */
-CommandResult Commands::echoCommand(const std::vector<std::string>& args) {
+CommandResult Commands::echoCommand(const std::vector<std::string>& args, IOContext&) {
     std::string out;
 
     for (const std::string& arg : args) {
@@ -72,37 +156,68 @@ CommandResult Commands::echoCommand(const std::vector<std::string>& args) {
  * @param args Must be empty
  * @return Status code, empty output on success or error message on failure
  */
-CommandResult Commands::pauseCommand(const std::vector<std::string> &args)
+CommandResult Commands::pauseCommand(const std::vector<std::string>& args, IOContext& io)
 {
     if (!args.empty()){
         return {1, "", "pause: this command takes no arguments"};
     }
 
-    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    // Whatever was printed before the pause has to be visible while we wait
+    io.out->flush();
+    Session::waitForNewline();
     return {0, "", ""};
 }
 
+/**
+ * @brief Width ls lays columns out in: the terminal's, else $COLUMNS, else 80
+ * @param fd Descriptor ls writes to
+ * @return Width in columns, or 0 when fd is not a terminal (one name per line)
+ */
+static size_t lsOutputWidth(int fd) {
+    if (!isatty(fd)) {
+        return 0;
+    }
+
+    struct winsize ws;
+    if (ioctl(fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        return ws.ws_col;
+    }
+
+    const char* env = Session::getenv("COLUMNS");
+    long cols = env ? strtol(env, nullptr, 10) : 0;
+    return cols > 0 ? static_cast<size_t>(cols) : 80;
+}
+
 /**
  * @brief List the contents of files and directories
+ * Entries are sorted by name (byte order) unless -t or -S is given. Short
+ * listings are laid out in columns on a terminal and one per line otherwise.
  * @param args Optional flags or file/directory paths:
  *        - "-a" include hidden entries
  *        - "-A" exclude "." and ".."
  *        - "-l" include detailed file information
+ *        - "-t" sort by modification time, newest first
+ *        - "-S" sort by size, largest first
+ *        - "-1" one entry per line
  *        - otherwise, treat as file/directory operand
  * @return Status code, output, and possible error messages
  */
-CommandResult Commands::lsCommand(const std::vector<std::string>& args) {
+CommandResult Commands::lsCommand(const std::vector<std::string>& args, IOContext& io) {
     bool showAll = false;
     bool almostAll = false;
     bool longList = false;
+    bool onePerLine = false;
+    ListingLayout::Order order = ListingLayout::Order::Name;
 
     std::vector<std::string> paths;
-    std::string out;
 
     for (const std::string& arg : args) {
         if (arg == "-a") showAll = true;
         else if (arg == "-A") almostAll = true;
         else if (arg == "-l") longList = true;
+        else if (arg == "-t") order = ListingLayout::Order::Mtime;
+        else if (arg == "-S") order = ListingLayout::Order::Size;
+        else if (arg == "-1") onePerLine = true;
         else if (arg.size() > 1 && arg[0] == '-') {
             return {1, "", "ls: invalid flag -- '" + arg + "'"};
         } else {
@@ -114,61 +229,126 @@ CommandResult Commands::lsCommand(const std::vector<std::string>& args) {
         paths.push_back(".");
     }
 
+    const size_t width = onePerLine ? 0 : lsOutputWidth(io.out->fd());
+    const bool needMeta = longList || order != ListingLayout::Order::Name;
+
+    // Lines are formatted into one arena and handed to the sink in large blocks
+    TextArena out;
+    LongFormatter formatter;
+    bool wrote = false;
+    char last = '\n';
+
+    // Reused across operands: one record (and, when needed, one FileMeta) per shown entry
+    std::vector<ListingLayout::Record> records;
+    std::vector<FileMeta> metas;
+
+    auto drain = [&]() {
+        if (out.empty()) return;
+        io.out->write(out.data(), out.size());
+        last = out.data()[out.size() - 1];
+        wrote = true;
+        out.clear();
+    };
+
+    // Whatever was listed before an error stays printed, like GNU ls
+    auto fail = [&](std::string message) -> CommandResult {
+        drain();
+        if (wrote && last != '\n') io.out->put('\n');
+        return {1, "", std::move(message)};
+    };
+
     for (const std::string& p : paths) {
-        struct stat info;
-        if (stat(p.c_str(), &info) == -1) {
-            return {1, "", "ls: cannot access '" + p + "': " + std::string(strerror(errno))};
+        FileMeta meta;
+        if (!FileMeta::at(AT_FDCWD, p.c_str(), meta)) {
+            return fail("ls: cannot access '" + p + "': " + std::string(strerror(errno)));
         }
-        
+
         // If path is a file
-        if (!S_ISDIR(info.st_mode)) {
+        if (!S_ISDIR(meta.mode)) {
             if (longList) {
-                out += formatLsLongListing(p, info);
+                formatter.append(out, meta, p);
             } else {
-                out += p + "\n";
-            } 
+                out.append(p);
+                out.put('\n');
+            }
             continue;
         }
 
         if (paths.size() > 1) {
-            out += p + ":\n";
+            out.append(p);
+            out.append(":\n", 2);
         }
 
-        DIR* dirp = opendir(p.c_str());
-        if (!dirp) {
-            return {1, "", "ls: cannot open directory '" + p + "': " + std::string(strerror(errno))};
+        int dirFd = open(p.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        // Unchanged directories come back from the session cache; see "cache"
+        std::shared_ptr<const DirListing> listing = dirFd == -1 ? nullptr : DirCache::get(dirFd);
+        if (!listing) {
+            std::string message = "ls: cannot open directory '" + p + "': " + std::string(strerror(errno));
+            if (dirFd != -1) close(dirFd);
+            return fail(std::move(message));
         }
 
-        struct dirent* dp;
-        while ((dp = readdir(dirp)) != nullptr) {
-            std::string name = dp->d_name;
+        records.clear();
+        metas.clear();
+        records.reserve(listing->size());
+
+        for (size_t i = 0; i < listing->size(); ++i) {
+            std::string_view name = listing->name(i);
 
             if (!showAll && !almostAll && name[0] == '.') {
                 continue;
             }
-            
+
             if (almostAll && (name == "." || name == "..")) {
                 continue;
             }
 
-            std::string full = p + "/" + name;
+            uint64_t key = 0;
+            uint32_t entry = 0;
+            if (needMeta) {
+                FileMeta finfo;
+                if (!FileMeta::at(dirFd, name.data(), finfo)) {
+                    std::string message = "ls: cannot access '" + std::string(name) + "': " + std::string(strerror(errno));
+                    close(dirFd);
+                    return fail(std::move(message));
+                }
+                if (order == ListingLayout::Order::Mtime) key = ListingLayout::newestFirst(finfo.mtime);
+                else if (order == ListingLayout::Order::Size) key = ListingLayout::largestFirst(finfo.size);
+                entry = static_cast<uint32_t>(metas.size());
+                metas.push_back(finfo);
+            }
+
+            records.push_back(ListingLayout::record(*listing, i, key, entry));
+        }
+
+        close(dirFd);
 
+        const char* names = listing->names.data();
+        ListingLayout::sort(records, names);
+
+        if (!longList && width > 0) {
+            ListingLayout::columns(out, records, names, width);
+            continue;
+        }
+
+        for (const ListingLayout::Record& rec : records) {
+            std::string_view name(names + rec.nameOffset, rec.nameLen);
             if (longList) {
-                struct stat finfo;
-                if (stat(full.c_str(), &finfo) == -1) {
-                    closedir(dirp);
-                    return {1, "", "ls: cannot access '" + name + "': " + std::string(strerror(errno))};
-                }
-                out += formatLsLongListing(name, finfo);
+                formatter.append(out, metas[rec.entry], name);
             } else {
-                out += name + " ";
+                out.append(name);
+                out.put('\n');
             }
-        }
 
-        closedir(dirp);
+            if (out.size() >= OutputSink::kDefaultCapacity) {
+                drain();
+            }
+        }
     }
 
-    return {0, stripTrailingNewline(out), ""};
+    drain();
+    if (wrote && last != '\n') io.out->put('\n');
+    return {0, "", ""};
 }
 
 /**
@@ -176,8 +356,8 @@ CommandResult Commands::lsCommand(const std::vector<std::string>& args) {
  * @param args Refer to ls command
  * @return Status code, directory listing output, and possible error messages
  */
-CommandResult Commands::dirCommand(const std::vector<std::string>& args) {
-    return lsCommand(args);
+CommandResult Commands::dirCommand(const std::vector<std::string>& args, IOContext& io) {
+    return lsCommand(args, io);
 }
 
 /**
@@ -187,8 +367,8 @@ CommandResult Commands::dirCommand(const std::vector<std::string>& args) {
  *        - one argument: change to the specified path (supports ~ expansion)
  * @return Status code, empty output on success or error message on failure
  */
-CommandResult Commands::cdCommand(const std::vector<std::string>& args) {
-    const char* home = getenv("HOME");
+CommandResult Commands::cdCommand(const std::vector<std::string>& args, IOContext&) {
+    const char* home = Session::getenv("HOME");
 
     if (args.empty()){
         if(chdir(home) == -1) {
@@ -220,7 +400,7 @@ CommandResult Commands::cdCommand(const std::vector<std::string>& args) {
  *       - two arguments: "-p" flag followed by the specified paths to remove
  * * @return Status code, directory deletion messages on success, or an error message on failure
  */
-CommandResult Commands::rmdirCommand(const std::vector<std::string>& args) {
+CommandResult Commands::rmdirCommand(const std::vector<std::string>& args, IOContext&) {
     if (args.empty()) {
         return {1, "", "rmdir: missing operand"};
     }
@@ -279,7 +459,7 @@ CommandResult Commands::rmdirCommand(const std::vector<std::string>& args) {
  * @param args The file name
  * @return Status code, empty output on success or error message on failure
  */
-CommandResult Commands::touchCommand(const std::vector<std::string>& args) {
+CommandResult Commands::touchCommand(const std::vector<std::string>& args, IOContext&) {
     if (args.empty() || args.size() > 1) {
         return {1, "", "touch: invalid arguments passed"};
     }
@@ -311,40 +491,90 @@ CommandResult Commands::touchCommand(const std::vector<std::string>& args) {
 
 /**
  * @brief Copy a file or directory to a destination path.
- * @param args Source and destination paths
+ * @param args Source and destination paths, with optional flags:
+ *        "-r"/"-R"  Recursively copy directories (in parallel)
+ *        "-j <num>" Number of worker threads for "-r" (default: one per core)
  * @return Status code, empty output on success or an error message on failure
  */
-CommandResult Commands::cpCommand(const std::vector<std::string>& args) {
-    /**
-     * TODO: Implement "-r" flag
-    */
+CommandResult Commands::cpCommand(const std::vector<std::string>& args, IOContext&) {
+    bool recursive = false;
+    size_t jobs = 0;
 
-    if (args.empty()) {
+    std::vector<std::string> operands;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+
+        if (arg == "-r" || arg == "-R") {
+            recursive = true;
+        } else if (arg == "-j" || (arg.rfind("-j", 0) == 0 && arg.size() > 2)) {
+            std::string value = arg.size() > 2 ? arg.substr(2) : "";
+            if (value.empty()) {
+                if (i + 1 >= args.size()) {
+                    return {1, "", "cp: option requires an argument -- 'j'"};
+                }
+                value = args[++i];
+            }
+
+            try {
+                int n = std::stoi(value);
+                if (n < 1) throw std::invalid_argument(value);
+                jobs = n;
+            } catch (...) {
+                return {1, "", "cp: invalid number of jobs '" + value + "'"};
+            }
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return {1, "", "cp: invalid option '" + arg + "'"};
+        } else {
+            operands.push_back(arg);
+        }
+    }
+
+    if (operands.empty()) {
         return {1, "", "cp: missing operand"};
     }
 
-    if (args.size() == 1) {
-        return {1, "", "cp: missing destination file operand after '" + args[0] + "'"};
+    if (operands.size() == 1) {
+        return {1, "", "cp: missing destination file operand after '" + operands[0] + "'"};
     }
 
-    std::string dest = args.back();
+    std::string dest = operands.back();
 
     struct stat stDest;
     bool destIsDir = stat(dest.c_str(), &stDest) == 0 && S_ISDIR(stDest.st_mode);
 
     // If multiple sources, dest MUST be a directory
-    int numSources = args.size() - 1;
+    int numSources = operands.size() - 1;
     if (numSources > 1 && !destIsDir) {
         return {1, "", "cp: target '" + dest + "' is not a directory"};
     }
 
+    std::vector<std::string> sources(operands.begin(), operands.end() - 1);
+    std::vector<bool> sourceIsDir(numSources);
+    std::vector<std::string> fileSources;
+
     for (int i = 0; i < numSources; ++i) {
-        std::string src = args[i];
+        std::string& src = sources[i];
+
+        // Trailing slashes would otherwise leave an empty basename
+        while (src.size() > 1 && src.back() == '/') {
+            src.pop_back();
+        }
 
-        // Rejecting directory sources because no -r support yet
         struct stat stSrc;
-        if (stat(src.c_str(), &stSrc) == 0 && S_ISDIR(stSrc.st_mode)) {
-            return {1, "", "cp: omitting directory '" + src + "'"};
+        sourceIsDir[i] = stat(src.c_str(), &stSrc) == 0 && S_ISDIR(stSrc.st_mode);
+        if (!sourceIsDir[i]) {
+            fileSources.push_back(src);
+        }
+    }
+
+    // Later sources are opened while earlier ones are copied; the data itself moves in-kernel
+    FileQueue queue(fileSources, 0);
+
+    for (int i = 0; i < numSources; ++i) {
+        const std::string& src = sources[i];
+        bool srcIsDir = sourceIsDir[i];
+        if (srcIsDir && !recursive) {
+            return {1, "", "cp: -r not specified; omitting directory '" + src + "'"};
         }
 
         std::string finalDest = dest;
@@ -354,35 +584,44 @@ CommandResult Commands::cpCommand(const std::vector<std::string>& args) {
             finalDest = dest + "/" + filename;
         }
 
-        int fdSrc = open(src.c_str(), O_RDONLY);
-        if (fdSrc == -1) {
-            return {1, "", "cp: cannot open source file '" + src + "': " + std::string(strerror(errno))};
+        if (srcIsDir) {
+            std::vector<std::string> errors = CopyEngine::copyTree(src, finalDest, jobs);
+            if (!errors.empty()) {
+                std::string msg;
+                for (const std::string& e : errors) {
+                    if (!msg.empty()) msg += "\n";
+                    msg += "cp: " + e;
+                }
+                return {1, "", msg};
+            }
+            continue;
         }
 
-        int fdDest = open(finalDest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fdDest == -1) {
-            close(fdSrc);
-            return {1, "", "cp: cannot create destination file '" + finalDest + "': " + std::string(strerror(errno))};
+        FileQueue::File file;
+        queue.next(file);
+        if (file.fd == -1) {
+            return {1, "", "cp: cannot open source file '" + src + "': " + std::string(strerror(file.error))};
         }
 
-        char buffer[1024];
-        ssize_t bytesRead;
-        while ((bytesRead = read(fdSrc, buffer, sizeof(buffer))) > 0) {
-            if (write(fdDest, buffer, bytesRead) != bytesRead) {
-                close(fdSrc);
-                close(fdDest);
+        CopyEngine::Status status = CopyEngine::copyFile(file.fd, finalDest);
+        int copyErrno = errno;
+        close(file.fd);
+        errno = copyErrno;
+
+        switch (status) {
+            case CopyEngine::Status::Ok:
+                break;
+            case CopyEngine::Status::OpenSourceFailed:
+                return {1, "", "cp: cannot open source file '" + src + "': " + std::string(strerror(errno))};
+            case CopyEngine::Status::CreateDestFailed:
+                return {1, "", "cp: cannot create destination file '" + finalDest + "': " + std::string(strerror(errno))};
+            case CopyEngine::Status::ReadFailed:
+                return {1, "", "cp: read error on '" + src + "': " + std::string(strerror(errno))};
+            case CopyEngine::Status::WriteFailed:
                 return {1, "", "cp: write error on '" + finalDest + "': " + std::string(strerror(errno))};
-            }
+            case CopyEngine::Status::SameFile:
+                return {1, "", "cp: '" + src + "' and '" + finalDest + "' are the same file"};
         }
-
-        if (bytesRead == -1) {
-            close(fdSrc);
-            close(fdDest);
-            return {1, "", "cp: read error on '" + src + "': " + std::string(strerror(errno))};
-        }
-
-        close(fdSrc);
-        close(fdDest);
     }
 
     return {0, "", ""};
@@ -393,7 +632,7 @@ CommandResult Commands::cpCommand(const std::vector<std::string>& args) {
  * @param args Username and file path
  * @return Status code, empty output on success or an error message on failure
  */
-CommandResult Commands::chownCommand(const std::vector<std::string>& args) {
+CommandResult Commands::chownCommand(const std::vector<std::string>& args, IOContext&) {
     if (args.empty()) {
         return {1, "", "chown: missing arguments"};    
     }
@@ -437,14 +676,20 @@ CommandResult Commands::chownCommand(const std::vector<std::string>& args) {
  *        - "-c"  Print only the count of matching lines
  *        - "-o"  Print only the matching substring(s) instead of entire lines
  *        - "-m <num>"  Stop after <num> matches
- * @return Status code and matched output text, or an error message on failure
+ *        - "-r"  Search the regular files below directory operands, in
+ *                sorted path order (the walk itself runs in parallel)
+ *        - "-j <num>"  Number of worker threads for several or large files
+ *                      (default: one per core); output order is unchanged
+ *        With no file operands, the piped input is searched instead.
+ * @param io Matching lines are streamed to io.out as each chunk is scanned
+ * @return Status code (or the match count for "-c"), or an error message on failure
  */
-CommandResult Commands::grepCommand(const std::vector<std::string>& args) {
+CommandResult Commands::grepCommand(const std::vector<std::string>& args, IOContext& io) {
     /**
      * TODO: Implement additional flags and support flag combinations
      */
 
-    if (args.size() < 2) {
+    if (args.empty() || (args.size() < 2 && io.in == -1)) {
         return {1, "", "grep: missing arguments"};
     }
 
@@ -455,17 +700,41 @@ CommandResult Commands::grepCommand(const std::vector<std::string>& args) {
     bool opt_c = false;
     bool opt_o = false;
     int  opt_m = -1;
+    bool opt_r = false;
+    size_t jobs = 0;
 
     int idx = 0;
     int flagCount = 0;
 
     while (idx < args.size() && args[idx][0] == '-') {
+        const std::string& flag = args[idx];
+
+        // Thread count only affects scheduling, so it does not count as a flag
+        if (flag == "-j") {
+            if (idx + 1 >= static_cast<int>(args.size()))
+                return {1, "", "grep: missing argument for -j"};
+            try {
+                int n = std::stoi(args[idx + 1]);
+                if (n < 1) throw std::invalid_argument(args[idx + 1]);
+                jobs = n;
+            } catch (...) {
+                return {1, "", "grep: invalid number of jobs '" + args[idx + 1] + "'"};
+            }
+            idx += 2;
+            continue;
+        }
+
+        // Likewise -r only changes which files are searched
+        if (flag == "-r" || flag == "-R") {
+            opt_r = true;
+            ++idx;
+            continue;
+        }
+
         if (++flagCount > 1) {
             return {1, "", "grep: only one flag can be used at a time"};
         }
 
-        const std::string& flag = args[idx];
-
         if (flag == "-i") opt_i = true;
         else if (flag == "-n") opt_n = true;
         else if (flag == "-v") opt_v = true;
@@ -488,140 +757,173 @@ CommandResult Commands::grepCommand(const std::vector<std::string>& args) {
 
     std::string pattern = args[idx++];
 
-    if (idx >= args.size()) {
+    // With no file operands, search the piped input instead (or "." under -r)
+    bool fromInput = idx >= static_cast<int>(args.size()) && !opt_r;
+    if (fromInput && io.in == -1) {
         return {1, "", "grep: missing file operand"};
     }
     
-    std::regex_constants::syntax_option_type flags;
-    if (opt_i) {
-        flags = std::regex_constants::ECMAScript | std::regex_constants::icase;
-    } else {
-        flags = std::regex_constants::ECMAScript;
-    }
-
-    if (opt_w) pattern = "\\b" + pattern + "\\b";
-
-    std::regex re;
+    // Literal and anchored patterns never reach std::regex; see Matcher.
+    // Compiled matchers are reused across invocations; see "cache"
+    std::shared_ptr<const Matcher> matcher;
     try {
-        re = std::regex(pattern, flags);
+        matcher = MatcherCache::get(pattern, opt_i, opt_w);
     } catch (...) {
         return {1, "", "grep: invalid regex"};
     }
 
-    bool multipleFiles = (args.size() - idx) > 1;
-
-    int totalMatches = 0;
-    std::string out;
+    std::vector<std::string> files(args.begin() + idx, args.end());
+    if (fromInput) {
+        files.push_back("(standard input)");
+    }
+    if (opt_r && files.empty()) {
+        files.push_back(".");
+    }
 
-    for (int i = idx; i < args.size(); ++i) {
+    bool multipleFiles = files.size() > 1;
 
-        const std::string& file = args[i];
+    // Operands are searched in order. Under -r a directory is walked when its
+    // turn comes and replaced by the regular files below it, sorted as find
+    // sorts them, so output does not depend on how the walk was scheduled
+    std::string walkErrors;
+    std::vector<std::string> expanded;
+    size_t nextOperand = 0;
+    size_t nextExpanded = 0;
 
-        int fd = open(file.c_str(), O_RDONLY);
-        if (fd == -1) {
-            return {1, "", "grep: cannot open file '" + file + "'"};
+    auto expand = [&](const std::string& file) {
+        struct stat st;
+        if (!opt_r || stat(file.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            expanded.push_back(file);
+            return;
         }
 
-        char buffer[1024];
-        ssize_t bytes;
-        std::string lineBuffer;
-        int lineNumber = 1;
-
-        while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
-            lineBuffer.append(buffer, bytes);
+        TreeWalker::Options options;
+        options.threads = jobs;
+        TreeWalker walker(options);
 
-            size_t newlinePos;
-            while ((newlinePos = lineBuffer.find('\n')) != std::string::npos) {
-                std::string line = lineBuffer.substr(0, newlinePos);
-                lineBuffer.erase(0, newlinePos + 1);
-
-                std::string matchedText;
-                bool matched = matchesPattern(line, re, opt_o, matchedText);
+        std::mutex foundMutex;
+        walker.onVisit([&](const TreeWalker::Entry& entry) {
+            if (entry.type == DT_REG) {
+                std::string path = entry.path();
+                std::lock_guard<std::mutex> lock(foundMutex);
+                expanded.push_back(std::move(path));
+            }
+            return entry.type == DT_DIR;
+        });
 
-                if (opt_v) {
-                    matched = !matched;
-                }
+        for (const std::string& e : walker.run(file)) {
+            if (!walkErrors.empty()) walkErrors += "\n";
+            walkErrors += "grep: " + e;
+        }
 
-                if (matched) {
-                    ++totalMatches;
+        TreeWalker::sortPaths(expanded);
+    };
 
-                    if (opt_m != -1 && totalMatches > opt_m) {
-                        close(fd);
-                        if (opt_c){
-                            return {0, std::to_string(totalMatches), ""};
-                        }
+    std::function<bool(std::string&)> nextFile = [&](std::string& path) {
+        while (nextExpanded == expanded.size()) {
+            if (nextOperand == files.size()) return false;
+            expanded.clear();
+            nextExpanded = 0;
+            expand(files[nextOperand++]);
+        }
+        path = std::move(expanded[nextExpanded++]);
+        return true;
+    };
+
+    if (opt_r) {
+        for (const std::string& file : files) {
+            struct stat st;
+            multipleFiles = multipleFiles || (stat(file.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+        }
+    }
 
-                        if (!out.empty() && out.back() == '\n') {
-                            out.pop_back();
-                        }
+    GrepScan scan;
+    scan.matcher = matcher.get();
+    scan.invert = opt_v;
+    scan.lineNumbers = opt_n;
+    scan.countOnly = opt_c;
+    scan.onlyMatching = opt_o;
+    scan.maxCount = opt_m;
+
+    // Several files, or one large one, are split across a thread pool
+    size_t threads = jobs ? jobs : WorkPool::defaultThreads();
+    bool parallel = !fromInput && threads > 1;
+    if (parallel && !multipleFiles) {
+        struct stat st;
+        parallel = stat(files[0].c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+                   st.st_size > static_cast<off_t>(kGrepChunk);
+    }
 
-                        return {0, out, ""};
-                    }
+    if (parallel) {
+        std::string error = grepParallel(nextFile, multipleFiles, scan, threads, *io.out);
+        if (!error.empty()) {
+            return {1, "", error};
+        }
+    }
 
-                    if (!opt_c) {
-                        if (multipleFiles) {
-                            out += file + ":";
-                        }
+    // Otherwise files are searched here, a batch at a time so the queue can prefetch them
+    std::vector<std::string> batch;
+    std::string path;
+    bool more = !parallel;
 
-                        if (opt_n) {
-                            out += std::to_string(lineNumber) + ":";
-                        }
+    while (more && !scan.limitReached) {
+        batch.clear();
+        while (batch.size() < kGrepBatch && (more = nextFile(path))) {
+            batch.push_back(std::move(path));
+        }
 
-                        if (opt_v && !opt_o) {
-                            out += line + "\n";\
-                        } else {
-                            out += matchedText + "\n";
-                        }
-                    }
-                }
+        const std::vector<std::string> noFiles;
+        FileQueue queue(fromInput ? noFiles : batch);
 
-                ++lineNumber;
+        for (const std::string& file : batch) {
+            FileQueue::File queued;
+            if (!fromInput) {
+                queue.next(queued);
             }
-        }
 
-        // Last line if it's not newline
-        if (!lineBuffer.empty()) {
-            std::string matchedText;
-            bool matched = matchesPattern(lineBuffer, re, opt_o, matchedText);
-
-            if (opt_v) {
-                matched = !matched;
+            int fd = fromInput ? io.in : queued.fd;
+            if (fd == -1) {
+                return {1, "", "grep: cannot open file '" + file + "'"};
             }
 
-            if (matched) {
-                ++totalMatches;
-                if (opt_m != -1 && totalMatches > opt_m) {
-                    close(fd);
-                    if (opt_c) {
-                        return {0, std::to_string(totalMatches), ""};
-                    }
+            // A count is all -c writes, so only printed lines can feed back
+            if (!opt_c && io.out->feedsBack(fd, fromInput ? -1 : 0)) {
+                if (!fromInput) close(fd);
+                return {1, "", "grep: " + file + ": input file is also the output"};
+            }
 
-                    if (!out.empty() && out.back() == '\n') {
-                        out.pop_back();
-                    }
+            scan.label = multipleFiles ? &file : nullptr;
+            scan.lineNumber = 1;
 
-                    return {0, out, ""};
-                }
+            bool readOk;
+            {
+                // Chunks end on a line boundary so output can be flushed between them
+                InputSource src(fd, queued.preloaded, queued.complete, kGrepWindow);
+                readOk = scanInput(src, scan, *io.out);
+            }
+            int readErrno = errno;
 
-                if (!opt_c) {
-                    if (multipleFiles) {
-                        out += file + ":";
-                    }
+            if (!fromInput) {
+                close(fd);
+            }
 
-                    if (opt_n) {
-                        out += std::to_string(lineNumber) + ":";
-                    }
+            if (!readOk) {
+                return {1, "", "grep: error reading '" + file + "': " + strerror(readErrno)};
+            }
 
-                    if (opt_v && !opt_o) {
-                        out += lineBuffer + "\n";
-                    } else {
-                        out += matchedText + "\n";
-                    }
-                }
+            if (scan.limitReached) {
+                break;
             }
         }
+    }
 
-        close(fd);
+    int totalMatches = scan.totalMatches;
+
+    if (!walkErrors.empty()) {
+        if (opt_c) {
+            io.out->write(std::to_string(totalMatches) + "\n");
+        }
+        return {1, "", walkErrors};
     }
 
     if (opt_c) {
@@ -632,7 +934,7 @@ CommandResult Commands::grepCommand(const std::vector<std::string>& args) {
         return {1, "", ""};
     }
 
-    return {0, stripTrailingNewline(out), ""};
+    return {0, "", ""};
 }
 
 
@@ -641,12 +943,19 @@ CommandResult Commands::grepCommand(const std::vector<std::string>& args) {
  * @param args Must be empty
  * @return Status code indicating shell termination.
  */
-CommandResult Commands::quitCommand(const std::vector<std::string>& args) {
+CommandResult Commands::quitCommand(const std::vector<std::string>& args, IOContext& io) {
     if (!args.empty()) {
         return {1, "", "quit: this command takes no arguments"};
     }
 
-    std::cout << "[Shell Terminated]\n";
+    io.out->write("[Shell Terminated]\n");
+    io.out->flush();
+
+    // A server request only ends itself
+    if (Session* session = Session::current()) {
+        session->quit = true;
+        return {0, "", ""};
+    }
     std::exit(0);
 }
 
@@ -655,13 +964,12 @@ CommandResult Commands::quitCommand(const std::vector<std::string>& args) {
  * @param args Must be empty
  * @return Status code, clears shell on success, error message on failure
  */
-CommandResult Commands::clrCommand(const std::vector<std::string>& args) {
+CommandResult Commands::clrCommand(const std::vector<std::string>& args, IOContext&) {
     if (!args.empty()) {
         return {1, "", "clr: takes no arguments"};
     }
 
-    // __NO_NL__ is a marker to notify the shell NOT to print out a newline
-    return {0, "__NO_NL__\e[H\e[J", ""};
+    return {0, "\e[H\e[J", "", true};
 }
 
 /**
@@ -669,7 +977,7 @@ CommandResult Commands::clrCommand(const std::vector<std::string>& args) {
  * @param args Must be empty
  * @return Status code and the current directory path
  */
-CommandResult Commands::pwdCommand(const std::vector<std::string>& args) {
+CommandResult Commands::pwdCommand(const std::vector<std::string>& args, IOContext&) {
     if (!args.empty()) {
         return {1, "", "pwd: this command takes no arguments"};
     }
@@ -687,14 +995,14 @@ CommandResult Commands::pwdCommand(const std::vector<std::string>& args) {
  * @param args Must be empty
  * @return Status code and printed file contents.
  */
-CommandResult Commands::environCommand(const std::vector<std::string>& args) {
+CommandResult Commands::environCommand(const std::vector<std::string>& args, IOContext&) {
     if (!args.empty()) {
         return {1, "", "environ: this command takes no arguments"};
     }
 
     std::string out;
 
-    for (char **env = environ; *env != nullptr; ++env) {
+    for (char **env = Session::environment(); *env != nullptr; ++env) {
         out += std::string(*env) + "\n";
     }
 
@@ -703,50 +1011,68 @@ CommandResult Commands::environCommand(const std::vector<std::string>& args) {
 
 /**
  * @brief Reads and prints the contents of each file provided in order.
- * @param args List of file paths to print
- * @return Status code, printed file contents on success, or error message on failure
+ * @param args List of file paths to print. With no operands, copies the piped input.
+ * @param io File data is moved straight into io.out's descriptor, in-kernel where possible
+ * @return Status code, or error message on failure
  */
-CommandResult Commands::catCommand(const std::vector<std::string>& args) {
+CommandResult Commands::catCommand(const std::vector<std::string>& args, IOContext& io) {
     if (args.empty()) {
-        return {1, "", "cat: missing file operand"};
+        if (io.in == -1) {
+            return {1, "", "cat: missing file operand"};
+        }
+
+        if (io.out->feedsBack(io.in)) {
+            return {1, "", "cat: -: input file is output file"};
+        }
+
+        if (io.out->copyFrom(io.in) == -1) {
+            return {1, "", "cat: error reading standard input: " + std::string(strerror(errno))};
+        }
+
+        return {0, "", ""};
     }
 
-    std::string out;
-    const size_t bufferSize = 4096; 
-    char buffer[bufferSize];
+    // Upcoming files are opened, and small ones read, while the current one is copied
+    FileQueue queue(args);
+    FileQueue::File file;
 
-    for (const std::string& filename : args) {
-        int fd = open(filename.c_str(), O_RDONLY); 
-        if (fd == -1) {
-            return {1, "", "cat: cannot open " + filename + ": " + strerror(errno)};
+    while (queue.next(file)) {
+        const std::string& filename = *file.path;
+        if (file.fd == -1) {
+            return {1, "", "cat: cannot open " + filename + ": " + strerror(file.error)};
         }
 
-        ssize_t bytesRead;
-        while ((bytesRead = read(fd, buffer, bufferSize)) > 0) { 
-            out.append(buffer, bytesRead);  
+        // Checked from the start of the file, before any preloaded bytes go out
+        if (io.out->feedsBack(file.fd, 0)) {
+            close(file.fd);
+            return {1, "", "cat: " + filename + ": input file is output file"};
         }
 
-        if (bytesRead == -1) {
-            return {1, "", "cat: error reading " + filename + ": " + strerror(errno)};
+        io.out->write(file.preloaded.data(), file.preloaded.size());
+        if (!file.complete && io.out->copyFrom(file.fd) == -1) {
+            int readErrno = errno;
+            close(file.fd);
+            return {1, "", "cat: error reading " + filename + ": " + strerror(readErrno)};
         }
 
-        out.append("\n");  
+        close(file.fd);
 
-        close(fd);
+        // Downstream reader is gone, nothing left to do
+        if (io.out->broken()) break;
     }
 
-    return {0, stripTrailingNewline(out), ""};
+    return {0, "", ""};
 }
 
 /**  
  * @brief Count number of lines, words, and characters in a file.
- * @param args List containing exactly one file path and optional files:
+ * @param args List of file paths (or none, to count the piped input) and optional flags:
  *        "-l" Count lines
  *        "-w" Count words
  *        "-c" Count characters
  * @return Status code, resulting counts on success, error message on failure.
  */
-CommandResult Commands::wcCommand(const std::vector<std::string>& args) {
+CommandResult Commands::wcCommand(const std::vector<std::string>& args, IOContext& io) {
     bool countLines = false;
     bool countWords = false;
     bool countChars = false;
@@ -763,53 +1089,60 @@ CommandResult Commands::wcCommand(const std::vector<std::string>& args) {
         countLines = countWords = countChars = true;
     }
 
-    if (files.empty()) {
-        return {1, "", "wc: missing file operand"};
+    // With no operands, count the piped input instead (reported without a name)
+    bool fromInput = files.empty();
+    if (fromInput) {
+        if (io.in == -1) {
+            return {1, "", "wc: missing file operand"};
+        }
+        files.push_back("");
     }
 
     std::string out;
 
-    for (const std::string& filename : files) {
+    // A byte count alone only needs the files opened, not read
+    const std::vector<std::string> noFiles;
+    const bool countOnlyChars = countChars && !countLines && !countWords;
+    FileQueue queue(fromInput ? noFiles : files, countOnlyChars ? 0 : FileQueue::kPrefetchBytes);
 
-        if (isFileEmpty(filename)) {
-            std::string zeroCount = "";
-            if (countLines) zeroCount += "0 ";
-            if (countWords) zeroCount += "0 ";
-            if (countChars) zeroCount += "0 ";
-            zeroCount += filename + "\n";
-            out += zeroCount;
-            continue;
+    for (const std::string& filename : files) {
+        FileQueue::File file;
+        if (!fromInput) {
+            queue.next(file);
         }
 
-        int fd = open(filename.c_str(), O_RDONLY);
+        int fd = fromInput ? io.in : file.fd;
         if (fd == -1) {
-            return {1, "", "wc: cannot open file '" + filename + "': " + strerror(errno)};
+            return {1, "", "wc: cannot open file '" + filename + "': " + strerror(file.error)};
         }
 
         size_t lines = 0, words = 0, chars = 0;
-        char buffer[4096];
         bool inWord = false;
-        ssize_t bytesRead;
         bool lastCharWasNewline = true;
 
-        while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0) {
-            for (int i = 0; i < bytesRead; ++i) {
-                char c = buffer[i];
-                ++chars;
+        // A byte count of a regular file is just its size
+        struct stat st;
+        bool sizeOnly = countOnlyChars && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
 
-                if (c == '\n') {
-                    ++lines;
-                    lastCharWasNewline = true;
-                } else {
-                    lastCharWasNewline = false;
+        bool readOk = true;
+        if (sizeOnly) {
+            chars = st.st_size;
+        } else {
+            InputSource src(fd, file.preloaded, file.complete);
+            std::string_view chunk;
+
+            // Large chunks (whole mapping windows for files) keep the SIMD kernels busy
+            while ((readOk = src.next(chunk)) && !chunk.empty()) {
+                chars += chunk.size();
+
+                // "-l" alone skips word-state tracking entirely
+                if (countWords) {
+                    CountKernel::countLinesWords(chunk.data(), chunk.size(), lines, words, inWord);
+                } else if (countLines) {
+                    lines += CountKernel::countLines(chunk.data(), chunk.size());
                 }
 
-                if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-                    inWord = false;
-                } else if (!inWord) {
-                    ++words;
-                    inWord = true;
-                }
+                lastCharWasNewline = chunk.back() == '\n';
             }
         }
 
@@ -817,16 +1150,20 @@ CommandResult Commands::wcCommand(const std::vector<std::string>& args) {
             ++lines;
         }
 
-        if (bytesRead == -1) {
-            close(fd);
+        if (!readOk) {
+            if (!fromInput) close(fd);
             return {1, "", "wc: error reading file '" + filename + "': " + strerror(errno)};
         }
 
-        close(fd);
+        if (!fromInput) close(fd);
 
         if (countLines) out += std::to_string(lines) + " ";
         if (countWords) out += std::to_string(words) + " ";
         if (countChars) out += std::to_string(chars) + " ";
+
+        if (fromInput) {
+            out.pop_back();
+        }
         out += filename + "\n";
     }
 
@@ -839,7 +1176,7 @@ CommandResult Commands::wcCommand(const std::vector<std::string>& args) {
  * - Supports "-p" flag to recursively create each directory specified in the path
  * @return Status code, empty output on success, error message on failure
  */
-CommandResult Commands::mkdirCommand(const std::vector<std::string>& args) {
+CommandResult Commands::mkdirCommand(const std::vector<std::string>& args, IOContext&) {
     if (args.empty()) {
         return {1, "", "mkdir: missing directory argument"};
     }
@@ -893,19 +1230,33 @@ CommandResult Commands::mkdirCommand(const std::vector<std::string>& args) {
  * @brief Removes a file or directory tree.
  * @param args A file or directory path, with optional flags:
  *        "-r" Recursively remove a directory and its contents
+ *        "-j <num>" Number of worker threads for "-r" (default: one per core)
  * @return Status code, empty output on success, error message on failure
  */
-CommandResult Commands::rmCommand(const std::vector<std::string>& args) {
+CommandResult Commands::rmCommand(const std::vector<std::string>& args, IOContext&) {
     if (args.empty()) {
         return {1, "", "rm: missing operand"};
     }
 
     bool recursive = false;
+    size_t jobs = 0;
     int currentArg = 0;
 
     while (currentArg < args.size() && args[currentArg][0] == '-') {
         const std::string& flag = args[currentArg];
-        if (flag.find('r') != std::string::npos) {
+        if (flag == "-j") {
+            if (currentArg + 1 >= static_cast<int>(args.size())) {
+                return {1, "", "rm: option requires an argument -- 'j'"};
+            }
+            const std::string& value = args[++currentArg];
+            try {
+                int n = std::stoi(value);
+                if (n < 1) throw std::invalid_argument(value);
+                jobs = n;
+            } catch (...) {
+                return {1, "", "rm: invalid number of jobs '" + value + "'"};
+            }
+        } else if (flag.find('r') != std::string::npos) {
             recursive = true;
         } else {
             return {1, "", "rm: invalid option '" + flag + "'"};
@@ -917,38 +1268,28 @@ CommandResult Commands::rmCommand(const std::vector<std::string>& args) {
         }
     }
 
-    std::string out;
-
     for (; currentArg < args.size(); ++currentArg) {
         const std::string& path = args[currentArg];
 
+        // lstat: a symlink to a directory is removed as a link, never followed
         struct stat st;
-        if (stat(path.c_str(), &st) == -1) {
+        if (lstat(path.c_str(), &st) == -1) {
             return {1, "", "rm: cannot access '" + path + "': " + strerror(errno)};
         }
 
         if (S_ISDIR(st.st_mode)) {
-            if (recursive) {
-                DIR* dir = opendir(path.c_str());
-                if (!dir) {
-                    return {1, "", "rm: cannot open directory '" + path + "': " + strerror(errno)};
-                }
-
-                struct dirent* entry;
-                while ((entry = readdir(dir)) != nullptr) {
-                    std::string name = entry->d_name;
-                    if (name == "." || name == "..") continue;
-                    std::string subpath = path + "/" + name;
-                    rmCommand({recursive ? "-r" : "", subpath});
-                }
-                closedir(dir);
+            if (!recursive) {
+                return {1, "", "rm: '" + path + "' is a directory"};
+            }
 
-                if (rmdir(path.c_str()) == -1) {
-                    return {1, "", "rm: failed to remove directory '" + path + "': " + strerror(errno)};
+            std::vector<std::string> errors = TreeRemover::removeTree(path, jobs);
+            if (!errors.empty()) {
+                std::string msg;
+                for (const std::string& e : errors) {
+                    if (!msg.empty()) msg += "\n";
+                    msg += "rm: " + e;
                 }
-
-            } else {
-                return {1, "", "rm: '" + path + "' is a directory"};
+                return {1, "", msg};
             }
         } else {
             if (unlink(path.c_str()) == -1) {
@@ -957,7 +1298,7 @@ CommandResult Commands::rmCommand(const std::vector<std::string>& args) {
         }
     }
 
-    return {0, out, ""};
+    return {0, "", ""};
 }
 
 /**
@@ -967,7 +1308,7 @@ CommandResult Commands::rmCommand(const std::vector<std::string>& args) {
  *        - args[1]: Destination path
  * @return Status code, empty output on success, or an error message on failure
  */
-CommandResult Commands::mvCommand(const std::vector<std::string>& args) {
+CommandResult Commands::mvCommand(const std::vector<std::string>& args, IOContext&) {
     if (args.size() != 2) {
         return {1, "", "mv: requires exactly two arguments: source and destination"};
     }
@@ -993,30 +1334,20 @@ CommandResult Commands::mvCommand(const std::vector<std::string>& args) {
     */
     if (std::rename(src.c_str(), dest.c_str()) != 0) {
         if (errno == EXDEV) {
-            int in = open(src.c_str(), O_RDONLY);
-            if (in == -1) {
-                return {1, "", "mv: cannot open source file '" + src + "'"};
-            }
-
-            int out = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (out == -1) {
-                close(in);
-                return {1, "", "mv: cannot create destination file '" + dest + "'"};
-            }
-
-            char buffer[4096];
-            ssize_t bytesRead;
-            while ((bytesRead = read(in, buffer, sizeof(buffer))) > 0) {
-                if (write(out, buffer, bytesRead) != bytesRead) {
-                    close(in);
-                    close(out);
+            switch (CopyEngine::copyFile(src, dest)) {
+                case CopyEngine::Status::Ok:
+                    break;
+                case CopyEngine::Status::OpenSourceFailed:
+                    return {1, "", "mv: cannot open source file '" + src + "'"};
+                case CopyEngine::Status::CreateDestFailed:
+                    return {1, "", "mv: cannot create destination file '" + dest + "'"};
+                case CopyEngine::Status::ReadFailed:
+                case CopyEngine::Status::WriteFailed:
                     return {1, "", "mv: write error while copying to '" + dest + "'"};
-                }
+                case CopyEngine::Status::SameFile:
+                    return {1, "", "mv: '" + src + "' and '" + dest + "' are the same file"};
             }
 
-            close(in);
-            close(out);
-
             if (unlink(src.c_str()) != 0) {
                 return {1, "", "mv: copied but failed to remove original '" + src + "'"};
             }
@@ -1032,18 +1363,23 @@ CommandResult Commands::mvCommand(const std::vector<std::string>& args) {
 
 /**
  * @brief Modify file permissions for user, group, and others
- * @param args Expects two arguments: 
+ * @param args Expects two arguments, optionally preceded by "-R":
  *        - permissions (must be numeric)
  *        - file path
+ *        With "-R", everything below a directory is changed too (symlinks
+ *        met on the way are left alone, as chmod(2) cannot change them)
  * @return Status code, empty output on success, or error message on failure
  */
-CommandResult Commands::chmodCommand(const std::vector<std::string>& args) {
-    if (args.size() != 2) {
+CommandResult Commands::chmodCommand(const std::vector<std::string>& args, IOContext&) {
+    bool recursive = !args.empty() && args[0] == "-R";
+    size_t first = recursive ? 1 : 0;
+
+    if (args.size() - first != 2) {
         return {1, "", "chmod: requires exactly two arguments: permissions and file"};
     }
 
-    const std::string& perm = args[0];
-    const std::string& filename = args[1];
+    const std::string& perm = args[first];
+    const std::string& filename = args[first + 1];
 
     mode_t mode = 0;
     try {
@@ -1052,6 +1388,26 @@ CommandResult Commands::chmodCommand(const std::vector<std::string>& args) {
         return {1, "", "chmod: invalid permissions format"};
     }
 
+    if (recursive) {
+        TreeWalker walker(TreeWalker::Options{});
+        walker.onVisit([&walker, mode](const TreeWalker::Entry& entry) {
+            if (entry.type == DT_LNK) {
+                return false;
+            }
+            if (fchmodat(entry.dirFd, entry.name, mode, 0) != 0) {
+                walker.fail(entry, "failed to change permissions for", errno);
+            }
+            return entry.type == DT_DIR;
+        });
+
+        std::string msg;
+        for (const std::string& e : walker.run(filename)) {
+            if (!msg.empty()) msg += "\n";
+            msg += "chmod: " + e;
+        }
+        return {msg.empty() ? 0 : 1, "", msg};
+    }
+
     if (chmod(filename.c_str(), mode) != 0) {
         return {1, "", "chmod: failed to change permissions for '" + filename + "': " + strerror(errno)};
     }
@@ -1059,42 +1415,412 @@ CommandResult Commands::chmodCommand(const std::vector<std::string>& args) {
     return {0, "", ""};
 }
 
-/* --- Helper Functions --- */
-std::string Commands::formatLsLongListing(const std::string& name, const struct stat& info) {
+namespace {
+
+/**
+ * A numeric find test such as "-size +10k" or "-mtime -2": the value is
+ * compared after rounding up to unit, as GNU find does.
+ */
+struct FindNumber {
+    enum class Cmp { None, Less, Equal, Greater };
+
+    Cmp cmp = Cmp::None;
+    long long value = 0;
+
+    bool parse(const std::string& text) {
+        size_t i = 0;
+        cmp = Cmp::Equal;
+        if (!text.empty() && (text[0] == '+' || text[0] == '-')) {
+            cmp = text[0] == '+' ? Cmp::Greater : Cmp::Less;
+            i = 1;
+        }
+        if (i >= text.size() || !isdigit(static_cast<unsigned char>(text[i]))) {
+            return false;
+        }
+        size_t used = 0;
+        try {
+            value = std::stoll(text.substr(i), &used);
+        } catch (...) {
+            return false;
+        }
+        return i + used == text.size();
+    }
+
+    bool matches(long long n) const {
+        switch (cmp) {
+            case Cmp::Less:    return n < value;
+            case Cmp::Equal:   return n == value;
+            case Cmp::Greater: return n > value;
+            case Cmp::None:    break;
+        }
+        return true;
+    }
+};
+
+// Every predicate of one find invocation; all of them must hold
+struct FindQuery {
+    std::string name;        // -name glob, matched against the last component
+    unsigned char type = 0;  // -type, as a DT_* value (0 = any)
+    FindNumber size;         // -size, in sizeUnit blocks
+    long long sizeUnit = 512;
+    FindNumber mtime;        // -mtime, in whole days
+    time_t now = 0;
+
+    bool needsStat() const {
+        return size.cmp != FindNumber::Cmp::None || mtime.cmp != FindNumber::Cmp::None;
+    }
+
+    bool matches(const TreeWalker::Entry& entry) const {
+        if (type && entry.type != type) {
+            return false;
+        }
+
+        if (!name.empty()) {
+            // The root is matched by its basename, like "find dir/ -name dir"
+            std::string_view base = entry.name;
+            if (entry.depth == 0) {
+                while (base.size() > 1 && base.back() == '/') base.remove_suffix(1);
+                size_t slash = base.find_last_of('/');
+                if (slash != std::string_view::npos && base.size() > 1) base.remove_prefix(slash + 1);
+            }
+            if (fnmatch(name.c_str(), std::string(base).c_str(), 0) != 0) {
+                return false;
+            }
+        }
+
+        if (needsStat()) {
+            struct stat st;
+            if (fstatat(entry.dirFd, entry.name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                return false;
+            }
+            if (!size.matches((st.st_size + sizeUnit - 1) / sizeUnit)) {
+                return false;
+            }
+            if (!mtime.matches((now - st.st_mtime) / 86400)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+unsigned char findTypeOf(const std::string& arg) {
+    if (arg.size() != 1) return 0;
+    switch (arg[0]) {
+        case 'f': return DT_REG;
+        case 'd': return DT_DIR;
+        case 'l': return DT_LNK;
+        case 'b': return DT_BLK;
+        case 'c': return DT_CHR;
+        case 'p': return DT_FIFO;
+        case 's': return DT_SOCK;
+        default:  return 0;
+    }
+}
+
+} // namespace
+
+/**
+ * @brief Search directory trees for entries matching every given test
+ * The trees are walked in parallel; matches are printed in depth-first
+ * order with each directory's entries in byte order, so the output does
+ * not depend on the number of threads.
+ * @param args Paths (default "."), then any of:
+ *        - "-name <glob>"  last path component matches the shell glob
+ *        - "-type <c>"     f, d, l, b, c, p or s
+ *        - "-size [+-]N[cwbkMG]"  size in units (default 512-byte blocks), rounded up
+ *        - "-mtime [+-]N"  modified N whole days ago (+N: more, -N: fewer)
+ *        - "-maxdepth N"   descend at most N levels below the paths
+ *        - "-j N"          number of worker threads (default: one per core)
+ * @return Status code, matching paths written to the output, and possible error messages
+ */
+CommandResult Commands::findCommand(const std::vector<std::string>& args, IOContext& io) {
+    std::vector<std::string> roots;
+    size_t idx = 0;
+    while (idx < args.size() && (args[idx].empty() || args[idx][0] != '-')) {
+        roots.push_back(args[idx++]);
+    }
+    if (roots.empty()) {
+        roots.push_back(".");
+    }
+
+    FindQuery query;
+    query.now = time(nullptr);
+    TreeWalker::Options options;
+
+    for (; idx < args.size(); idx += 2) {
+        const std::string& test = args[idx];
+        if (test != "-name" && test != "-type" && test != "-size" && test != "-mtime" &&
+            test != "-maxdepth" && test != "-j") {
+            return {1, "", "find: unknown predicate '" + test + "'"};
+        }
+        if (idx + 1 >= args.size()) {
+            return {1, "", "find: missing argument to '" + test + "'"};
+        }
+
+        const std::string& value = args[idx + 1];
+        bool ok = true;
+
+        if (test == "-name") {
+            query.name = value;
+        } else if (test == "-type") {
+            query.type = findTypeOf(value);
+            ok = query.type != 0;
+        } else if (test == "-size") {
+            std::string digits = value;
+            char unit = digits.empty() ? 0 : digits.back();
+            if (unit && !isdigit(static_cast<unsigned char>(unit))) {
+                digits.pop_back();
+                switch (unit) {
+                    case 'c': query.sizeUnit = 1; break;
+                    case 'w': query.sizeUnit = 2; break;
+                    case 'b': query.sizeUnit = 512; break;
+                    case 'k': query.sizeUnit = 1024; break;
+                    case 'M': query.sizeUnit = 1024 * 1024; break;
+                    case 'G': query.sizeUnit = 1024LL * 1024 * 1024; break;
+                    default:  ok = false; break;
+                }
+            }
+            ok = ok && query.size.parse(digits);
+        } else if (test == "-mtime") {
+            ok = query.mtime.parse(value);
+        } else {
+            FindNumber n;
+            ok = n.parse(value) && n.cmp == FindNumber::Cmp::Equal && (test == "-maxdepth" || n.value > 0);
+            if (ok && test == "-maxdepth") options.maxDepth = n.value;
+            if (ok && test == "-j") options.threads = n.value;
+        }
+
+        if (!ok) {
+            return {1, "", "find: invalid argument '" + value + "' to '" + test + "'"};
+        }
+    }
+
+    // Like find -P: symlinks are reported, never followed, not even at the root
+    options.followRoot = false;
+    TreeWalker walker(options);
+
+    std::mutex matchMutex;
+    std::vector<std::string> matches;
+
+    walker.onVisit([&](const TreeWalker::Entry& entry) {
+        if (query.matches(entry)) {
+            std::string path = entry.path();
+            std::lock_guard<std::mutex> lock(matchMutex);
+            matches.push_back(std::move(path));
+        }
+        return true;
+    });
+
+    std::string msg;
+    TextArena out;
+
+    for (const std::string& root : roots) {
+        for (const std::string& e : walker.run(root)) {
+            if (!msg.empty()) msg += "\n";
+            msg += "find: " + e;
+        }
+
+        TreeWalker::sortPaths(matches);
+        for (const std::string& path : matches) {
+            out.append(path);
+            out.put('\n');
+        }
+        matches.clear();
+
+        io.out->write(out.data(), out.size());
+        out.clear();
+    }
+
+    return {msg.empty() ? 0 : 1, "", msg};
+}
+
+/**
+ * @brief Report hit/miss statistics for the shell's session caches
+ * @param args Empty to print statistics, "clear" to empty every cache
+ *        and reset its counters, or "dir on"/"dir off" to toggle the
+ *        directory listing cache
+ * @return Status code and one line per cache, or an error message on failure
+ */
+CommandResult Commands::cacheCommand(const std::vector<std::string>& args, IOContext&) {
+    if (args.size() == 2 && args[0] == "dir" && (args[1] == "on" || args[1] == "off")) {
+        DirCache::setEnabled(args[1] == "on");
+        return {0, "", ""};
+    }
+
+    if (args.size() > 1 || (args.size() == 1 && args[0] != "clear")) {
+        return {1, "", "cache: usage: cache [clear | dir on|off]"};
+    }
+
+    if (!args.empty()) {
+        MatcherCache::clear();
+        PathCache::clear();
+        DirCache::clear();
+        return {0, "", ""};
+    }
+
+    MatcherCache::Stats regex = MatcherCache::stats();
+    std::string out = "regex: " + std::to_string(regex.hits) + " hits, " +
+                      std::to_string(regex.misses) + " misses, " +
+                      std::to_string(regex.evictions) + " evictions, " +
+                      std::to_string(regex.size) + "/" + std::to_string(regex.capacity) + " entries";
+
+    PathCache::Stats path = PathCache::stats();
+    out += "\npath: " + std::to_string(path.hits) + " hits, " +
+           std::to_string(path.misses) + " misses, " +
+           std::to_string(path.invalidations) + " invalidations, " +
+           std::to_string(path.size) + " entries";
+
+    DirCache::Stats dir = DirCache::stats();
+    out += "\ndir: " + std::to_string(dir.hits) + " hits, " +
+           std::to_string(dir.misses) + " misses, " +
+           std::to_string(dir.invalidations) + " invalidations, " +
+           std::to_string(dir.evictions) + " evictions, " +
+           std::to_string(dir.size) + "/" + std::to_string(dir.capacity) + " entries";
+    if (!dir.enabled) {
+        out += " (off)";
+    }
+
+    return {0, out, ""};
+}
+
+/**
+ * @brief List the shell's background jobs
+ * @param args Must be empty
+ * @return Status code and one "[N] state command" line per job
+ */
+CommandResult Commands::jobsCommand(const std::vector<std::string>& args, IOContext&) {
+    if (!args.empty()) {
+        return {1, "", "jobs: this command takes no arguments"};
+    }
+
     std::string out;
+    for (const JobTable::Job& job : JobTable::list()) {
+        out += "[" + std::to_string(job.id) + "] " + JobTable::describe(job) + "\t" + job.command + "\n";
+    }
+
+    // Finished jobs have now been reported
+    JobTable::takeFinished();
+
+    return {0, out, "", true};
+}
+
+/**
+ * @brief Block until background jobs finish
+ * @param args Job numbers ("N" or "%N"); with none, waits for every job
+ * @return The status of the last job waited for (0 when waiting for all),
+ *         or an error message for an unknown job
+ */
+CommandResult Commands::waitCommand(const std::vector<std::string>& args, IOContext& io) {
+    io.out->flush();
+
+    if (args.empty()) {
+        int status;
+        for (const JobTable::Job& job : JobTable::list()) {
+            JobTable::wait(job.id, status);
+        }
+        return {0, "", ""};
+    }
+
+    int status = 0;
+    for (const std::string& spec : args) {
+        int id;
+        if (!parseJobSpec(spec, id) || !JobTable::wait(id, status)) {
+            return {127, "", "wait: " + spec + ": no such job"};
+        }
+    }
+
+    return {status, "", ""};
+}
+
+/**
+ * @brief Bring a background job to the foreground and wait for it
+ * There is no terminal job control, so this waits for the job to finish.
+ * @param args An optional job number ("N" or "%N"); defaults to the most recent job
+ * @return The job's exit status, or an error message if there is no such job
+ */
+CommandResult Commands::fgCommand(const std::vector<std::string>& args, IOContext& io) {
+    if (args.size() > 1) {
+        return {1, "", "fg: too many arguments"};
+    }
 
-    char type = S_ISDIR(info.st_mode) ? 'd' : '-';
-    out += type;
+    int id = JobTable::mostRecent();
+    if (!args.empty() && !parseJobSpec(args[0], id)) {
+        return {1, "", "fg: " + args[0] + ": no such job"};
+    }
+    if (id == -1) {
+        return {1, "", "fg: no current job"};
+    }
+
+    const JobTable::Job* found = nullptr;
+    std::vector<JobTable::Job> jobs = JobTable::list();
+    for (const JobTable::Job& job : jobs) {
+        if (job.id == id) found = &job;
+    }
+    if (!found) {
+        return {1, "", "fg: " + std::to_string(id) + ": no such job"};
+    }
 
-    out += ((info.st_mode & S_IRUSR) ? 'r' : '-');
-    out += ((info.st_mode & S_IWUSR) ? 'w' : '-');
-    out += ((info.st_mode & S_IXUSR) ? 'x' : '-');
-    out += ((info.st_mode & S_IRGRP) ? 'r' : '-');
-    out += ((info.st_mode & S_IWGRP) ? 'w' : '-');
-    out += ((info.st_mode & S_IXGRP) ? 'x' : '-');
-    out += ((info.st_mode & S_IROTH) ? 'r' : '-');
-    out += ((info.st_mode & S_IWOTH) ? 'w' : '-');
-    out += ((info.st_mode & S_IXOTH) ? 'x' : '-');
-    out += " " + std::to_string(info.st_nlink);
+    io.out->write(found->command + "\n");
+    io.out->flush();
+
+    int status;
+    if (!JobTable::wait(id, status)) {
+        return {1, "", "fg: " + std::to_string(id) + ": no such job"};
+    }
+
+    return {status, "", ""};
+}
+
+/**
+ * @brief Inspect the remembered locations of external programs
+ * @param args Empty to list them, "-r" to forget them all, or program
+ *        names to look up and remember now
+ * @return Status code and a "hits<TAB>command" table, or an error message
+ *         for a name that is not on $PATH
+ */
+CommandResult Commands::hashCommand(const std::vector<std::string>& args, IOContext&) {
+    if (args.size() == 1 && args[0] == "-r") {
+        PathCache::clear();
+        return {0, "", ""};
+    }
 
-    struct passwd* pw = getpwuid(info.st_uid);
-    std::string user = pw ? pw->pw_name : std::to_string(info.st_uid);
-    out += " " + user;
+    if (!args.empty()) {
+        for (const std::string& name : args) {
+            if (name.find('/') == std::string::npos && PathCache::lookup(name).empty()) {
+                return {1, "", "hash: " + name + ": not found"};
+            }
+        }
+        return {0, "", ""};
+    }
 
-    struct group* gr = getgrgid(info.st_gid);
-    std::string group = gr ? gr->gr_name : std::to_string(info.st_gid);
-    out += " " + group;
+    std::vector<PathCache::Entry> entries = PathCache::entries();
+    if (entries.empty()) {
+        return {0, "hash: hash table empty", ""};
+    }
 
-    out += " " + std::to_string(info.st_size);
+    std::string out = "hits\tcommand";
+    for (const PathCache::Entry& e : entries) {
+        out += "\n" + std::to_string(e.hits) + "\t" + e.path;
+    }
 
-    char timebuf[64];
-    struct tm* t = localtime(&info.st_mtime);
-    strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", t);
-    out += " " + std::string(timebuf);
+    return {0, out, ""};
+}
 
-    out += " " + name + "\n";
+/* --- Helper Functions --- */
+bool Commands::parseJobSpec(const std::string& spec, int& id) {
+    std::string digits = !spec.empty() && spec[0] == '%' ? spec.substr(1) : spec;
+    if (digits.empty() || digits.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
 
-    return out;
+    try {
+        id = std::stoi(digits);
+    } catch (...) {
+        return false;
+    }
+    return true;
 }
 
 std::string Commands::formatRmdirErrorMsg(const std::string& path) {
@@ -1118,22 +1844,339 @@ std::string Commands::formatRmdirErrorMsg(const std::string& path) {
     }
 }
 
-bool Commands::matchesPattern(const std::string& line, const std::regex& re, bool printOnlyMatch, std::string& outMatch) {
-    std::smatch match;
-    
-    if (!std::regex_search(line, match, re)) {
-        return false;
+/**
+ * @brief Scan the lines in [p, end) for matches
+ * The matcher's literal search runs over the whole range at once, so lines
+ * that cannot match are skipped without being looked at individually. The
+ * last line of the range may lack its newline.
+ */
+void Commands::scanRegion(const char* p, const char* end, GrepScan& scan) {
+    const Matcher& matcher = *scan.matcher;
+
+    while (p < end && !scan.limitReached) {
+        size_t offset = matcher.findCandidate(p, end - p);
+
+        // Start of the line holding the next candidate; everything before it cannot match
+        const char* lineStart = end;
+        if (offset != Matcher::npos) {
+            const char* candidate = p + offset;
+            const void* prevNewline = memrchr(p, '\n', candidate - p);
+            lineStart = prevNewline ? static_cast<const char*>(prevNewline) + 1 : p;
+        }
+
+        if (scan.invert) {
+            while (p < lineStart && !scan.limitReached) {
+                const void* nl = memchr(p, '\n', lineStart - p);
+                const char* lineEnd = nl ? static_cast<const char*>(nl) : lineStart;
+                reportLine(std::string_view(p, lineEnd - p), 0, lineEnd - p, scan);
+                ++scan.lineNumber;
+                p = lineEnd < lineStart ? lineEnd + 1 : lineStart;
+            }
+        } else if (scan.lineNumbers) {
+            scan.lineNumber += CountKernel::countLines(p, lineStart - p);
+        }
+
+        if (lineStart >= end || scan.limitReached) {
+            break;
+        }
+
+        const void* nl = memchr(lineStart, '\n', end - lineStart);
+        const char* lineEnd = nl ? static_cast<const char*>(nl) : end;
+
+        std::string_view line(lineStart, lineEnd - lineStart);
+        size_t matchStart = 0, matchLen = 0;
+        bool matched = matcher.matchLine(line, matchStart, matchLen);
+
+        if (matched != scan.invert) {
+            if (scan.invert) {
+                matchStart = 0;
+                matchLen = line.size();
+            }
+            reportLine(line, matchStart, matchLen, scan);
+        }
+
+        ++scan.lineNumber;
+        p = lineEnd < end ? lineEnd + 1 : end;
+    }
+}
+
+void Commands::reportLine(std::string_view line, size_t matchStart, size_t matchLen, GrepScan& scan) {
+    if (scan.maxCount != -1 && scan.totalMatches >= scan.maxCount) {
+        scan.limitReached = true;
+        return;
     }
 
-    if (printOnlyMatch) {
-        outMatch = match.str();
+    ++scan.totalMatches;
+
+    if (scan.countOnly) {
+        return;
+    }
+
+    if (scan.label) {
+        scan.out.append(*scan.label);
+        scan.out.put(':');
+    }
+
+    if (scan.lineNumbers) {
+        scan.out.appendNumber(scan.lineNumber);
+        scan.out.put(':');
+    }
+
+    if (scan.onlyMatching) {
+        scan.out.append(line.substr(matchStart, matchLen));
     } else {
-        outMatch = line;
+        scan.out.append(line);
+    }
+    scan.out.put('\n');
+
+    if (scan.recordEnds) {
+        scan.ends.push_back(scan.out.size());
+    }
+}
+
+/**
+ * @brief Run grep over everything readable from src
+ * Regular files are mapped and scanned in line-aligned windows; pipes and
+ * other descriptors are read into a reusable buffer where only the partial
+ * last line is carried over between reads. The final line without a
+ * newline goes through the same path as every other line.
+ * @return false on a read error (errno set)
+ */
+bool Commands::scanInput(InputSource& src, GrepScan& scan, OutputSink& out) {
+    std::string_view chunk;
+
+    while (!scan.limitReached) {
+        if (!src.nextLines(chunk)) {
+            return false;
+        }
+        if (chunk.empty()) {
+            break;
+        }
+
+        scanRegion(chunk.data(), chunk.data() + chunk.size(), scan);
+        flushGrepOutput(scan, out);
     }
 
     return true;
 }
 
+/**
+ * @brief Run grep over files on a thread pool
+ * Files are taken from nextFile in order, opened and handed to the pool one
+ * job each; a regular file larger than kGrepChunk is mapped once and split
+ * into line-aligned slices, one job per slice. Every job scans into its own arena and the arenas are
+ * written out strictly in submission order, so output is identical to a
+ * serial run. At most a few jobs per thread are in flight, which bounds the
+ * open files, mappings and buffered output however many files there are.
+ * For "-n", the newlines of a split file's slices are counted first to give
+ * each slice its starting line number. For "-m", every job stops after the
+ * limit on its own, only the first matches up to the global limit are
+ * written, and jobs not started yet are skipped once it is reached.
+ * @param nextFile Stores the next path to search, false when there are no more
+ * @param scan Options for the run; receives the total match count
+ * @return An error message for the first file that cannot be read, after
+ *         the output of the files before it has been written; empty otherwise
+ */
+std::string Commands::grepParallel(const std::function<bool(std::string&)>& nextFile, bool multipleFiles,
+                                   GrepScan& scan, size_t threads, OutputSink& out) {
+    const size_t window = threads * 4;
+
+    WorkPool pool(threads);
+    std::deque<GrepJob> jobs; // submitted but not written out yet, oldest first
+    std::mutex doneMutex;
+    std::condition_variable doneCond;
+    std::atomic<bool> stop{false};
+    std::string error;
+    int emitted = 0;
+
+    auto runJob = [&stop](GrepJob& job) {
+        try {
+            if (job.map) {
+                if (!stop.load(std::memory_order_relaxed)) {
+                    scanRegion(job.begin, job.end, job.scan);
+                }
+            } else {
+                // Mapped in windows above the mmap threshold, read below it
+                InputSource src(job.fd, kGrepWindow);
+                std::string_view chunk;
+                while (!job.scan.limitReached && !stop.load(std::memory_order_relaxed)) {
+                    if (!src.nextLines(chunk)) {
+                        job.error = "grep: error reading '" + job.path + "': " + strerror(errno);
+                        break;
+                    }
+                    if (chunk.empty()) break;
+                    scanRegion(chunk.data(), chunk.data() + chunk.size(), job.scan);
+                }
+            }
+        } catch (const std::exception& ex) {
+            job.error = "grep: " + job.path + ": " + ex.what();
+        }
+
+        if (job.fd != -1) {
+            close(job.fd);
+            job.fd = -1;
+        }
+        job.map.reset();
+    };
+
+    // Wait for the oldest job and write its output
+    auto emitOldest = [&] {
+        GrepJob& job = jobs.front();
+        {
+            std::unique_lock<std::mutex> lock(doneMutex);
+            doneCond.wait(lock, [&job] { return job.done; });
+        }
+
+        if (!stop && !job.error.empty()) {
+            error = job.error;
+            stop = true;
+        } else if (!stop) {
+            int take = job.scan.totalMatches;
+            if (scan.maxCount != -1) {
+                take = std::min(take, scan.maxCount - emitted);
+            }
+
+            if (!scan.countOnly && take > 0) {
+                size_t bytes = take < job.scan.totalMatches ? job.scan.ends[take - 1] : job.scan.out.size();
+                if (!out.write(job.scan.out.data(), bytes)) {
+                    stop = true;
+                }
+            }
+
+            emitted += take;
+            if (scan.maxCount != -1 && emitted >= scan.maxCount) {
+                stop = true;
+            }
+        }
+
+        jobs.pop_front();
+    };
+
+    // Queue a job behind the ones in flight; run == false for a failure that only needs reporting
+    auto enqueue = [&](GrepJob&& job, bool run) {
+        while (jobs.size() >= window) {
+            emitOldest();
+        }
+
+        jobs.push_back(std::move(job));
+        GrepJob& queued = jobs.back();
+        queued.scan.label = multipleFiles ? &queued.path : nullptr;
+        queued.done = !run;
+        if (!run) {
+            return;
+        }
+
+        pool.submit([&queued, &runJob, &doneMutex, &doneCond] {
+            runJob(queued);
+            std::lock_guard<std::mutex> lock(doneMutex);
+            queued.done = true;
+            doneCond.notify_all();
+        });
+    };
+
+    std::string path;
+    while (!stop && nextFile(path)) {
+        GrepJob job;
+        job.path = std::move(path);
+        job.scan = scan;
+        job.scan.recordEnds = scan.maxCount != -1 && !scan.countOnly;
+
+        job.fd = open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (job.fd == -1) {
+            job.error = "grep: cannot open file '" + job.path + "'";
+            enqueue(std::move(job), false);
+            continue;
+        }
+
+        if (!scan.countOnly && out.feedsBack(job.fd, 0)) {
+            close(job.fd);
+            job.fd = -1;
+            job.error = "grep: " + job.path + ": input file is also the output";
+            enqueue(std::move(job), false);
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(job.fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= static_cast<off_t>(kGrepChunk)) {
+            enqueue(std::move(job), true);
+            continue;
+        }
+
+        auto map = std::make_shared<MappedFile>();
+        bool mapped = map->map(job.fd);
+        int savedErrno = errno;
+        close(job.fd);
+        job.fd = -1;
+
+        if (!mapped) {
+            job.error = "grep: error reading '" + job.path + "': " + strerror(savedErrno);
+            enqueue(std::move(job), false);
+            continue;
+        }
+
+        std::string_view view = map->view();
+        const char* end = view.data() + view.size();
+        std::vector<std::pair<const char*, const char*>> slices;
+        for (const char* p = view.data(); p < end;) {
+            const char* sliceEnd = p + std::min<size_t>(kGrepChunk, end - p);
+            if (sliceEnd < end) {
+                const void* nl = memchr(sliceEnd, '\n', end - sliceEnd);
+                sliceEnd = nl ? static_cast<const char*>(nl) + 1 : end;
+            }
+            slices.emplace_back(p, sliceEnd);
+            p = sliceEnd;
+        }
+
+        // Starting line of every slice, counted on the pool while earlier jobs run
+        std::vector<size_t> lines(slices.size(), 0);
+        if (scan.lineNumbers) {
+            size_t remaining = slices.size() - 1;
+            for (size_t i = 0; i + 1 < slices.size(); ++i) {
+                pool.submit([&, i] {
+                    size_t n = CountKernel::countLines(slices[i].first, slices[i].second - slices[i].first);
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    lines[i] = n;
+                    if (--remaining == 0) doneCond.notify_all();
+                });
+            }
+            std::unique_lock<std::mutex> lock(doneMutex);
+            doneCond.wait(lock, [&remaining] { return remaining == 0; });
+        }
+
+        long lineNumber = scan.lineNumber;
+        for (size_t i = 0; i < slices.size() && !stop; ++i) {
+            GrepJob slice;
+            slice.path = job.path;
+            slice.map = map;
+            slice.begin = slices[i].first;
+            slice.end = slices[i].second;
+            slice.scan = job.scan;
+            slice.scan.lineNumber = lineNumber;
+            lineNumber += lines[i];
+            enqueue(std::move(slice), true);
+        }
+    }
+
+    while (!jobs.empty()) {
+        emitOldest();
+    }
+    pool.wait();
+
+    scan.totalMatches = emitted;
+    return error;
+}
+
+// Hand completed lines downstream as soon as each region is scanned
+void Commands::flushGrepOutput(GrepScan& scan, OutputSink& out) {
+    if (scan.out.empty()) {
+        return;
+    }
+    if (!out.write(scan.out.data(), scan.out.size())) {
+        scan.limitReached = true;
+    }
+    scan.out.clear();
+}
+
 std::string Commands::stripTrailingNewline(const std::string& s) {
     if (!s.empty() && s.back() == '\n') {
         return s.substr(0, s.size() - 1);
@@ -1141,10 +2184,3 @@ std::string Commands::stripTrailingNewline(const std::string& s) {
     return s;
 }
 
-bool Commands::isFileEmpty(const std::string& filename) {
-    struct stat st;
-    if (stat(filename.c_str(), &st) != 0) {
-        return false;
-    }
-    return st.st_size == 0;
-}
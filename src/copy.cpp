@@ -0,0 +1,500 @@
+#include "copy.h"
+#include "walk.h"
+#include "stream.h"
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <cstdlib>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <limits.h>
+
+// Upper bound on a single in-kernel transfer request
+static constexpr off_t kKernelChunk = 1 << 30;
+
+// Errors meaning "this mechanism does not apply here", as opposed to real I/O failures
+static bool isUnsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV ||
+           err == EOPNOTSUPP || err == ENOTTY || err == EBADF || err == ETXTBSY;
+}
+
+/**
+ * @brief Open the destination of a copy and empty it
+ * Truncation waits until dest is known not to be the source itself, so
+ * "cp a a" or a hard link back to the source cannot wipe the data first.
+ * @param srcInfo fstat of the source
+ * @param sameFile Set when dest is the source; errno is then EEXIST
+ * @return The open destination, or -1 with errno set
+ */
+static int openDestination(int dirFd, const char* path, mode_t mode, const struct stat& srcInfo, bool& sameFile) {
+    sameFile = false;
+    int fd = openat(dirFd, path, O_WRONLY | O_CREAT | O_CLOEXEC, mode);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (info.st_dev == srcInfo.st_dev && info.st_ino == srcInfo.st_ino) {
+        close(fd);
+        sameFile = true;
+        errno = EEXIST;
+        return -1;
+    }
+
+    // Devices such as /dev/null take no truncation, which O_TRUNC ignored too
+    if (S_ISREG(info.st_mode) && info.st_size != 0 && ftruncate(fd, 0) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Size of the read/write fallback buffer
+ * @return CUSTOM_SHELL_COPY_BUFFER (bytes) when set to a sane value, otherwise 1 MiB
+ */
+size_t CopyEngine::bufferSize() {
+    static const size_t size = [] {
+        const char* env = getenv("CUSTOM_SHELL_COPY_BUFFER");
+        if (env) {
+            char* end = nullptr;
+            unsigned long long v = strtoull(env, &end, 10);
+            if (end != env && *end == '\0' && v >= 4096 && v <= (1ULL << 30)) {
+                return static_cast<size_t>(v);
+            }
+        }
+        return kDefaultBufferSize;
+    }();
+    return size;
+}
+
+/**
+ * @brief Copy src to dest, creating or truncating dest
+ * @param mode Permission bits for a newly created destination
+ * @return Ok, or the step that failed (errno preserved)
+ */
+CopyEngine::Status CopyEngine::copyFile(const std::string& src, const std::string& dest, mode_t mode) {
+    int srcFd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (srcFd == -1) {
+        return Status::OpenSourceFailed;
+    }
+
+    Status status = copyFile(srcFd, dest, mode);
+    int err = errno;
+    close(srcFd);
+    errno = err;
+    return status;
+}
+
+/**
+ * @brief Copy an already opened source to dest, creating or truncating dest
+ * @param srcFd Open source, read from its start; left open for the caller
+ * @param mode Permission bits for a newly created destination
+ * @return Ok, SameFile if dest is the source itself, or the step that failed
+ *         (errno preserved)
+ */
+CopyEngine::Status CopyEngine::copyFile(int srcFd, const std::string& dest, mode_t mode) {
+    struct stat info;
+    if (fstat(srcFd, &info) == -1) {
+        return Status::ReadFailed;
+    }
+
+    bool sameFile;
+    int destFd = openDestination(AT_FDCWD, dest.c_str(), mode, info, sameFile);
+    if (destFd == -1) {
+        return sameFile ? Status::SameFile : Status::CreateDestFailed;
+    }
+
+    Status status = copyFd(srcFd, destFd, info);
+    int err = errno;
+
+    if (close(destFd) == -1 && status == Status::Ok) {
+        return Status::WriteFailed;
+    }
+
+    errno = err;
+    return status;
+}
+
+/**
+ * @brief Copy the whole of srcFd into the (empty) destFd
+ * @param srcInfo fstat of srcFd, used to pick a strategy
+ */
+CopyEngine::Status CopyEngine::copyFd(int srcFd, int destFd, const struct stat& srcInfo) {
+    // Pipes, character devices, ... have no size or offsets to work with
+    if (!S_ISREG(srcInfo.st_mode)) {
+        return copyStream(srcFd, destFd);
+    }
+
+    const off_t size = srcInfo.st_size;
+    if (size == 0) {
+        return Status::Ok;
+    }
+
+    // Reflink shares the source's extents outright, holes included
+    if (ioctl(destFd, FICLONE, srcFd) == 0) {
+        return Status::Ok;
+    }
+
+    Method method = Method::CopyFileRange;
+
+    // Fewer allocated blocks than the apparent size means the file has holes
+    const bool sparse = static_cast<off_t>(srcInfo.st_blocks) * 512 < size;
+
+    if (!sparse) {
+        // Best effort: lets the filesystem lay the file out contiguously
+        const bool preallocated = fallocate(destFd, 0, 0, size) == 0;
+
+        off_t copied = 0;
+        Status status = copyRange(srcFd, destFd, copied, size, method);
+
+        // A failed copy or a source that shrank must not keep the preallocated tail
+        if (preallocated && copied < size) {
+            const int savedErrno = errno;
+            if (ftruncate(destFd, copied) == -1 && status == Status::Ok) {
+                return Status::WriteFailed;
+            }
+            errno = savedErrno;
+        }
+        return status;
+    }
+
+    off_t offset = 0;
+    while (offset < size) {
+        off_t dataStart = lseek(srcFd, offset, SEEK_DATA);
+        if (dataStart == -1) {
+            if (errno == ENXIO) break; // only a hole remains
+            if (isUnsupported(errno)) {
+                off_t copied = 0;
+                return copyRange(srcFd, destFd, copied, size, method);
+            }
+            return Status::ReadFailed;
+        }
+
+        off_t dataEnd = lseek(srcFd, dataStart, SEEK_HOLE);
+        if (dataEnd == -1) {
+            return Status::ReadFailed;
+        }
+
+        off_t copied = dataStart;
+        Status status = copyRange(srcFd, destFd, copied, dataEnd - dataStart, method);
+        if (status != Status::Ok) {
+            return status;
+        }
+
+        offset = dataEnd;
+    }
+
+    // Trailing holes are recreated by extending the file to its full size
+    if (ftruncate(destFd, size) == -1) {
+        return Status::WriteFailed;
+    }
+
+    return Status::Ok;
+}
+
+/**
+ * @brief Copy length bytes at offset from srcFd to the same offset in destFd
+ * @param offset Start of the range; left at the end of what was written, also on failure
+ * @param method Cheapest method still worth trying; downgraded as methods turn out unsupported
+ */
+CopyEngine::Status CopyEngine::copyRange(int srcFd, int destFd, off_t& offset, off_t length, Method& method) {
+    off_t inOff = offset;
+    const off_t end = offset + length;
+
+    while (inOff < end && method == Method::CopyFileRange) {
+        size_t want = static_cast<size_t>(std::min(end - inOff, kKernelChunk));
+        ssize_t n = copy_file_range(srcFd, &inOff, destFd, &offset, want, 0);
+        if (n > 0) continue;
+        if (n == 0) return Status::Ok; // source shrank underneath us
+        if (errno == EINTR) continue;
+        if (!isUnsupported(errno)) return Status::WriteFailed;
+        method = Method::Sendfile;
+    }
+
+    // sendfile writes at the destination's file offset
+    if (inOff < end && method == Method::Sendfile) {
+        if (lseek(destFd, offset, SEEK_SET) == -1) {
+            method = Method::Buffered;
+        }
+    }
+
+    while (inOff < end && method == Method::Sendfile) {
+        size_t want = static_cast<size_t>(std::min(end - inOff, kKernelChunk));
+        ssize_t n = sendfile(destFd, srcFd, &inOff, want);
+        if (n > 0) {
+            offset += n;
+            continue;
+        }
+        if (n == 0) return Status::Ok;
+        if (errno == EINTR) continue;
+        if (!isUnsupported(errno)) return Status::WriteFailed;
+        method = Method::Buffered;
+    }
+
+    if (inOff < end) {
+        return copyBuffered(srcFd, destFd, offset, end - inOff);
+    }
+
+    return Status::Ok;
+}
+
+/**
+ * @brief pread/pwrite fallback for copyRange
+ * @param offset Start of the range; left at the end of what was written, also on failure
+ */
+CopyEngine::Status CopyEngine::copyBuffered(int srcFd, int destFd, off_t& offset, off_t length) {
+    // One buffer per thread, reused across files
+    thread_local std::vector<char> buffer;
+
+    size_t capacity = std::min(bufferSize(), static_cast<size_t>(length));
+    if (buffer.size() < capacity) {
+        buffer.resize(capacity);
+    }
+
+    const off_t end = offset + length;
+    while (offset < end) {
+        size_t want = static_cast<size_t>(std::min<off_t>(end - offset, buffer.size()));
+        ssize_t bytesRead = pread(srcFd, buffer.data(), want, offset);
+        if (bytesRead == 0) break;
+        if (bytesRead == -1) {
+            if (errno == EINTR) continue;
+            return Status::ReadFailed;
+        }
+
+        ssize_t written = 0;
+        while (written < bytesRead) {
+            ssize_t n = pwrite(destFd, buffer.data() + written, bytesRead - written, offset);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return Status::WriteFailed;
+            }
+            written += n;
+            offset += n;
+        }
+    }
+
+    return Status::Ok;
+}
+
+CopyEngine::Status CopyEngine::copyStream(int srcFd, int destFd) {
+    InputSource src(srcFd, bufferSize());
+    std::string_view chunk;
+
+    while (true) {
+        if (!src.next(chunk)) return Status::ReadFailed;
+        if (chunk.empty()) return Status::Ok;
+
+        size_t written = 0;
+        while (written < chunk.size()) {
+            ssize_t n = write(destFd, chunk.data() + written, chunk.size() - written);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return Status::WriteFailed;
+            }
+            written += n;
+        }
+    }
+}
+
+namespace {
+
+// The copy of a source directory; its fd is shared by every task copying into it
+struct DestDir {
+    int fd = -1;
+    bool restoreMode = false; // created owner-writable; finalMode is applied once the children are in
+    mode_t finalMode = 0;
+
+    DestDir(int fd, bool restoreMode, mode_t finalMode) : fd(fd), restoreMode(restoreMode), finalMode(finalMode) {}
+    ~DestDir() {
+        if (fd != -1) close(fd);
+    }
+};
+
+int destFdOf(const TreeWalker::Entry& entry) {
+    return static_cast<const DestDir*>(entry.dirData.get())->fd;
+}
+
+void copyEntryFile(TreeWalker& walker, const TreeWalker::Entry& entry) {
+    int in = openat(entry.dirFd, entry.name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1) {
+        walker.fail(entry, "cannot open source file", errno);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(in, &st) == -1) {
+        walker.fail(entry, "cannot stat", errno);
+        close(in);
+        return;
+    }
+
+    bool sameFile;
+    int out = openDestination(destFdOf(entry), entry.name, st.st_mode & 0777, st, sameFile);
+    if (out == -1) {
+        walker.fail(entry, sameFile ? "cannot copy onto itself" : "cannot create destination file", errno);
+        close(in);
+        return;
+    }
+
+    CopyEngine::Status status = CopyEngine::copyFd(in, out, st);
+    if (status == CopyEngine::Status::ReadFailed) {
+        walker.fail(entry, "read error on", errno);
+    } else if (status == CopyEngine::Status::WriteFailed) {
+        walker.fail(entry, "write error on", errno);
+    }
+
+    close(in);
+    close(out);
+}
+
+void copyEntrySymlink(TreeWalker& walker, const TreeWalker::Entry& entry) {
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(entry.dirFd, entry.name, target, sizeof(target) - 1);
+    if (len == -1) {
+        walker.fail(entry, "cannot read symbolic link", errno);
+        return;
+    }
+    target[len] = '\0';
+
+    if (symlinkat(target, destFdOf(entry), entry.name) == -1) {
+        walker.fail(entry, "cannot create symbolic link", errno);
+    }
+}
+
+/**
+ * @brief Create the copy of a directory with mode srcMode, writable by us until it is filled
+ * @param created Set when the directory did not exist yet
+ * @return 0, or -1 with errno set
+ */
+int makeDestDir(int parentFd, const char* name, mode_t srcMode, bool& created) {
+    created = mkdirat(parentFd, name, (srcMode & 07777) | S_IRWXU) == 0;
+    return created || errno == EEXIST ? 0 : -1;
+}
+
+/**
+ * @brief Destination directory state for a copy of a source directory with mode srcMode
+ * A directory we created gets the source's permissions less the umask, like
+ * the files, once its children are in; until then it stays owner-writable.
+ */
+std::shared_ptr<DestDir> makeDestData(int fd, mode_t srcMode, mode_t mask, bool created) {
+    const mode_t mode = srcMode & 07777 & ~mask;
+    return std::make_shared<DestDir>(fd, created && (mode & S_IRWXU) != S_IRWXU, mode);
+}
+
+} // namespace
+
+/**
+ * @brief Recursively copy the directory src to dest
+ * The copy is driven by a TreeWalker: each directory is created (and
+ * opened) when it is visited, before anything inside it is scheduled, and
+ * its entries are copied by whichever worker visits them.
+ * @return One message per failure
+ */
+std::vector<std::string> CopyEngine::copyTree(const std::string& src, const std::string& dest, size_t threads) {
+    TreeWalker::Options options;
+    options.threads = threads;
+    TreeWalker walker(options);
+
+    // umask(2) can only be read by setting it; the walk uses it to finish directories
+    const mode_t mask = umask(0);
+    umask(mask);
+
+    // The destination root; skipped if it lives inside the source
+    dev_t destDev = 0;
+    ino_t destIno = 0;
+
+    walker.onVisit([&](const TreeWalker::Entry& entry) {
+        if (entry.depth == 0) {
+            struct stat st;
+            if (stat(src.c_str(), &st) == -1) {
+                walker.fail("cannot stat", src, errno);
+                return false;
+            }
+            bool created;
+            if (makeDestDir(AT_FDCWD, dest.c_str(), st.st_mode, created) == -1) {
+                walker.fail("cannot create directory", dest, errno);
+                return false;
+            }
+
+            int fd = open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd == -1) {
+                walker.fail("cannot open destination directory", dest, errno);
+                return false;
+            }
+
+            struct stat destSt;
+            if (fstat(fd, &destSt) == 0) {
+                destDev = destSt.st_dev;
+                destIno = destSt.st_ino;
+            }
+            *entry.childData = makeDestData(fd, st.st_mode, mask, created);
+            return true;
+        }
+
+        switch (entry.type) {
+            case DT_REG:
+                copyEntryFile(walker, entry);
+                return false;
+
+            case DT_LNK:
+                copyEntrySymlink(walker, entry);
+                return false;
+
+            case DT_DIR: {
+                struct stat st;
+                if (fstatat(entry.dirFd, entry.name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    walker.fail(entry, "cannot stat", errno);
+                    return false;
+                }
+                if (st.st_dev == destDev && st.st_ino == destIno) {
+                    return false;
+                }
+
+                int parentDest = destFdOf(entry);
+                bool created;
+                if (makeDestDir(parentDest, entry.name, st.st_mode, created) == -1) {
+                    walker.fail(entry, "cannot create directory", errno);
+                    return false;
+                }
+
+                int fd = openat(parentDest, entry.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd == -1) {
+                    walker.fail(entry, "cannot open destination directory", errno);
+                    return false;
+                }
+                *entry.childData = makeDestData(fd, st.st_mode, mask, created);
+                return true;
+            }
+
+            default:
+                walker.fail(entry, "skipping special file", EOPNOTSUPP);
+                return false;
+        }
+    });
+
+    // Directories get their own permissions back once nothing more is copied into them
+    walker.onLeave([&walker](const TreeWalker::Entry& entry, bool) {
+        const DestDir* dir = static_cast<const DestDir*>(entry.childData->get());
+        if (dir && dir->restoreMode && fchmod(dir->fd, dir->finalMode) == -1) {
+            walker.fail(entry, "cannot set permissions of", errno);
+        }
+    });
+
+    return walker.run(src);
+}
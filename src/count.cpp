@@ -0,0 +1,211 @@
+#include "count.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COUNT_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using LinesFn = size_t (*)(const char*, size_t);
+using LinesWordsFn = void (*)(const char*, size_t, size_t&, size_t&, bool&);
+
+inline bool isSpace(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* --- Scalar --- */
+
+size_t linesScalar(const char* data, size_t len) {
+    size_t lines = 0;
+    const char* end = data + len;
+    while ((data = static_cast<const char*>(memchr(data, '\n', end - data))) != nullptr) {
+        ++lines;
+        ++data;
+    }
+    return lines;
+}
+
+void linesWordsScalar(const char* data, size_t len, size_t& lines, size_t& words, bool& inWord) {
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = data[i];
+        lines += (c == '\n');
+        bool space = isSpace(c);
+        words += (!space && !inWord);
+        inWord = !space;
+    }
+}
+
+#ifdef COUNT_HAVE_X86
+
+/**
+ * Both SIMD kernels build a 64-bit mask per 64-byte block where bit i is
+ * set when byte i is whitespace. A word starts at every non-space byte
+ * whose predecessor is a space, i.e. ~mask & (mask << 1 | carry), where
+ * carry is 1 when the previous block ended outside a word.
+ */
+inline uint64_t wordStarts(uint64_t spaceMask, bool& inWord) {
+    uint64_t prevSpace = (spaceMask << 1) | (inWord ? 0 : 1);
+    inWord = !(spaceMask >> 63);
+    return ~spaceMask & prevSpace;
+}
+
+/* --- SSE2 (baseline on x86-64) --- */
+
+__attribute__((target("sse2")))
+inline uint64_t mask16(__m128i v, __m128i needle) {
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+}
+
+__attribute__((target("sse2")))
+inline uint64_t spaceMask16(__m128i v) {
+    __m128i sp = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    return static_cast<uint32_t>(_mm_movemask_epi8(sp));
+}
+
+__attribute__((target("sse2")))
+size_t linesSse2(const char* data, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t lines = 0;
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(data + i);
+        uint64_t m = mask16(_mm_loadu_si128(p), nl)
+                   | mask16(_mm_loadu_si128(p + 1), nl) << 16
+                   | mask16(_mm_loadu_si128(p + 2), nl) << 32
+                   | mask16(_mm_loadu_si128(p + 3), nl) << 48;
+        lines += __builtin_popcountll(m);
+    }
+
+    return lines + linesScalar(data + i, len - i);
+}
+
+__attribute__((target("sse2")))
+void linesWordsSse2(const char* data, size_t len, size_t& lines, size_t& words, bool& inWord) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(data + i);
+        __m128i v0 = _mm_loadu_si128(p);
+        __m128i v1 = _mm_loadu_si128(p + 1);
+        __m128i v2 = _mm_loadu_si128(p + 2);
+        __m128i v3 = _mm_loadu_si128(p + 3);
+
+        uint64_t nlMask = mask16(v0, nl) | mask16(v1, nl) << 16 | mask16(v2, nl) << 32 | mask16(v3, nl) << 48;
+        uint64_t spMask = spaceMask16(v0) | spaceMask16(v1) << 16 | spaceMask16(v2) << 32 | spaceMask16(v3) << 48;
+
+        lines += __builtin_popcountll(nlMask);
+        words += __builtin_popcountll(wordStarts(spMask, inWord));
+    }
+
+    linesWordsScalar(data + i, len - i, lines, words, inWord);
+}
+
+/* --- AVX2 --- */
+
+__attribute__((target("avx2,popcnt")))
+inline uint64_t mask32(__m256i v, __m256i needle) {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)));
+}
+
+__attribute__((target("avx2,popcnt")))
+inline uint64_t spaceMask32(__m256i v) {
+    __m256i sp = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(sp));
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t linesAvx2(const char* data, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t lines = 0;
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        const __m256i* p = reinterpret_cast<const __m256i*>(data + i);
+        uint64_t m = mask32(_mm256_loadu_si256(p), nl) | mask32(_mm256_loadu_si256(p + 1), nl) << 32;
+        lines += _mm_popcnt_u64(m);
+    }
+
+    return lines + linesScalar(data + i, len - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+void linesWordsAvx2(const char* data, size_t len, size_t& lines, size_t& words, bool& inWord) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        const __m256i* p = reinterpret_cast<const __m256i*>(data + i);
+        __m256i v0 = _mm256_loadu_si256(p);
+        __m256i v1 = _mm256_loadu_si256(p + 1);
+
+        uint64_t nlMask = mask32(v0, nl) | mask32(v1, nl) << 32;
+        uint64_t spMask = spaceMask32(v0) | spaceMask32(v1) << 32;
+
+        lines += _mm_popcnt_u64(nlMask);
+        words += _mm_popcnt_u64(wordStarts(spMask, inWord));
+    }
+
+    linesWordsScalar(data + i, len - i, lines, words, inWord);
+}
+
+#endif // COUNT_HAVE_X86
+
+struct Kernel {
+    const char* name;
+    LinesFn lines;
+    LinesWordsFn linesWords;
+};
+
+Kernel selectKernel() {
+    const Kernel scalar = {"scalar", linesScalar, linesWordsScalar};
+
+#ifdef COUNT_HAVE_X86
+    const Kernel sse2 = {"sse2", linesSse2, linesWordsSse2};
+    const Kernel avx2 = {"avx2", linesAvx2, linesWordsAvx2};
+
+    __builtin_cpu_init();
+    bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    bool hasSse2 = __builtin_cpu_supports("sse2");
+
+    const char* forced = getenv("CUSTOM_SHELL_SIMD");
+    if (forced) {
+        if (strcmp(forced, "scalar") == 0) return scalar;
+        if (strcmp(forced, "sse2") == 0 && hasSse2) return sse2;
+        if (strcmp(forced, "avx2") == 0 && hasAvx2) return avx2;
+    }
+
+    if (hasAvx2) return avx2;
+    if (hasSse2) return sse2;
+#endif
+
+    return scalar;
+}
+
+const Kernel& kernel() {
+    static const Kernel k = selectKernel();
+    return k;
+}
+
+} // namespace
+
+size_t CountKernel::countLines(const char* data, size_t len) {
+    return kernel().lines(data, len);
+}
+
+void CountKernel::countLinesWords(const char* data, size_t len, size_t& lines, size_t& words, bool& inWord) {
+    kernel().linesWords(data, len, lines, words, inWord);
+}
+
+const char* CountKernel::name() {
+    return kernel().name;
+}
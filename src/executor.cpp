@@ -1,83 +1,407 @@
 #include "executor.h"
 #include "commands.h"
+#include "builtins.h"
+#include "jobs.h"
+#include "external.h"
+#include "trace.h"
+#include "session.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <thread>
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
 
-CommandResult Executor::executeCommand(const AST& node) {
-    return execute(node);
+CommandResult Executor::executeCommand(const AST& ast, IOContext& io) {
+    return execute(ast, ast.root(), io);
 }
 
-CommandResult Executor::execute(const AST& node) {
-    if (node.node == AST::NodeType::Command)
-        return runCommand(node);
+CommandResult Executor::execute(const AST& ast, AST::NodeId id, IOContext& io) {
+    const bool isCommand = ast.type(id) == AST::NodeType::Command;
 
-    const std::string& op = node.op;
+    // One trace event per node; the node's text is only rendered when tracing
+    Trace::Span span(isCommand ? "command" : "operator",
+                     isCommand ? ast.command(id) : std::string_view(AST::opSymbol(ast.op(id))),
+                     Trace::enabled() ? ast.text(id) : std::string());
 
-    if (op == "|")  return handlePipe(node);
-    if (op == ">")  return handleRedirectOut(node);
-    if (op == "<")  return handleRedirectIn(node);
-    if (op == ">>") return handleAppend(node);
-    if (op == "&&") return handleAnd(node);
-    if (op == "||") return handleOr(node);
-    if (op == ";")  return handleSeq(node);
-    if (op == "&")  return handleBackground(node);
+    if (isCommand) {
+        CommandResult result = runCommand(ast, id, io);
 
-    return {1, "", "Unknown operator: " + op};
+        Trace::Span output("output", "emit");
+        emit(result, io);
+        return result;
+    }
+
+    switch (ast.op(id)) {
+        case AST::OpType::Pipe:        return handlePipe(ast, id, io);
+        case AST::OpType::RedirectOut: return handleRedirectOut(ast, id, io);
+        case AST::OpType::RedirectIn:  return handleRedirectIn(ast, id, io);
+        case AST::OpType::Append:      return handleAppend(ast, id, io);
+        case AST::OpType::And:
+        case AST::OpType::Or:
+        case AST::OpType::Seq:         return handleList(ast, id, io);
+        case AST::OpType::Background:  return handleBackground(ast, id, io);
+    }
+
+    return {1, "", "Unknown operator: " + std::string(AST::opSymbol(ast.op(id)))};
+}
+
+CommandResult Executor::runCommand(const AST& ast, AST::NodeId id, IOContext& io) {
+    std::string_view name = ast.command(id);
+
+    if (name == "time") {
+        return runTimed(ast.args(id), io);
+    }
+
+    return runSimple(name, ast.args(id), io);
+}
+
+CommandResult Executor::runSimple(std::string_view name, const std::vector<std::string>& args, IOContext& io) {
+    Builtins::Handler handler = Builtins::find(name);
+    if (handler) {
+        return handler(args, io);
+    }
+
+    return ExternalCommand::run(name, args, io);
+}
+
+static std::string formatSeconds(double seconds) {
+    char buf[32];
+    int minutes = static_cast<int>(seconds / 60);
+    snprintf(buf, sizeof(buf), "%dm%.3fs", minutes, seconds - minutes * 60.0);
+    return buf;
+}
+
+static double cpuSeconds(const struct timeval& after, const struct timeval& before) {
+    return (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec) / 1e6;
+}
+
+/**
+ * @brief "time cmd [args]...": run cmd, then report its cost on stderr
+ * user and sys cover the shell's own threads (builtins, pipeline stages)
+ * and any programs that were waited for; peak rss is how much the shell's
+ * peak grew plus how far the largest waited-for program went beyond the
+ * previous largest one, both from getrusage.
+ * @param args The command to run and its arguments; none times nothing
+ * @return The command's own result; its output is emitted ahead of the report
+ */
+CommandResult Executor::runTimed(const std::vector<std::string>& args, IOContext& io) {
+    struct rusage selfBefore, childBefore, selfAfter, childAfter;
+    getrusage(RUSAGE_SELF, &selfBefore);
+    getrusage(RUSAGE_CHILDREN, &childBefore);
+    auto start = std::chrono::steady_clock::now();
+
+    CommandResult result{0, "", ""};
+    if (!args.empty()) {
+        std::vector<std::string> rest(args.begin() + 1, args.end());
+        result = runSimple(args[0], rest, io);
+    }
+    emit(result, io);
+
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+    getrusage(RUSAGE_SELF, &selfAfter);
+    getrusage(RUSAGE_CHILDREN, &childAfter);
+
+    double user = cpuSeconds(selfAfter.ru_utime, selfBefore.ru_utime) + cpuSeconds(childAfter.ru_utime, childBefore.ru_utime);
+    double sys = cpuSeconds(selfAfter.ru_stime, selfBefore.ru_stime) + cpuSeconds(childAfter.ru_stime, childBefore.ru_stime);
+    long rss = (selfAfter.ru_maxrss - selfBefore.ru_maxrss) + std::max(0L, childAfter.ru_maxrss - childBefore.ru_maxrss);
+
+    // A failing command's error comes first, as the shell would have printed it anyway
+    reportError(result.error, io);
+    result.error.clear();
+
+    reportError("\nreal\t" + formatSeconds(wall.count()) +
+                "\nuser\t" + formatSeconds(user) +
+                "\nsys\t" + formatSeconds(sys) +
+                "\nrss\t+" + std::to_string(rss) + " KiB", io);
+    return result;
+}
+
+/**
+ * @brief Write a builtin's buffered output to the active sink
+ * Builtins that stream write to io.out themselves and return no output;
+ * the rest still hand back a string, which is forwarded here followed by a newline.
+ */
+void Executor::emit(CommandResult& result, IOContext& io) {
+    if (result.status != 0 || result.output.empty()) {
+        return;
+    }
+
+    io.out->write(result.output);
+    if (!result.noNewline) {
+        io.out->put('\n');
+    }
+
+    result.output.clear();
+}
+
+/**
+ * @brief Flatten a left-associative chain of pipes, e.g. (a | b) | c, into [a, b, c]
+ */
+void Executor::collectPipeStages(const AST& ast, AST::NodeId id, std::vector<AST::NodeId>& stages) {
+    if (ast.type(id) == AST::NodeType::Operator && ast.op(id) == AST::OpType::Pipe) {
+        collectPipeStages(ast, ast.left(id), stages);
+        collectPipeStages(ast, ast.right(id), stages);
+        return;
+    }
+    stages.push_back(id);
+}
+
+CommandResult Executor::handlePipe(const AST& ast, AST::NodeId id, IOContext& io) {
+    std::vector<AST::NodeId> stages;
+    collectPipeStages(ast, id, stages);
+
+    const size_t n = stages.size();
+
+    // pipes[i] connects stage i (write end) to stage i + 1 (read end)
+    std::vector<int> readEnds(n, -1);
+    std::vector<int> writeEnds(n, -1);
+    for (size_t i = 0; i + 1 < n; ++i) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            for (size_t j = 0; j < i; ++j) {
+                close(readEnds[j]);
+                close(writeEnds[j]);
+            }
+            return {1, "", "pipe: " + std::string(strerror(errno))};
+        }
+        readEnds[i] = fds[0];
+        writeEnds[i] = fds[1];
+    }
+
+    std::vector<CommandResult> results(n);
+    Session* session = Session::current();
+
+    auto runStage = [&](size_t i) {
+        // Stages on worker threads still belong to the caller's session
+        Session::Scope scope(session);
+
+        IOContext stageIo;
+        stageIo.in = (i == 0) ? io.in : readEnds[i - 1];
+
+        try {
+            if (i + 1 == n) {
+                stageIo.out = io.out;
+                results[i] = execute(ast, stages[i], stageIo);
+            } else {
+                OutputSink sink(writeEnds[i]);
+                stageIo.out = &sink;
+                results[i] = execute(ast, stages[i], stageIo);
+            }
+        } catch (const std::exception& ex) {
+            results[i] = {1, "", ex.what()};
+        }
+
+        // Downstream sees EOF once we close our write end; upstream sees
+        // EPIPE once we stop reading, which lets it stop early
+        if (i + 1 < n) close(writeEnds[i]);
+        if (i > 0) close(readEnds[i - 1]);
+    };
+
+    // Every stage but the last runs on a worker thread; the last one writes
+    // to the caller's sink so it stays on the calling thread
+    std::vector<std::thread> workers;
+    workers.reserve(n - 1);
+    for (size_t i = 0; i + 1 < n; ++i) {
+        workers.emplace_back(runStage, i);
+    }
+    runStage(n - 1);
+
+    for (std::thread& t : workers) {
+        t.join();
+    }
+
+    CommandResult combined = {results.back().status, "", ""};
+    for (const CommandResult& r : results) {
+        if (r.error.empty()) continue;
+        if (!combined.error.empty()) combined.error += "\n";
+        combined.error += r.error;
+    }
+
+    return combined;
 }
 
-CommandResult Executor::runCommand(const AST& node) {
-    if (node.command == "help")  return Commands::helpCommand(node.args);
-    if (node.command == "echo")  return Commands::echoCommand(node.args);
-    if (node.command == "pause") return Commands::pauseCommand(node.args);
-    if (node.command == "ls")    return Commands::lsCommand(node.args);
-    if (node.command == "dir")   return Commands::dirCommand(node.args);
-    if (node.command == "cd")    return Commands::cdCommand(node.args);
-    if (node.command == "pwd")   return Commands::pwdCommand(node.args);
-    if (node.command == "clr")   return Commands::clrCommand(node.args);
-    if (node.command == "quit")  return Commands::quitCommand(node.args);
-    if (node.command == "environ") return Commands::environCommand(node.args);
-    if (node.command == "cat")   return Commands::catCommand(node.args);
-    if (node.command == "wc")    return Commands::wcCommand(node.args);
-    if (node.command == "mkdir") return Commands::mkdirCommand(node.args);
-    if (node.command == "rm")    return Commands::rmCommand(node.args);
-    if (node.command == "rmdir") return Commands::rmdirCommand(node.args);
-    if (node.command == "touch") return Commands::touchCommand(node.args);
-    if (node.command == "cp")    return Commands::cpCommand(node.args);
-    if (node.command == "chown") return Commands::chownCommand(node.args);
-    if (node.command == "grep")  return Commands::grepCommand(node.args);
-    if (node.command == "mv")    return Commands::mvCommand(node.args);
-    if (node.command == "chmod") return Commands::chmodCommand(node.args);
+/**
+ * @brief Run a chain of "&&", "||" and ";" without recursing into it
+ * The parser builds these chains left-deep, e.g. a; b; c ::= (a; b); c, so
+ * the left spine is walked once to collect [a, (;, b), (;, c)] and the
+ * commands are then run left to right. "&&" runs its right side only after
+ * a zero status, "||" only after a non-zero one; a skipped command leaves
+ * the status unchanged, which matches evaluating the tree bottom-up.
+ * Every command writes straight to io.out and reports its own error as it
+ * finishes, so nothing is accumulated across the chain.
+ * @return The status of the last command that ran
+ */
+CommandResult Executor::handleList(const AST& ast, AST::NodeId id, IOContext& io) {
+    std::vector<AST::NodeId> rest;
+    while (ast.type(id) == AST::NodeType::Operator && isListOp(ast.op(id))) {
+        rest.push_back(id);
+        id = ast.left(id);
+    }
+
+    int status = runListItem(ast, id, io);
+
+    for (auto it = rest.rbegin(); it != rest.rend(); ++it) {
+        AST::OpType op = ast.op(*it);
+        if ((op == AST::OpType::And && status != 0) || (op == AST::OpType::Or && status == 0)) {
+            continue;
+        }
+        status = runListItem(ast, ast.right(*it), io);
+    }
 
-    return {1, "", "Unknown command: " + node.command};
+    return {status, "", ""};
 }
 
-CommandResult Executor::handlePipe(const AST& node) {
-    return {1, "", ""}; 
+bool Executor::isListOp(AST::OpType op) {
+    return op == AST::OpType::And || op == AST::OpType::Or || op == AST::OpType::Seq;
 }
 
-CommandResult Executor::handleRedirectOut(const AST& node) {
-    return {1, "", ""};
+int Executor::runListItem(const AST& ast, AST::NodeId id, IOContext& io) {
+    CommandResult result;
+    try {
+        result = execute(ast, id, io);
+    } catch (const std::exception& ex) {
+        result = {1, "", ex.what()};
+    }
+
+    reportError(result.error, io);
+    return result.status;
 }
 
-CommandResult Executor::handleRedirectIn(const AST& node) {
-    return {1, "", ""};
+/**
+ * @brief Print an error for a command that has already finished
+ * Pending output is flushed first so stdout and stderr stay in order.
+ */
+void Executor::reportError(const std::string& error, IOContext& io) {
+    if (error.empty()) {
+        return;
+    }
+    io.out->flush();
+    Session::writeError(error);
 }
 
-CommandResult Executor::handleAppend(const AST& node) {
-    return {1, "", ""};
+CommandResult Executor::handleRedirectOut(const AST& ast, AST::NodeId id, IOContext& io) {
+    return redirectOutput(ast, id, io, O_WRONLY | O_CREAT | O_TRUNC);
 }
 
-CommandResult Executor::handleAnd(const AST& node) {
-    return {1, "", ""};
+CommandResult Executor::handleAppend(const AST& ast, AST::NodeId id, IOContext& io) {
+    return redirectOutput(ast, id, io, O_WRONLY | O_CREAT | O_APPEND);
 }
 
-CommandResult Executor::handleOr(const AST& node) {
-    return {1, "", ""};
+/**
+ * @brief "cmd > file" and "cmd >> file"
+ * The file is opened once and given its own sink, so everything the left
+ * side writes goes straight to the file; cat moves data with
+ * copy_file_range/sendfile without it ever passing through the shell.
+ */
+CommandResult Executor::redirectOutput(const AST& ast, AST::NodeId id, IOContext& io, int flags) {
+    std::string path;
+    CommandResult err = redirectTarget(ast, ast.right(id), path);
+    if (!err.error.empty()) {
+        return err;
+    }
+
+    int fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return {1, "", "custom-shell: " + path + ": " + strerror(errno)};
+    }
+
+    CommandResult result;
+    {
+        OutputSink sink(fd);
+        IOContext redirected;
+        redirected.in = io.in;
+        redirected.out = &sink;
+        result = execute(ast, ast.left(id), redirected);
+    }
+
+    close(fd);
+    return result;
 }
 
-CommandResult Executor::handleSeq(const AST& node) {
-    return {1, "", ""};
+/**
+ * @brief "cmd < file"
+ * The opened descriptor becomes the command's input, which cat, grep and wc
+ * read directly when they are given no file operands.
+ */
+CommandResult Executor::handleRedirectIn(const AST& ast, AST::NodeId id, IOContext& io) {
+    std::string path;
+    CommandResult err = redirectTarget(ast, ast.right(id), path);
+    if (!err.error.empty()) {
+        return err;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return {1, "", "custom-shell: " + path + ": " + strerror(errno)};
+    }
+
+    IOContext redirected;
+    redirected.in = fd;
+    redirected.out = io.out;
+    CommandResult result = execute(ast, ast.left(id), redirected);
+
+    close(fd);
+    return result;
 }
 
-CommandResult Executor::handleBackground(const AST& node) {
-    return {1, "", ""};
+// The right side of a redirection must be exactly one word: the file name
+CommandResult Executor::redirectTarget(const AST& ast, AST::NodeId id, std::string& path) {
+    if (ast.type(id) != AST::NodeType::Command || ast.argCount(id) != 0) {
+        return {1, "", "custom-shell: " + ast.text(id) + ": ambiguous redirect"};
+    }
+    path = std::string(ast.command(id));
+    return {0, "", ""};
+}
+
+/**
+ * @brief Start the left side of "&" as a background job, then run the right side
+ * The job is a forked copy of the shell, so builtins like cd only affect
+ * the job itself. Its stdin is /dev/null and it shares the shell's stdout.
+ * @return Status of the right-hand side, or 0 for a trailing "&"
+ */
+CommandResult Executor::handleBackground(const AST& ast, AST::NodeId id, IOContext& io) {
+    // Forking a multithreaded server would copy every other request's state
+    if (Session::current()) {
+        return {1, "", "custom-shell: background jobs are not available in server mode"};
+    }
+
+    // Buffered output would otherwise be written twice, once by each process
+    io.out->flush();
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        return {1, "", "fork: " + std::string(strerror(errno))};
+    }
+
+    if (pid == 0) {
+        JobTable::prepareChild();
+
+        int devNull = open("/dev/null", O_RDONLY);
+        if (devNull != -1) {
+            dup2(devNull, STDIN_FILENO);
+            close(devNull);
+        }
+
+        IOContext jobIo;
+        jobIo.out = io.out;
+
+        int status = runListItem(ast, ast.left(id), jobIo);
+        jobIo.out->flush();
+        _exit(status);
+    }
+
+    int job = JobTable::add(pid, ast.text(ast.left(id)));
+    io.out->write("[" + std::to_string(job) + "] " + std::to_string(pid) + "\n");
+    io.out->flush();
+
+    if (ast.right(id) == AST::kNone) {
+        return {0, "", ""};
+    }
+    return execute(ast, ast.right(id), io);
 }
@@ -0,0 +1,225 @@
+#include "external.h"
+#include "session.h"
+#include <mutex>
+#include <unordered_map>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+namespace {
+
+struct PathDir {
+    std::string path;
+    struct timespec mtime;
+    bool exists;
+};
+
+struct Cached {
+    std::string path;
+    size_t dirIndex;
+    size_t hits;
+};
+
+struct PathState {
+    std::mutex mutex;
+    std::string pathVar;
+    bool loaded = false;
+    std::vector<PathDir> dirs;
+    std::unordered_map<std::string, Cached> entries;
+    PathCache::Stats stats;
+};
+
+PathState& pathState() {
+    static PathState s;
+    return s;
+}
+
+void statDir(PathDir& dir) {
+    struct stat st;
+    dir.exists = stat(dir.path.c_str(), &st) == 0;
+    dir.mtime = dir.exists ? st.st_mtim : timespec{0, 0};
+}
+
+bool dirChanged(const PathDir& dir) {
+    PathDir now{dir.path, {0, 0}, false};
+    statDir(now);
+    return now.exists != dir.exists || now.mtime.tv_sec != dir.mtime.tv_sec || now.mtime.tv_nsec != dir.mtime.tv_nsec;
+}
+
+// Re-read $PATH into s.dirs; an empty entry means the current directory
+void loadPath(PathState& s, const std::string& pathVar) {
+    s.pathVar = pathVar;
+    s.loaded = true;
+    s.dirs.clear();
+    s.entries.clear();
+
+    size_t start = 0;
+    while (start <= pathVar.size()) {
+        size_t colon = pathVar.find(':', start);
+        if (colon == std::string::npos) colon = pathVar.size();
+
+        PathDir dir{pathVar.substr(start, colon - start), {0, 0}, false};
+        if (dir.path.empty()) dir.path = ".";
+        statDir(dir);
+        s.dirs.push_back(std::move(dir));
+
+        start = colon + 1;
+    }
+}
+
+bool isExecutable(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0;
+}
+
+int decodeStatus(int raw) {
+    if (WIFEXITED(raw)) return WEXITSTATUS(raw);
+    if (WIFSIGNALED(raw)) return 128 + WTERMSIG(raw);
+    return 1;
+}
+
+} // namespace
+
+std::string PathCache::lookup(const std::string& name) {
+    PathState& s = pathState();
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    const char* env = Session::getenv("PATH");
+    std::string pathVar = env ? env : "/usr/local/bin:/usr/bin:/bin";
+    if (!s.loaded || pathVar != s.pathVar) {
+        if (s.loaded) ++s.stats.invalidations;
+        loadPath(s, pathVar);
+    }
+
+    auto it = s.entries.find(name);
+    if (it != s.entries.end()) {
+        // Anything added earlier in PATH, or removed from the entry's own directory, shows up as an mtime change
+        bool stale = false;
+        for (size_t i = 0; i <= it->second.dirIndex && !stale; ++i) {
+            stale = dirChanged(s.dirs[i]);
+        }
+
+        if (!stale) {
+            ++s.stats.hits;
+            ++it->second.hits;
+            return it->second.path;
+        }
+
+        ++s.stats.invalidations;
+        loadPath(s, pathVar);
+    }
+
+    ++s.stats.misses;
+
+    for (size_t i = 0; i < s.dirs.size(); ++i) {
+        std::string candidate = s.dirs[i].path + "/" + name;
+        if (isExecutable(candidate)) {
+            s.entries[name] = {candidate, i, 1};
+            return candidate;
+        }
+    }
+
+    return "";
+}
+
+std::vector<PathCache::Entry> PathCache::entries() {
+    PathState& s = pathState();
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    std::vector<Entry> out;
+    for (const auto& kv : s.entries) {
+        out.push_back({kv.first, kv.second.path, kv.second.hits});
+    }
+    return out;
+}
+
+PathCache::Stats PathCache::stats() {
+    PathState& s = pathState();
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    Stats st = s.stats;
+    st.size = s.entries.size();
+    return st;
+}
+
+void PathCache::clear() {
+    PathState& s = pathState();
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    s.loaded = false;
+    s.dirs.clear();
+    s.entries.clear();
+    s.stats = Stats();
+}
+
+/**
+ * @brief Spawn an external program and wait for it
+ * A name containing '/' is run as given; anything else is resolved through
+ * PathCache. The child gets io.in (when set) as stdin and io.out's
+ * descriptor as stdout, a cleared signal mask and default SIGPIPE handling.
+ * @return The program's status, with an error message if it could not be started
+ */
+CommandResult ExternalCommand::run(std::string_view name, const std::vector<std::string>& args, IOContext& io) {
+    std::string command(name);
+    std::string path = command.find('/') != std::string::npos ? command : PathCache::lookup(command);
+    if (path.empty()) {
+        return {127, "", "Unknown command: " + command};
+    }
+
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 2);
+    argv.push_back(const_cast<char*>(command.c_str()));
+    for (const std::string& a : args) {
+        argv.push_back(const_cast<char*>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    // The program writes to the descriptor directly; our buffered output goes first
+    io.out->flush();
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // A server request's program inherits the client's stdin and stderr, not the server's
+    Session* session = Session::current();
+    int in = io.in != -1 ? io.in : session ? session->in : STDIN_FILENO;
+    if (in != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    }
+    if (io.out->fd() != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, io.out->fd(), STDOUT_FILENO);
+    }
+    if (session && session->err != STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, session->err, STDERR_FILENO);
+    }
+
+    // The shell blocks SIGCHLD and ignores SIGPIPE; the program should not inherit either
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t empty, defaults;
+    sigemptyset(&empty);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, path.c_str(), &actions, &attr, argv.data(), Session::environment());
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (rc != 0) {
+        return {rc == ENOENT ? 127 : 126, "", "custom-shell: " + command + ": " + strerror(rc)};
+    }
+
+    int raw = 0;
+    while (waitpid(pid, &raw, 0) == -1 && errno == EINTR) {
+    }
+
+    return {decodeStatus(raw), "", ""};
+}
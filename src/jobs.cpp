@@ -0,0 +1,171 @@
+#include "jobs.h"
+#include <algorithm>
+#include <mutex>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace {
+
+struct State {
+    std::mutex mutex;
+    std::vector<JobTable::Job> jobs;
+    int nextId = 1;
+    int sigFd = -1;
+    sigset_t savedMask;
+};
+
+State& state() {
+    static State s;
+    return s;
+}
+
+int decodeStatus(int raw) {
+    if (WIFEXITED(raw)) return WEXITSTATUS(raw);
+    if (WIFSIGNALED(raw)) return 128 + WTERMSIG(raw);
+    return 1;
+}
+
+// Drain the signalfd; true if at least one SIGCHLD arrived
+bool drainSignals(int fd) {
+    bool any = false;
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+        any = true;
+    }
+    return any;
+}
+
+} // namespace
+
+void JobTable::init() {
+    State& s = state();
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &s.savedMask);
+
+    s.sigFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+void JobTable::prepareChild() {
+    State& s = state();
+    if (s.sigFd != -1) {
+        close(s.sigFd);
+        s.sigFd = -1;
+    }
+    sigprocmask(SIG_SETMASK, &s.savedMask, nullptr);
+    s.jobs.clear();
+}
+
+int JobTable::add(pid_t pid, std::string command) {
+    State& s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    // Numbering restarts once every job has been collected, as in other shells
+    if (s.jobs.empty()) {
+        s.nextId = 1;
+    }
+
+    Job job;
+    job.id = s.nextId++;
+    job.pid = pid;
+    job.command = std::move(command);
+    s.jobs.push_back(std::move(job));
+    return s.jobs.back().id;
+}
+
+void JobTable::reap() {
+    State& s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    // Without a signalfd (init failed) fall back to checking every job
+    if (s.jobs.empty() || (s.sigFd != -1 && !drainSignals(s.sigFd))) {
+        return;
+    }
+
+    for (Job& job : s.jobs) {
+        if (job.done) continue;
+
+        int raw;
+        if (waitpid(job.pid, &raw, WNOHANG) == job.pid) {
+            job.done = true;
+            job.status = decodeStatus(raw);
+        }
+    }
+}
+
+std::vector<JobTable::Job> JobTable::list() {
+    reap();
+
+    State& s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.jobs;
+}
+
+std::string JobTable::takeFinished() {
+    reap();
+
+    State& s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    std::string out;
+    std::vector<Job> running;
+    for (Job& job : s.jobs) {
+        if (job.done) {
+            out += "[" + std::to_string(job.id) + "] " + describe(job) + "\t" + job.command + "\n";
+        } else {
+            running.push_back(std::move(job));
+        }
+    }
+    s.jobs = std::move(running);
+    return out;
+}
+
+bool JobTable::wait(int id, int& status) {
+    State& s = state();
+    pid_t pid = -1;
+
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (const Job& job : s.jobs) {
+            if (job.id != id) continue;
+            if (job.done) {
+                status = job.status;
+            } else {
+                pid = job.pid;
+            }
+            break;
+        }
+
+        if (pid == -1) {
+            size_t before = s.jobs.size();
+            s.jobs.erase(std::remove_if(s.jobs.begin(), s.jobs.end(), [id](const Job& j) { return j.id == id; }), s.jobs.end());
+            return s.jobs.size() != before;
+        }
+    }
+
+    int raw = 0;
+    while (waitpid(pid, &raw, 0) == -1 && errno == EINTR) {
+    }
+    status = decodeStatus(raw);
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.jobs.erase(std::remove_if(s.jobs.begin(), s.jobs.end(), [id](const Job& j) { return j.id == id; }), s.jobs.end());
+    return true;
+}
+
+int JobTable::mostRecent() {
+    State& s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.jobs.empty() ? -1 : s.jobs.back().id;
+}
+
+std::string JobTable::describe(const Job& job) {
+    if (!job.done) return "Running";
+    if (job.status == 0) return "Done";
+    return "Exit " + std::to_string(job.status);
+}
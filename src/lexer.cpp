@@ -1,86 +1,114 @@
 #include "lexer.h"
-#include <unordered_map>
-#include <cctype>
-
-using OpMap = std::unordered_map<std::string, TokenType>;
-using OpIter = OpMap::const_iterator;
-
-static const OpMap OP_TABLE = {
-    {"&&", TokenType::AND_OP},
-    {"||", TokenType::OR_OP},
-    {">>", TokenType::APPEND_OP},
-    {"|",  TokenType::PIPE},
-    {">",  TokenType::REDIR_OUT},
-    {"<",  TokenType::REDIR_IN},
-    {";",  TokenType::SEMICOLON},
-    {"&",  TokenType::AMPERSAND}
+#include <cstdint>
+
+namespace {
+
+enum CharClass : uint8_t {
+    WORD_CHAR,
+    SPACE,
+    QUOTE,
+    OP_CHAR
 };
 
-void Lexer::flushCurrent(std::vector<Token>& tokens, std::string& current) {
-    if (!current.empty()) {
-        tokens.push_back({TokenType::WORD, current});
-        current.clear();
+constexpr struct ClassTable {
+    CharClass cls[256];
+
+    constexpr ClassTable() : cls() {
+        for (CharClass& c : cls) {
+            c = WORD_CHAR;
+        }
+        for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+            cls[c] = SPACE;
+        }
+        cls[static_cast<unsigned char>('"')] = QUOTE;
+        cls[static_cast<unsigned char>('\'')] = QUOTE;
+        for (unsigned char c : {'&', '|', '>', '<', ';'}) {
+            cls[c] = OP_CHAR;
+        }
     }
+} kClasses;
+
+inline CharClass classOf(char c) {
+    return kClasses.cls[static_cast<unsigned char>(c)];
 }
 
-std::vector<Token> Lexer::tokenize(const std::string& input) {
+TokenType singleOp(char c) {
+    switch (c) {
+        case '&': return TokenType::AMPERSAND;
+        case '|': return TokenType::PIPE;
+        case '>': return TokenType::REDIR_OUT;
+        case '<': return TokenType::REDIR_IN;
+        default:  return TokenType::SEMICOLON;
+    }
+}
+
+// "&&", "||" and ">>" are the only two-character operators
+bool doubledOp(char c, TokenType& type) {
+    switch (c) {
+        case '&': type = TokenType::AND_OP;    return true;
+        case '|': type = TokenType::OR_OP;     return true;
+        case '>': type = TokenType::APPEND_OP; return true;
+        default:  return false;
+    }
+}
+
+} // namespace
+
+/**
+ * @brief Split a command line into tokens in a single pass
+ * Every character is classified through a 256-entry table. Words run until
+ * whitespace, a quote or an operator character; quoted text runs to the
+ * matching quote (or the end of input) and is emitted without its quotes.
+ * @return Tokens whose lexemes are slices of input
+ */
+std::vector<Token> Lexer::tokenize(std::string_view input) {
     std::vector<Token> tokens;
-    std::string current;
 
-    int i = 0;
-    const int n = static_cast<int>(input.size());
+    const char* p = input.data();
+    const char* end = p + input.size();
 
-    while (i < n) {
-        char c = input[i];
+    while (p < end) {
+        const char c = *p;
 
-        if (std::isspace(static_cast<unsigned char>(c))) { // whitespace
-            flushCurrent(tokens, current);
-            ++i;
-        } else if (c == '"' || c == '\'') { // quotes
-            char quote = c;
-            ++i; // skip opening quote
+        switch (classOf(c)) {
+            case SPACE:
+                ++p;
+                break;
 
-            std::string quoted;
-            while (i < n && input[i] != quote) {
-                quoted.push_back(input[i]);
-                ++i;
+            case QUOTE: {
+                const char* start = ++p; // skip opening quote
+                while (p < end && *p != c) {
+                    ++p;
+                }
+                tokens.push_back({TokenType::QUOTED, std::string_view(start, p - start)});
+                if (p < end) {
+                    ++p; // skip closing quote
+                }
+                break;
             }
 
-            if (i < n) {
-                ++i; // skip closing quote
+            case OP_CHAR: {
+                TokenType type;
+                if (p + 1 < end && p[1] == c && doubledOp(c, type)) {
+                    tokens.push_back({type, std::string_view(p, 2)});
+                    p += 2;
+                } else {
+                    tokens.push_back({singleOp(c), std::string_view(p, 1)});
+                    ++p;
+                }
+                break;
             }
 
-            flushCurrent(tokens, current);
-            tokens.push_back({TokenType::QUOTED, quoted});
-        } else if (i + 1 < n) { // possible multi-char op
-            std::string two = input.substr(i, 2);
-
-            OpIter multiOpIter = OP_TABLE.find(two);
-
-            if (multiOpIter != OP_TABLE.end()) { // matched multi-char op
-                flushCurrent(tokens, current);
-                tokens.push_back({multiOpIter->second, two});
-                i += 2;
-            } else {
-                std::string one = input.substr(i, 1);
-
-                OpIter iter = OP_TABLE.find(one);
-
-                if (iter != OP_TABLE.end()) { // check single-char op 
-                    flushCurrent(tokens, current);
-                    tokens.push_back({iter->second, one});
-                    ++i;
-                } else { // normal word token
-                    current.push_back(c);
-                    ++i;
+            case WORD_CHAR: {
+                const char* start = p;
+                while (p < end && classOf(*p) == WORD_CHAR) {
+                    ++p;
                 }
+                tokens.push_back({TokenType::WORD, std::string_view(start, p - start)});
+                break;
             }
-        } else { // normal word char
-            current.push_back(c);
-            ++i;
         }
     }
 
-    flushCurrent(tokens, current);
     return tokens;
 }
@@ -0,0 +1,561 @@
+#include "listing.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static constexpr size_t kGetdentsBuffer = 256 * 1024;
+
+void DirListing::clear() {
+    names.clear();
+    entries.clear();
+}
+
+static void addEntry(DirListing& out, const char* name, unsigned char type, ino_t ino) {
+    size_t len = strlen(name);
+    DirListing::Entry e;
+    e.nameOffset = static_cast<uint32_t>(out.names.size());
+    e.nameLen = static_cast<uint16_t>(len);
+    e.type = type;
+    e.ino = ino;
+    out.names.insert(out.names.end(), name, name + len + 1);
+    out.entries.push_back(e);
+}
+
+static bool useGetdents() {
+    static const bool enabled = [] {
+        const char* env = getenv("CUSTOM_SHELL_GETDENTS");
+        return !(env && strcmp(env, "0") == 0);
+    }();
+    return enabled;
+}
+
+// Layout the kernel fills in for getdents64; glibc does not export it
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static bool readGetdents(int dirFd, DirListing& out) {
+    // One buffer per thread, reused for every directory it lists
+    thread_local std::vector<char> buffer(kGetdentsBuffer);
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, dirFd, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) return true;
+
+        for (long pos = 0; pos < n;) {
+            const LinuxDirent64* d = reinterpret_cast<const LinuxDirent64*>(buffer.data() + pos);
+            addEntry(out, d->d_name, d->d_type, d->d_ino);
+            pos += d->d_reclen;
+        }
+    }
+}
+
+static bool readStdio(int dirFd, DirListing& out) {
+    // closedir() closes the descriptor it was given, so hand it a copy
+    int fd = dup(dirFd);
+    if (fd == -1) return false;
+
+    DIR* dirp = fdopendir(fd);
+    if (!dirp) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return false;
+    }
+
+    errno = 0;
+    while (struct dirent* dp = readdir(dirp)) {
+        addEntry(out, dp->d_name, dp->d_type, dp->d_ino);
+    }
+    int saved = errno;
+    closedir(dirp);
+    errno = saved;
+    return saved == 0;
+}
+
+/**
+ * @brief Append every entry of an open directory to out
+ * @param dirFd Descriptor opened with O_DIRECTORY
+ * @param out Listing to fill; existing entries are kept
+ * @return false on error, with errno set
+ */
+bool DirReader::read(int dirFd, DirListing& out) {
+    return useGetdents() ? readGetdents(dirFd, out) : readStdio(dirFd, out);
+}
+
+/* --- FileMeta --- */
+
+static void fromStat(const struct stat& st, FileMeta& out) {
+    out.mode = st.st_mode;
+    out.nlink = st.st_nlink;
+    out.uid = st.st_uid;
+    out.gid = st.st_gid;
+    out.size = st.st_size;
+    out.mtime = st.st_mtime;
+}
+
+/**
+ * @brief Fetch the metadata ls needs for name, relative to dirFd
+ * Only the requested statx fields are filled in, which spares filesystems
+ * that compute the rest lazily. Kernels without statx fall back to fstatat.
+ * @param dirFd Directory descriptor, or AT_FDCWD
+ * @param name Entry name (or path) relative to dirFd
+ * @param out Receives the metadata
+ * @return false on error, with errno set
+ */
+bool FileMeta::at(int dirFd, const char* name, FileMeta& out) {
+    static std::atomic<bool> haveStatx{true};
+
+#ifdef STATX_BASIC_STATS
+    if (haveStatx.load(std::memory_order_relaxed)) {
+        constexpr unsigned kMask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID |
+                                   STATX_GID | STATX_SIZE | STATX_MTIME;
+        struct statx stx;
+        if (statx(dirFd, name, 0, kMask, &stx) == 0) {
+            out.mode = stx.stx_mode;
+            out.nlink = stx.stx_nlink;
+            out.uid = stx.stx_uid;
+            out.gid = stx.stx_gid;
+            out.size = static_cast<off_t>(stx.stx_size);
+            out.mtime = stx.stx_mtime.tv_sec;
+            return true;
+        }
+        if (errno != ENOSYS) return false;
+        haveStatx.store(false, std::memory_order_relaxed);
+    }
+#endif
+
+    struct stat st;
+    if (fstatat(dirFd, name, &st, 0) == -1) return false;
+    fromStat(st, out);
+    return true;
+}
+
+/* --- IdNameCache --- */
+
+namespace {
+
+struct NameTables {
+    std::mutex mutex;
+    std::unordered_map<uid_t, std::string> users;
+    std::unordered_map<gid_t, std::string> groups;
+};
+
+NameTables& nameTables() {
+    static NameTables tables;
+    return tables;
+}
+
+} // namespace
+
+/**
+ * @brief User name for uid, looked up once per session
+ * @return Name (or the decimal uid); valid for the rest of the session
+ */
+std::string_view IdNameCache::user(uid_t uid) {
+    NameTables& t = nameTables();
+    std::lock_guard<std::mutex> lock(t.mutex);
+
+    auto it = t.users.find(uid);
+    if (it == t.users.end()) {
+        struct passwd* pw = getpwuid(uid);
+        it = t.users.emplace(uid, pw ? pw->pw_name : std::to_string(uid)).first;
+    }
+    // Map nodes are never erased, so the view outlives the lock
+    return it->second;
+}
+
+/**
+ * @brief Group name for gid, looked up once per session
+ * @return Name (or the decimal gid); valid for the rest of the session
+ */
+std::string_view IdNameCache::group(gid_t gid) {
+    NameTables& t = nameTables();
+    std::lock_guard<std::mutex> lock(t.mutex);
+
+    auto it = t.groups.find(gid);
+    if (it == t.groups.end()) {
+        struct group* gr = getgrgid(gid);
+        it = t.groups.emplace(gid, gr ? gr->gr_name : std::to_string(gid)).first;
+    }
+    return it->second;
+}
+
+/* --- LongFormatter --- */
+
+/**
+ * @brief Append one "ls -l" line: "drwxr-xr-x nlink user group size Mon DD HH:MM name\n"
+ * @param out Arena the line is written into
+ * @param meta Metadata of the entry
+ * @param name Name to print
+ */
+void LongFormatter::append(TextArena& out, const FileMeta& meta, std::string_view name) {
+    char perms[11];
+    perms[0] = S_ISDIR(meta.mode) ? 'd' : '-';
+    static constexpr char kBits[] = "rwxrwxrwx";
+    for (int i = 0; i < 9; ++i) {
+        perms[i + 1] = (meta.mode & (0400 >> i)) ? kBits[i] : '-';
+    }
+    perms[10] = ' ';
+    out.append(perms, sizeof(perms));
+
+    out.appendNumber(meta.nlink);
+    out.put(' ');
+    out.append(IdNameCache::user(meta.uid));
+    out.put(' ');
+    out.append(IdNameCache::group(meta.gid));
+    out.put(' ');
+    out.appendNumber(static_cast<unsigned long long>(meta.size));
+    out.put(' ');
+
+    // Files in one directory tend to share their mtime minute
+    time_t minute = meta.mtime / 60;
+    if (minute != cachedMinute_) {
+        struct tm t;
+        localtime_r(&meta.mtime, &t);
+        timeLen_ = strftime(timeText_, sizeof(timeText_), "%b %d %H:%M", &t);
+        cachedMinute_ = minute;
+    }
+    out.append(timeText_, timeLen_);
+
+    out.put(' ');
+    out.append(name);
+    out.put('\n');
+}
+
+/* --- DirCache --- */
+
+namespace {
+
+// Anything that changes which names a directory holds
+constexpr uint32_t kWatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                IN_DELETE_SELF | IN_ONLYDIR;
+
+struct DirState {
+    using Key = std::pair<dev_t, ino_t>;
+
+    struct Entry {
+        Key key;
+        struct timespec mtime;
+        int watch; // inotify watch descriptor, or -1
+        std::shared_ptr<const DirListing> listing;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries; // most recently used first
+    std::map<Key, std::list<Entry>::iterator> index;
+    std::unordered_map<int, Key> watches;
+    int inotifyFd = -1;
+    DirCache::Stats stats;
+
+    DirState() {
+        stats.capacity = 64;
+        const char* env = getenv("CUSTOM_SHELL_DIR_CACHE");
+        stats.enabled = !(env && strcmp(env, "0") == 0);
+    }
+
+    void erase(std::list<Entry>::iterator it) {
+        if (it->watch != -1) {
+            inotify_rm_watch(inotifyFd, it->watch);
+            watches.erase(it->watch);
+        }
+        index.erase(it->key);
+        entries.erase(it);
+    }
+
+    void invalidate(const Key& key) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            erase(it->second);
+            ++stats.invalidations;
+        }
+    }
+
+    // Apply every pending inotify event without blocking
+    void drainEvents() {
+        if (inotifyFd == -1) return;
+
+        alignas(struct inotify_event) char buf[4096];
+        for (;;) {
+            ssize_t n = ::read(inotifyFd, buf, sizeof(buf));
+            if (n <= 0) return;
+
+            for (ssize_t pos = 0; pos < n;) {
+                const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(buf + pos);
+                pos += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // Events were lost; nothing cached can be trusted
+                    stats.invalidations += entries.size();
+                    while (!entries.empty()) erase(entries.begin());
+                    continue;
+                }
+
+                auto w = watches.find(ev->wd);
+                if (w == watches.end()) continue;
+
+                Key key = w->second;
+                if (ev->mask & IN_IGNORED) {
+                    // The kernel already dropped the watch
+                    watches.erase(w);
+                    auto it = index.find(key);
+                    if (it != index.end()) it->second->watch = -1;
+                }
+                invalidate(key);
+            }
+        }
+    }
+
+    int addWatch(int dirFd, const Key& key) {
+        if (inotifyFd == -1) {
+            inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotifyFd == -1) return -1;
+        }
+
+        // Watch the directory itself, whatever path it was opened through
+        std::string self = "/proc/self/fd/" + std::to_string(dirFd);
+        int wd = inotify_add_watch(inotifyFd, self.c_str(), kWatchMask);
+        if (wd != -1) watches[wd] = key;
+        return wd;
+    }
+};
+
+DirState& dirState() {
+    static DirState state;
+    return state;
+}
+
+bool sameTime(const struct timespec& a, const struct timespec& b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+} // namespace
+
+/**
+ * @brief Listing of an open directory, from the cache when it is still current
+ * @param dirFd Descriptor opened with O_DIRECTORY
+ * @return Shared, immutable listing, or nullptr on error with errno set
+ */
+std::shared_ptr<const DirListing> DirCache::get(int dirFd) {
+    DirState& cache = dirState();
+
+    auto readFresh = [dirFd]() -> std::shared_ptr<DirListing> {
+        auto listing = std::make_shared<DirListing>();
+        return DirReader::read(dirFd, *listing) ? listing : nullptr;
+    };
+
+    struct stat st;
+    if (fstat(dirFd, &st) == -1) return nullptr;
+    const DirState::Key key(st.st_dev, st.st_ino);
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if (!cache.stats.enabled) {
+            return readFresh();
+        }
+
+        cache.drainEvents();
+
+        auto it = cache.index.find(key);
+        if (it != cache.index.end()) {
+            if (sameTime(it->second->mtime, st.st_mtim)) {
+                ++cache.stats.hits;
+                cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+                return it->second->listing;
+            }
+            cache.invalidate(key);
+        }
+        ++cache.stats.misses;
+    }
+
+    // Scan outside the lock. The mtime was taken first, so a change made
+    // during the scan shows up as a stale entry on the next lookup.
+    std::shared_ptr<const DirListing> listing = readFresh();
+    if (!listing) return nullptr;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.stats.capacity == 0 || !cache.stats.enabled || cache.index.count(key)) {
+        return listing;
+    }
+
+    cache.entries.push_front({key, st.st_mtim, -1, listing});
+    cache.index[key] = cache.entries.begin();
+    cache.entries.front().watch = cache.addWatch(dirFd, key);
+
+    while (cache.entries.size() > cache.stats.capacity) {
+        cache.erase(std::prev(cache.entries.end()));
+        ++cache.stats.evictions;
+    }
+
+    return listing;
+}
+
+void DirCache::setEnabled(bool enabled) {
+    DirState& cache = dirState();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    cache.stats.enabled = enabled;
+    if (!enabled) {
+        while (!cache.entries.empty()) cache.erase(cache.entries.begin());
+    }
+}
+
+DirCache::Stats DirCache::stats() {
+    DirState& cache = dirState();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    Stats s = cache.stats;
+    s.size = cache.entries.size();
+    return s;
+}
+
+void DirCache::clear() {
+    DirState& cache = dirState();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    while (!cache.entries.empty()) cache.erase(cache.entries.begin());
+
+    Stats fresh;
+    fresh.capacity = cache.stats.capacity;
+    fresh.enabled = cache.stats.enabled;
+    cache.stats = fresh;
+}
+
+/* --- ListingLayout --- */
+
+// Minimum width of a column: one character plus the two-space gap
+static constexpr size_t kMinColumnWidth = 3;
+static constexpr size_t kColumnGap = 2;
+
+/**
+ * @brief Build the sort record for entry i of listing
+ * @param listing Listing the record points into
+ * @param i Entry index in listing
+ * @param key Primary key (see newestFirst/largestFirst), 0 to sort by name only
+ * @param entry Index the caller wants back after sorting
+ * @return Record ready for sort()
+ */
+ListingLayout::Record ListingLayout::record(const DirListing& listing, size_t i, uint64_t key, uint32_t entry) {
+    const DirListing::Entry& e = listing.entries[i];
+    const unsigned char* name = reinterpret_cast<const unsigned char*>(listing.names.data() + e.nameOffset);
+
+    // Names never contain '\0', so zero padding sorts a prefix before its extensions
+    uint64_t prefix = 0;
+    for (size_t b = 0; b < 8; ++b) {
+        prefix = (prefix << 8) | (b < e.nameLen ? name[b] : 0);
+    }
+
+    return {key, prefix, e.nameOffset, e.nameLen, entry};
+}
+
+uint64_t ListingLayout::newestFirst(time_t mtime) {
+    // Flip the sign bit so signed order becomes unsigned order, then invert
+    return ~(static_cast<uint64_t>(mtime) ^ (uint64_t(1) << 63));
+}
+
+uint64_t ListingLayout::largestFirst(off_t size) {
+    return ~static_cast<uint64_t>(size);
+}
+
+/**
+ * @brief Sort records by key, then by name bytes
+ * Most comparisons are decided by the two integer fields; the name buffer
+ * is only touched when the first eight bytes tie.
+ * @param records Records to sort in place
+ * @param names The listing's name buffer the records point into
+ */
+void ListingLayout::sort(std::vector<Record>& records, const char* names) {
+    std::sort(records.begin(), records.end(), [names](const Record& a, const Record& b) {
+        if (a.key != b.key) return a.key < b.key;
+        if (a.prefix != b.prefix) return a.prefix < b.prefix;
+        if (a.nameLen <= 8 || b.nameLen <= 8) return a.nameLen < b.nameLen;
+
+        size_t n = std::min(a.nameLen, b.nameLen) - 8;
+        int cmp = memcmp(names + a.nameOffset + 8, names + b.nameOffset + 8, n);
+        return cmp != 0 ? cmp < 0 : a.nameLen < b.nameLen;
+    });
+}
+
+/**
+ * @brief Append records as columns, filled top to bottom then left to right
+ * Every column count up to width / 3 is tried in one pass over the names
+ * (as GNU ls does), and the widest layout that fits is used. Widths are
+ * byte lengths.
+ * @param out Arena the rows are written into, each ending in '\n'
+ * @param records Sorted records
+ * @param names The listing's name buffer
+ * @param width Terminal width in columns
+ */
+void ListingLayout::columns(TextArena& out, const std::vector<Record>& records, const char* names, size_t width) {
+    const size_t n = records.size();
+    if (n == 0) return;
+
+    const size_t maxCols = std::max<size_t>(1, std::min(n, width / kMinColumnWidth));
+
+    // Layout c (1-based) keeps its c column widths at colWidths[c*(c-1)/2 ...]
+    std::vector<size_t> colWidths(maxCols * (maxCols + 1) / 2, 0);
+    std::vector<size_t> lineLen(maxCols + 1, 0);
+    std::vector<char> fits(maxCols + 1, 1);
+
+    for (size_t i = 0; i < n; ++i) {
+        const size_t len = records[i].nameLen;
+        for (size_t c = 1; c <= maxCols; ++c) {
+            if (!fits[c]) continue;
+
+            size_t rows = (n + c - 1) / c;
+            size_t col = i / rows;
+            size_t need = len + (col == c - 1 ? 0 : kColumnGap);
+            size_t& w = colWidths[c * (c - 1) / 2 + col];
+            if (w < need) {
+                lineLen[c] += need - w;
+                w = need;
+                fits[c] = lineLen[c] < width;
+            }
+        }
+    }
+
+    size_t cols = maxCols;
+    while (cols > 1 && !fits[cols]) --cols;
+
+    const size_t rows = (n + cols - 1) / cols;
+    const size_t* widths = colWidths.data() + cols * (cols - 1) / 2;
+
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t c = 0; c < cols; ++c) {
+            size_t i = c * rows + r;
+            if (i >= n) break;
+
+            const Record& rec = records[i];
+            out.append(names + rec.nameOffset, rec.nameLen);
+
+            // Pad only when another name follows on this row
+            if (i + rows < n) {
+                for (size_t pad = rec.nameLen; pad < widths[c]; ++pad) out.put(' ');
+            }
+        }
+        out.put('\n');
+    }
+}
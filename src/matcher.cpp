@@ -0,0 +1,347 @@
+#include "matcher.h"
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+static inline unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+LiteralSearcher::LiteralSearcher(const std::string& needle, bool foldCase)
+    : needle_(needle), foldCase_(foldCase) {
+    const size_t m = needle_.size();
+
+    if (foldCase_) {
+        for (char& c : needle_) {
+            c = static_cast<char>(fold(c));
+        }
+    }
+
+    for (size_t& s : shift_) {
+        s = m;
+    }
+
+    for (size_t i = 0; i + 1 < m; ++i) {
+        unsigned char c = needle_[i];
+        shift_[c] = m - 1 - i;
+        if (foldCase_) {
+            shift_[toupper(c)] = m - 1 - i;
+        }
+    }
+}
+
+bool LiteralSearcher::equalAt(const char* data) const {
+    const size_t m = needle_.size();
+    if (!foldCase_) {
+        return memcmp(data, needle_.data(), m - 1) == 0;
+    }
+    for (size_t i = 0; i + 1 < m; ++i) {
+        if (fold(data[i]) != static_cast<unsigned char>(needle_[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t LiteralSearcher::find(const char* data, size_t len) const {
+    const size_t m = needle_.size();
+    if (m == 0) return 0;
+    if (m > len) return npos;
+
+    if (m == 1) {
+        unsigned char c = needle_[0];
+        const void* hit = memchr(data, c, len);
+        size_t pos = hit ? static_cast<const char*>(hit) - data : npos;
+
+        unsigned char upper = toupper(c);
+        if (foldCase_ && upper != c) {
+            const void* other = memchr(data, upper, hit ? pos : len);
+            if (other) pos = static_cast<const char*>(other) - data;
+        }
+        return pos;
+    }
+
+    const unsigned char last = needle_[m - 1];
+    size_t i = 0;
+
+    while (i <= len - m) {
+        unsigned char c = data[i + m - 1];
+        unsigned char cmp = foldCase_ ? fold(c) : c;
+        if (cmp == last && equalAt(data + i)) {
+            return i;
+        }
+        i += shift_[c];
+    }
+
+    return npos;
+}
+
+/* --- Pattern analysis --- */
+
+// ECMAScript metacharacters
+static bool isMeta(char c) {
+    return c != '\0' && strchr("\\^$.|?*+()[]{}", c) != nullptr;
+}
+
+static bool isQuantifier(char c) {
+    return c == '?' || c == '*' || c == '{';
+}
+
+/**
+ * @brief Collect the literal text at the start of pattern[begin, end)
+ * @param out Receives every character a match is guaranteed to start with
+ * @return true if the whole range is a plain literal
+ */
+static bool literalPrefix(const std::string& pattern, size_t begin, size_t end, std::string& out) {
+    size_t i = begin;
+
+    while (i < end) {
+        char c = pattern[i];
+        size_t next;
+
+        if (c == '\\') {
+            // "\." is a literal dot; "\d", "\b", "\w", ... are classes
+            if (i + 1 >= end || isalnum(static_cast<unsigned char>(pattern[i + 1]))) {
+                return false;
+            }
+            c = pattern[i + 1];
+            next = i + 2;
+        } else if (isMeta(c)) {
+            // "+" still requires the previous character once
+            return false;
+        } else {
+            next = i + 1;
+        }
+
+        // A quantified character is optional, so it cannot be part of the prefix
+        if (next < end && isQuantifier(pattern[next])) {
+            return false;
+        }
+
+        out += c;
+        i = next;
+    }
+
+    return true;
+}
+
+static bool isAscii(const std::string& s) {
+    for (unsigned char c : s) {
+        if (c >= 0x80) return false;
+    }
+    return true;
+}
+
+Matcher::Matcher(const std::string& pattern, bool ignoreCase, bool wholeWord) : ignoreCase_(ignoreCase) {
+    const size_t n = pattern.size();
+
+    // Alternation means no single literal is required; leave it to the regex
+    bool alternation = false;
+    for (size_t i = 0; i < n; ++i) {
+        if (pattern[i] == '\\') {
+            ++i;
+        } else if (pattern[i] == '|') {
+            alternation = true;
+        }
+    }
+
+    // Literal folding is ASCII-only; anything else keeps the regex semantics
+    bool foldable = !ignoreCase || isAscii(pattern);
+
+    if (!alternation && foldable) {
+        bool anchoredStart = n > 0 && pattern[0] == '^';
+        size_t begin = anchoredStart ? 1 : 0;
+
+        std::string lit;
+        bool fullyLiteral = literalPrefix(pattern, begin, n, lit);
+
+        // Trailing "$", as long as it is not the escaped "\$" consumed above
+        bool anchoredEnd = false;
+        std::string litBody;
+        if (!fullyLiteral && n > begin && pattern[n - 1] == '$' &&
+            literalPrefix(pattern, begin, n - 1, litBody)) {
+            anchoredEnd = true;
+            lit = litBody;
+            fullyLiteral = true;
+        }
+
+        if (fullyLiteral && !lit.empty() && !wholeWord) {
+            literal_ = ignoreCase ? std::string() : lit;
+            if (ignoreCase) {
+                for (char c : lit) literal_ += static_cast<char>(fold(c));
+            }
+
+            if (anchoredStart && anchoredEnd) kind_ = Kind::Exact;
+            else if (anchoredStart) kind_ = Kind::AnchoredStart;
+            else if (anchoredEnd) kind_ = Kind::AnchoredEnd;
+            else kind_ = Kind::Literal;
+
+            searcher_ = LiteralSearcher(lit, ignoreCase);
+            return;
+        }
+
+        if (!lit.empty()) {
+            kind_ = Kind::Prefiltered;
+            searcher_ = LiteralSearcher(lit, ignoreCase);
+        }
+    }
+
+    std::regex_constants::syntax_option_type flags = std::regex_constants::ECMAScript;
+    if (ignoreCase) {
+        flags |= std::regex_constants::icase;
+    }
+
+    re_ = std::regex(wholeWord ? "\\b" + pattern + "\\b" : pattern, flags);
+}
+
+size_t Matcher::findCandidate(const char* data, size_t len) const {
+    if (kind_ == Kind::Literal || kind_ == Kind::Prefiltered) {
+        return searcher_.find(data, len);
+    }
+    return len == 0 ? npos : 0;
+}
+
+bool Matcher::equalsLiteral(const char* data, size_t len) const {
+    if (len != literal_.size()) return false;
+    if (!ignoreCase_) return memcmp(data, literal_.data(), len) == 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (fold(data[i]) != static_cast<unsigned char>(literal_[i])) return false;
+    }
+    return true;
+}
+
+bool Matcher::matchLine(std::string_view lineView, size_t& matchStart, size_t& matchLen) const {
+    const char* line = lineView.data();
+    const size_t len = lineView.size();
+    const size_t litLen = literal_.size();
+
+    switch (kind_) {
+        case Kind::Literal:
+            matchStart = searcher_.find(line, len);
+            matchLen = litLen;
+            return matchStart != npos;
+
+        case Kind::AnchoredStart:
+            matchStart = 0;
+            matchLen = litLen;
+            return len >= litLen && equalsLiteral(line, litLen);
+
+        case Kind::AnchoredEnd:
+            matchStart = len - litLen;
+            matchLen = litLen;
+            return len >= litLen && equalsLiteral(line + len - litLen, litLen);
+
+        case Kind::Exact:
+            matchStart = 0;
+            matchLen = litLen;
+            return equalsLiteral(line, len);
+
+        case Kind::Prefiltered:
+            if (searcher_.find(line, len) == npos) {
+                return false;
+            }
+            break;
+
+        case Kind::Regex:
+            break;
+    }
+
+    std::cmatch match;
+    if (!std::regex_search(line, line + len, match, re_)) {
+        return false;
+    }
+
+    matchStart = match.position(0);
+    matchLen = match.length(0);
+    return true;
+}
+
+/* --- MatcherCache --- */
+
+namespace {
+
+struct CacheState {
+    using Entry = std::pair<std::string, std::shared_ptr<const Matcher>>;
+
+    std::mutex mutex;
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    MatcherCache::Stats stats;
+
+    CacheState() {
+        stats.capacity = 64;
+        if (const char* env = getenv("CUSTOM_SHELL_REGEX_CACHE")) {
+            stats.capacity = strtoul(env, nullptr, 10);
+        }
+    }
+};
+
+CacheState& cacheState() {
+    static CacheState state;
+    return state;
+}
+
+} // namespace
+
+std::shared_ptr<const Matcher> MatcherCache::get(const std::string& pattern, bool ignoreCase, bool wholeWord) {
+    CacheState& cache = cacheState();
+
+    std::string key = pattern;
+    key += '\0';
+    key += ignoreCase ? 'i' : '-';
+    key += wholeWord ? 'w' : '-';
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        auto it = cache.index.find(key);
+        if (it != cache.index.end()) {
+            ++cache.stats.hits;
+            cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+            return it->second->second;
+        }
+        ++cache.stats.misses;
+    }
+
+    // Compile outside the lock; a concurrent miss on the same key just compiles twice
+    auto matcher = std::make_shared<const Matcher>(pattern, ignoreCase, wholeWord);
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.stats.capacity == 0 || cache.index.count(key)) {
+        return matcher;
+    }
+
+    cache.entries.emplace_front(key, matcher);
+    cache.index[key] = cache.entries.begin();
+
+    while (cache.entries.size() > cache.stats.capacity) {
+        cache.index.erase(cache.entries.back().first);
+        cache.entries.pop_back();
+        ++cache.stats.evictions;
+    }
+
+    return matcher;
+}
+
+MatcherCache::Stats MatcherCache::stats() {
+    CacheState& cache = cacheState();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    Stats s = cache.stats;
+    s.size = cache.entries.size();
+    return s;
+}
+
+void MatcherCache::clear() {
+    CacheState& cache = cacheState();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    cache.entries.clear();
+    cache.index.clear();
+    size_t capacity = cache.stats.capacity;
+    cache.stats = Stats();
+    cache.stats.capacity = capacity;
+}
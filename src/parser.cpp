@@ -1,27 +1,78 @@
 #include "parser.h"
 #include <stdexcept>
 
+namespace {
+
+struct OpInfo {
+    bool isOperator;
+    int precedence;
+    bool rightAssoc;
+    bool mayEndLine; // "a;" is complete without a right-hand side
+    AST::OpType op;
+};
+
+constexpr OpInfo kWord = {false, -1, false, false, AST::OpType::Pipe};
+
+constexpr size_t kTokenTypes = static_cast<size_t>(TokenType::END_OF_INPUT) + 1;
+
+/**
+ * Everything the parser needs to know about a token, indexed by TokenType.
+ * Precedence and associativity follow the table in parser.h.
+ */
+constexpr OpInfo kOpTable[kTokenTypes] = {
+    /* WORD         */ kWord,
+    /* QUOTED       */ kWord,
+    /* AND_OP       */ {true, 3, false, false, AST::OpType::And},
+    /* OR_OP        */ {true, 2, false, false, AST::OpType::Or},
+    /* APPEND_OP    */ {true, 5, false, false, AST::OpType::Append},
+    /* PIPE         */ {true, 4, false, false, AST::OpType::Pipe},
+    /* REDIR_OUT    */ {true, 5, false, false, AST::OpType::RedirectOut},
+    /* REDIR_IN     */ {true, 5, false, false, AST::OpType::RedirectIn},
+    /* SEMICOLON    */ {true, 0, false, true,  AST::OpType::Seq},
+    /* AMPERSAND    */ {true, 1, true,  true,  AST::OpType::Background},
+    /* END_OF_INPUT */ kWord,
+};
+
+static_assert(kOpTable[static_cast<size_t>(TokenType::PIPE)].op == AST::OpType::Pipe &&
+              kOpTable[static_cast<size_t>(TokenType::AMPERSAND)].op == AST::OpType::Background,
+              "kOpTable is out of sync with TokenType");
+
+constexpr const OpInfo& opInfo(TokenType type) {
+    return kOpTable[static_cast<size_t>(type)];
+}
+
+} // namespace
+
 AST Parser::parse(const std::vector<Token>& tokens) {
     if (tokens.empty()) {
         throw std::runtime_error("Cannot parse empty token list");
     }
 
+    // Every token becomes at most one node and one word
+    size_t chars = 0;
+    for (const Token& tok : tokens) {
+        chars += tok.lexeme.size();
+    }
+
+    AST tree;
+    tree.reserve(tokens.size(), chars);
+
     int index = 0;
     // <START> ::= <COMMAND_LINE> <END_OF_INPUT>
     // END_OF_INPUT is implicitly handled by reaching tokens.size()
-    AST tree = parseCmdLine(index, tokens);
+    tree.setRoot(parseCmdLine(tree, index, tokens));
     return tree;
 }
 
 // <COMMAND_LINE> ::= <OP_EXPR>
-AST Parser::parseCmdLine(int& index, const std::vector<Token>& tokens) {
-    AST lhs = parseCmdAtomic(index, tokens);
-    return parseOpExpr(std::move(lhs), 0, index, tokens);
+AST::NodeId Parser::parseCmdLine(AST& tree, int& index, const std::vector<Token>& tokens) {
+    AST::NodeId lhs = parseCmdAtomic(tree, index, tokens);
+    return parseOpExpr(tree, lhs, 0, index, tokens);
 }
 
 // <COMMAND_ATOM> ::= <WORD_OR_QUOTED> <ARG_LIST>
 // <ARG_LIST> implemented via a loop until an operator is seen
-AST Parser::parseCmdAtomic(int& index, const std::vector<Token>& tokens) {
+AST::NodeId Parser::parseCmdAtomic(AST& tree, int& index, const std::vector<Token>& tokens) {
     int n = tokens.size();
     if (index >= n) {
         throw std::runtime_error("Unexpected end of input in command atom");
@@ -29,22 +80,22 @@ AST Parser::parseCmdAtomic(int& index, const std::vector<Token>& tokens) {
     
     if (isOperator(tokens[index])) {
         throw std::runtime_error(
-            "Expected command, found operator '" + tokens[index].lexeme + "'"
+            "Expected command, found operator '" + std::string(tokens[index].lexeme) + "'"
         );
     }
 
-    // First element is the command name
-    std::string cmd = tokens[index].lexeme;
+    // First element is the command name, then arguments until we hit an operator
+    uint32_t first = tree.addWord(tokens[index].lexeme);
+    uint32_t count = 1;
     ++index;
 
-    // Then collect arguments until we hit an operator
-    std::vector<std::string> args;
     while (index < n && !isOperator(tokens[index])) {
-        args.push_back(tokens[index].lexeme);
+        tree.addWord(tokens[index].lexeme);
+        ++count;
         ++index;
     }
 
-    return AST::makeCommandNode(std::move(cmd), std::move(args));
+    return tree.addCommand(first, count);
 }
 
 /**
@@ -56,59 +107,48 @@ AST Parser::parseCmdAtomic(int& index, const std::vector<Token>& tokens) {
  *    - If next operator has higher precedence, recursively parse its RHS first
  *    - Otherwise return to the caller
  */
-AST Parser::parseOpExpr(AST lhs, int min_prec, int& index, const std::vector<Token>& tokens) {
+AST::NodeId Parser::parseOpExpr(AST& tree, AST::NodeId lhs, int min_prec, int& index, const std::vector<Token>& tokens) {
     int n = tokens.size();
 
     while (index < n) {
+        const OpInfo& info = opInfo(tokens[index].type);
 
-        if (!isOperator(tokens[index])) {
+        if (!info.isOperator || info.precedence < min_prec) {
             break;
         }
 
-        const std::string& op = tokens[index].lexeme;
-        int prec = precedence(op);
-
-        if (prec < min_prec) { 
+        ++index;
+        if (index >= n && info.mayEndLine) {
+            // A trailing ";" adds nothing; a trailing "&" still needs its node
+            if (info.op == AST::OpType::Background) {
+                lhs = tree.addOperator(info.op, lhs, AST::kNone);
+            }
             break;
         }
 
-        ++index;
-        AST rhs = parseCmdAtomic(index, tokens);
+        AST::NodeId rhs = parseCmdAtomic(tree, index, tokens);
 
-        // Handle higher-precedence operators on the RHS
-        while (index < n && isOperator(tokens[index])) {
+        // Handle higher-precedence (or equal, right-associative) operators on the RHS
+        while (index < n) {
+            const OpInfo& next = opInfo(tokens[index].type);
 
-            std::string next = tokens[index].lexeme;
-            int next_prec = precedence(next);
+            bool bindsTighter = next.precedence > info.precedence ||
+                                (next.rightAssoc && next.precedence == info.precedence);
 
-            if (next_prec > prec) {
-                rhs = parseOpExpr(std::move(rhs), next_prec, index, tokens);
-            } else {
+            if (!next.isOperator || !bindsTighter) {
                 break;
             }
+
+            rhs = parseOpExpr(tree, rhs, next.precedence, index, tokens);
         }
 
-        lhs = AST::makeOperatorNode(op, std::move(lhs), std::move(rhs));
+        lhs = tree.addOperator(info.op, lhs, rhs);
     }
 
     return lhs;
 }
 
+// Quoted text is always a word, even when it spells an operator
 bool Parser::isOperator(const Token& token) {
-    const std::string& op = token.lexeme;
-    return (
-        op == "||" || op == "&&" ||
-        op == "|"  ||
-        op == ">"  || op == ">>" || op == "<" ||
-        op == ";" || op == "&"
-    );
-}
-
-int Parser::precedence(const std::string& op) {
-    if (op == "||") return 1;
-    if (op == "&&") return 2;
-    if (op == "|")  return 3;
-    if (op == ">" || op == ">>" || op == "<") return 4;
-    if (op == ";" || op == "&") return 0;
-    return -1;
+    return opInfo(token.type).isOperator;
 }
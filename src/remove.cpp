@@ -0,0 +1,39 @@
+#include "remove.h"
+#include "walk.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+std::vector<std::string> TreeRemover::removeTree(const std::string& path, size_t threads) {
+    TreeWalker::Options options;
+    options.threads = threads;
+    options.followRoot = false;
+
+    TreeWalker walker(options);
+
+    // Everything but directories goes on the way down
+    walker.onVisit([&walker](const TreeWalker::Entry& entry) {
+        if (entry.type == DT_DIR) {
+            return true;
+        }
+        if (unlinkat(entry.dirFd, entry.name, 0) == -1) {
+            walker.fail(entry, "cannot remove", errno);
+        }
+        return false;
+    });
+
+    // A directory goes once its last child has, from whichever worker removed that child
+    walker.onLeave([&walker](const TreeWalker::Entry& entry, bool failedBelow) {
+        if (unlinkat(entry.dirFd, entry.name, AT_REMOVEDIR) == 0) {
+            return;
+        }
+        // A failed descendant already explains why this directory is not empty
+        if (failedBelow && errno == ENOTEMPTY) {
+            return;
+        }
+        walker.fail(entry, "failed to remove directory", errno);
+    });
+
+    return walker.run(path);
+}
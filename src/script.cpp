@@ -0,0 +1,304 @@
+#include "script.h"
+#include "lexer.h"
+#include "parser.h"
+#include "executor.h"
+#include "stream.h"
+#include "jobs.h"
+#include "trace.h"
+#include "session.h"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+namespace {
+
+// Bump when the AST layout or the file format changes
+constexpr char kPlanMagic[8] = {'C', 'S', 'P', 'L', 'A', 'N', '0', '1'};
+
+uint64_t hashText(std::string_view text) {
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+bool isBlankOrComment(std::string_view line) {
+    for (char c : line) {
+        if (c == '#') return true;
+        if (c != ' ' && c != '\t') return false;
+    }
+    return true;
+}
+
+void putU64(std::string& out, uint64_t v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+bool getU64(std::string_view& in, uint64_t& v) {
+    if (in.size() < sizeof(v)) return false;
+    memcpy(&v, in.data(), sizeof(v));
+    in.remove_prefix(sizeof(v));
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Run a script file
+ * Regular files are mapped rather than read; the plans come from the plan
+ * cache when one is configured and holds an entry for these exact contents.
+ * @return Exit status of the last command, 2 on a syntax error, or 127 if
+ *         the file cannot be read
+ */
+int Script::runFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        reportError("custom-shell: cannot open '" + path + "': " + strerror(errno));
+        if (fd != -1) close(fd);
+        return 127;
+    }
+
+    // Pipes, FIFOs and /dev/stdin report no size and cannot be mapped, so
+    // anything but a regular file, or one the map refuses, is read instead
+    MappedFile map;
+    std::string buffer;
+    std::string_view text;
+    bool regular = S_ISREG(st.st_mode);
+    if (regular && (st.st_size == 0 || map.map(fd))) {
+        text = map.view();
+    } else {
+        InputSource src(fd);
+        std::string_view chunk;
+        bool readOk;
+        while ((readOk = src.next(chunk)) && !chunk.empty()) {
+            buffer.append(chunk.data(), chunk.size());
+        }
+        if (!readOk) {
+            int readErrno = errno;
+            close(fd);
+            reportError("custom-shell: cannot read '" + path + "': " + strerror(readErrno));
+            return 127;
+        }
+        text = buffer;
+    }
+    close(fd);
+
+    const size_t size = text.size();
+    std::vector<Plan> plans;
+    bool ok = true;
+
+    const char* cacheDir = getenv("CUSTOM_SHELL_PLAN_CACHE");
+    bool useCache = cacheDir && *cacheDir;
+    uint64_t hash = useCache ? hashText(text) : 0;
+    std::string cacheFile = useCache ? cachePath(cacheDir, hash) : "";
+
+    if (cacheFile.empty() || !loadCache(cacheFile, hash, size, plans)) {
+        plans.clear();
+        ok = parseAll(text, path, plans);
+        if (ok && !cacheFile.empty()) {
+            storeCache(cacheFile, hash, size, plans);
+        }
+    }
+
+    // Plans own copies of every word, so the text can go before running
+    map.reset();
+    std::string().swap(buffer);
+
+    return ok ? runAll(plans) : 2;
+}
+
+int Script::runString(std::string_view text, const std::string& name) {
+    std::vector<Plan> plans;
+    if (!parseAll(text, name, plans)) {
+        return 2;
+    }
+    return runAll(plans);
+}
+
+/**
+ * @brief Lex and parse every command line of a script up front
+ * Every syntax error is reported, not just the first.
+ * @return false if any line failed to parse
+ */
+bool Script::parseAll(std::string_view text, const std::string& name, std::vector<Plan>& plans) {
+    bool ok = true;
+    uint32_t lineNo = 0;
+
+    while (!text.empty()) {
+        size_t nl = text.find('\n');
+        std::string_view line = text.substr(0, nl);
+        text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+        ++lineNo;
+
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (isBlankOrComment(line)) {
+            continue;
+        }
+
+        try {
+            std::vector<Token> tokens;
+            {
+                Trace::Span span("phase", "lex", line);
+                tokens = Lexer::tokenize(line);
+            }
+            if (tokens.empty()) continue;
+
+            Trace::Span span("phase", "parse", line);
+            plans.push_back({lineNo, Parser::parse(tokens)});
+        } catch (const std::exception& ex) {
+            reportError(name + ":" + std::to_string(lineNo) + ": Error: " + ex.what());
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+int Script::runAll(const std::vector<Plan>& plans) {
+    int status = 0;
+    for (const Plan& plan : plans) {
+        // In server mode "quit" ends only the current request
+        Session* session = Session::current();
+        if (session && session->quit) {
+            break;
+        }
+
+        Trace::Span span("phase", "execute", Trace::enabled() ? plan.ast.text(plan.ast.root()) : std::string());
+        status = runPlan(plan.ast);
+    }
+    return status;
+}
+
+/**
+ * @brief Execute one parsed command line
+ * Output goes to the shared stdout sink and is not flushed here; it is only
+ * flushed ahead of an error message so the two still appear in order.
+ * @return Exit status of the command line
+ */
+int Script::runPlan(const AST& ast) {
+    OutputSink& out = OutputSink::standardOutput();
+
+    // Collect background jobs that finished in the meantime
+    JobTable::reap();
+
+    try {
+        IOContext io;
+        io.out = &out;
+
+        CommandResult result = Executor::executeCommand(ast, io);
+
+        if (!result.error.empty()) {
+            reportError(result.error);
+        }
+        return result.status;
+    } catch (const std::exception& ex) {
+        reportError(std::string("Error: ") + ex.what());
+        return 1;
+    }
+}
+
+void Script::reportError(const std::string& message) {
+    OutputSink::standardOutput().flush();
+    Session::writeError(message);
+}
+
+/* --- Plan cache --- */
+
+std::string Script::cachePath(const char* dir, uint64_t hash) {
+    static const char hex[] = "0123456789abcdef";
+    std::string name(16, '0');
+    for (int i = 15; i >= 0; --i, hash >>= 4) {
+        name[i] = hex[hash & 0xF];
+    }
+    return std::string(dir) + "/" + name + ".plan";
+}
+
+bool Script::loadCache(const std::string& path, uint64_t hash, size_t size, std::vector<Plan>& plans) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    std::string data;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, n);
+    }
+    close(fd);
+    if (n == -1) {
+        return false;
+    }
+
+    std::string_view in(data);
+    uint64_t storedHash, storedSize, count;
+    if (in.size() < sizeof(kPlanMagic) || memcmp(in.data(), kPlanMagic, sizeof(kPlanMagic)) != 0) {
+        return false;
+    }
+    in.remove_prefix(sizeof(kPlanMagic));
+
+    // The name already encodes the hash; the size guards against collisions
+    if (!getU64(in, storedHash) || !getU64(in, storedSize) || !getU64(in, count) ||
+        storedHash != hash || storedSize != size) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t line;
+        Plan plan;
+        if (!getU64(in, line) || !AST::deserialize(in, plan.ast)) {
+            return false;
+        }
+        plan.line = static_cast<uint32_t>(line);
+        plans.push_back(std::move(plan));
+    }
+
+    return in.empty();
+}
+
+// Best effort: a cache that cannot be written only costs the next run a parse
+void Script::storeCache(const std::string& path, uint64_t hash, size_t size, const std::vector<Plan>& plans) {
+    std::string data(kPlanMagic, sizeof(kPlanMagic));
+    putU64(data, hash);
+    putU64(data, size);
+    putU64(data, plans.size());
+    for (const Plan& plan : plans) {
+        putU64(data, plan.line);
+        plan.ast.serialize(data);
+    }
+
+    // Write under a temporary name so concurrent runs never see a partial file
+    std::string tmp = path + "." + std::to_string(getpid()) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+
+    if (close(fd) == 0 && left == 0) {
+        rename(tmp.c_str(), path.c_str());
+    } else {
+        unlink(tmp.c_str());
+    }
+}
@@ -0,0 +1,271 @@
+#include "server.h"
+#include "script.h"
+#include "session.h"
+#include "stream.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+extern char** environ;
+
+static const uint32_t kMagic = 0x63736831; // "csh1"
+static const uint32_t kMaxPayload = 64u << 20;
+
+/**
+ * @brief Fill in a sockaddr_un for path.
+ * @param path Socket path.
+ * @param addr Address to fill in.
+ * @return false if the path does not fit in sun_path.
+ */
+static bool socketAddress(const std::string& path, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        Script::reportError("custom-shell: " + path + ": socket path too long");
+        return false;
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    return true;
+}
+
+/**
+ * @brief Write all of buf to fd, retrying short writes.
+ * @return true if everything was written.
+ */
+static bool writeAll(int fd, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Read exactly len bytes from fd.
+ * @return true if all of them arrived before end of file.
+ */
+static bool readAll(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Connect a stream socket to the server at path.
+ * @param path Socket path.
+ * @return The connected socket, or -1 if nothing is listening there.
+ */
+static int dial(const std::string& path) {
+    sockaddr_un addr;
+    if (!socketAddress(path, addr)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int Server::serve(const std::string& socketPath) {
+    sockaddr_un addr;
+    if (!socketAddress(socketPath, addr)) return 1;
+
+    // Only a socket nobody answers on is stale enough to replace
+    int existing = dial(socketPath);
+    if (existing != -1) {
+        close(existing);
+        Script::reportError("custom-shell: " + socketPath + ": a server is already listening");
+        return 1;
+    }
+    unlink(socketPath.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1 ||
+        bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+        listen(listener, SOMAXCONN) == -1) {
+        Script::reportError("custom-shell: " + socketPath + ": " + strerror(errno));
+        if (listener != -1) close(listener);
+        return 1;
+    }
+
+    while (true) {
+        int conn = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+            Script::reportError("custom-shell: accept: " + std::string(strerror(errno)));
+            close(listener);
+            return 1;
+        }
+        std::thread(&Server::handle, conn).detach();
+    }
+}
+
+/**
+ * @brief Run one client request on the calling thread.
+ *
+ * The thread gets a private working directory before changing into the
+ * client's, so concurrent requests never see each other's cd.
+ *
+ * @param conn Accepted connection; closed on return.
+ */
+void Server::handle(int conn) {
+    uint32_t header[2];
+    int fds[3] = {-1, -1, -1};
+
+    iovec iov = {header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n == -1 && errno == EINTR);
+
+    int received = 0;
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            received = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), std::min<size_t>(received, 3) * sizeof(int));
+        }
+    }
+
+    auto finish = [&](int32_t status) {
+        writeAll(conn, &status, sizeof(status));
+        for (int fd : fds) {
+            if (fd != -1) close(fd);
+        }
+        close(conn);
+    };
+
+    std::string payload;
+    if (n != sizeof(header) || header[0] != kMagic || header[1] > kMaxPayload || received != 3 ||
+        (msg.msg_flags & MSG_CTRUNC)) {
+        finish(2);
+        return;
+    }
+    payload.resize(header[1]);
+    if (!readAll(conn, &payload[0], payload.size())) {
+        finish(2);
+        return;
+    }
+
+    // cwd '\0' commands '\0' then the environment, one entry per '\0'
+    size_t cwdEnd = payload.find('\0');
+    size_t commandEnd = cwdEnd == std::string::npos ? cwdEnd : payload.find('\0', cwdEnd + 1);
+    if (commandEnd == std::string::npos) {
+        finish(2);
+        return;
+    }
+
+    OutputSink sink(fds[1]);
+    Session session;
+    session.in = fds[0];
+    session.err = fds[2];
+    session.out = &sink;
+    for (size_t pos = commandEnd + 1; pos < payload.size();) {
+        size_t end = payload.find('\0', pos);
+        if (end == std::string::npos) end = payload.size();
+        if (end > pos) session.env.emplace_back(payload, pos, end - pos);
+        pos = end + 1;
+    }
+
+    Session::Scope scope(&session);
+
+    const std::string cwd = payload.substr(0, cwdEnd);
+    if (unshare(CLONE_FS) == -1 || chdir(cwd.c_str()) == -1) {
+        Session::writeError("custom-shell: " + cwd + ": " + strerror(errno));
+        finish(1);
+        return;
+    }
+
+    std::string_view commands(payload.data() + cwdEnd + 1, commandEnd - cwdEnd - 1);
+    int status = Script::runString(commands, "-c");
+    sink.flush();
+    finish(status);
+}
+
+int Server::connect(const std::string& socketPath, const std::string& commands) {
+    int fd = dial(socketPath);
+    if (fd == -1) return -1;
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        close(fd);
+        return -1;
+    }
+
+    std::string payload(cwd);
+    payload += '\0';
+    payload += commands;
+    payload += '\0';
+    for (char** e = environ; *e; ++e) {
+        payload += *e;
+        payload += '\0';
+    }
+    if (payload.size() > kMaxPayload) {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t header[2] = {kMagic, static_cast<uint32_t>(payload.size())};
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+
+    iovec iov = {header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+
+    // Nothing reached the server yet, so running locally instead is still safe
+    if (n != sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+
+    int32_t status;
+    if (!writeAll(fd, payload.data(), payload.size()) || !readAll(fd, &status, sizeof(status))) {
+        close(fd);
+        Script::reportError("custom-shell: " + socketPath + ": server closed the connection");
+        return 1;
+    }
+
+    close(fd);
+    return status;
+}
@@ -0,0 +1,86 @@
+#include "session.h"
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <iostream>
+#include <limits>
+
+extern char** environ;
+
+static thread_local Session* currentSession = nullptr;
+
+Session::Scope::Scope(Session* session) : previous_(currentSession) {
+    currentSession = session;
+}
+
+Session::Scope::~Scope() {
+    currentSession = previous_;
+}
+
+Session* Session::current() {
+    return currentSession;
+}
+
+const char* Session::getenv(const char* name) {
+    Session* session = currentSession;
+    if (!session) {
+        return ::getenv(name);
+    }
+
+    const size_t len = strlen(name);
+    for (const std::string& entry : session->env) {
+        if (entry.size() > len && entry[len] == '=' && entry.compare(0, len, name) == 0) {
+            return entry.c_str() + len + 1;
+        }
+    }
+    return nullptr;
+}
+
+char** Session::environment() {
+    Session* session = currentSession;
+    if (!session) {
+        return environ;
+    }
+
+    // Built on first use; the entries do not change during a request
+    if (session->envp_.empty()) {
+        for (std::string& entry : session->env) {
+            session->envp_.push_back(&entry[0]);
+        }
+        session->envp_.push_back(nullptr);
+    }
+    return session->envp_.data();
+}
+
+void Session::writeError(const std::string& message) {
+    Session* session = currentSession;
+    if (!session) {
+        std::cerr << message << "\n";
+        return;
+    }
+
+    std::string line = message + "\n";
+    const char* p = line.data();
+    size_t left = line.size();
+    while (left > 0) {
+        ssize_t n = write(session->err, p, left);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return;
+        p += n;
+        left -= n;
+    }
+}
+
+void Session::waitForNewline() {
+    Session* session = currentSession;
+    if (!session) {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        return;
+    }
+
+    char c;
+    ssize_t n;
+    while ((n = read(session->in, &c, 1)) == 1 || (n == -1 && errno == EINTR)) {
+        if (n == 1 && c == '\n') return;
+    }
+}
@@ -1,69 +1,141 @@
-#include <iostream>
-#include <string>
-#include <vector>
-#include "lexer.h"
-#include "parser.h"
-#include "ast.h"
-#include "token.h"
-#include "executor.h"
-#include "commands.h"
-#include <limits.h>
-#include <unistd.h>
-
-int main() {
-    std::cout << "|  Welcome to our Custom Shell!\n";
-    std::cout << "|  Type help for our list of commands!\n";
-
-    while (true) {
-        char cwd[PATH_MAX];
-        getcwd(cwd, sizeof(cwd));
-        std::cout << "custom-shell:" << cwd << "# ";
-
-        std::string input;
-        std::getline(std::cin, input);
-
-        if (input.empty()) {
-            continue;
-        }
-
-        try {
-            std::vector<Token> tokens = Lexer::tokenize(input);
-
-            AST ast = Parser::parse(tokens);
-
-            CommandResult result = Executor::executeCommand(ast);
-
-            bool printNewline = false;
-
-            if (result.status == 0) {
-                if (!result.output.empty()) {
-                    printNewline = true;
-                }
-
-                if (result.output.rfind("__NO_NL__", 0) == 0) {
-                    printNewline = false;
-                    result.output = result.output.substr(9); 
-                }
-
-                std::cout << result.output;
-            }
-
-            if (result.status == 1) {
-                if (!result.error.empty()) {
-                    printNewline = true;
-                }
-                
-                std::cerr << result.error;
-            }
-            
-            if (printNewline) {
-                std::cout << "\n";
-            }
-            
-        } catch (const std::exception& ex) {
-            std::cerr << "Error: " << ex.what() << "\n";
-        }
-    }
-
-    return 0;
-}
+#include <iostream>
+#include <string>
+#include <vector>
+#include "lexer.h"
+#include "parser.h"
+#include "ast.h"
+#include "token.h"
+#include "script.h"
+#include "stream.h"
+#include "jobs.h"
+#include "trace.h"
+#include "server.h"
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+
+static int interactive() {
+    OutputSink& out = OutputSink::standardOutput();
+
+    out.write("|  Welcome to our Custom Shell!\n");
+    out.write("|  Type help for our list of commands!\n");
+
+    int status = 0;
+
+    while (true) {
+        // Report background jobs that finished since the last prompt
+        out.write(JobTable::takeFinished());
+
+        char cwd[PATH_MAX];
+        getcwd(cwd, sizeof(cwd));
+        out.write("custom-shell:");
+        out.write(cwd, strlen(cwd));
+        out.write("# ");
+
+        // Everything up to and including the prompt must be visible before we block
+        {
+            Trace::Span span("phase", "output");
+            out.flush();
+        }
+
+        std::string input;
+        if (!std::getline(std::cin, input)) {
+            // End of input (Ctrl-D or a closed pipe)
+            out.put('\n');
+            return status;
+        }
+
+        if (input.empty()) {
+            continue;
+        }
+
+        try {
+            std::vector<Token> tokens;
+            {
+                Trace::Span span("phase", "lex", input);
+                tokens = Lexer::tokenize(input);
+            }
+            if (tokens.empty()) {
+                continue;
+            }
+
+            AST ast;
+            {
+                Trace::Span span("phase", "parse", input);
+                ast = Parser::parse(tokens);
+            }
+
+            Trace::Span span("phase", "execute", input);
+            status = Script::runPlan(ast);
+        } catch (const std::exception& ex) {
+            Script::reportError(std::string("Error: ") + ex.what());
+        }
+    }
+}
+
+/**
+ * Usage:
+ *   custom-shell                    interactive prompt
+ *   custom-shell <script> [...]     run a script file
+ *   custom-shell -c <commands>      run the given command line(s)
+ *   custom-shell --serve <socket>   stay resident and run requests sent to socket
+ *   custom-shell --connect <socket> -c <commands>
+ *                                   run them on that server, or here if none answers
+ */
+int main(int argc, char** argv) {
+    // A pipeline stage whose reader has exited should see EPIPE, not die
+    signal(SIGPIPE, SIG_IGN);
+
+    // The client does no setup of its own unless it has to run the commands itself
+    if (argc >= 2 && strcmp(argv[1], "--connect") == 0) {
+        if (argc < 5 || strcmp(argv[3], "-c") != 0) {
+            Script::reportError("custom-shell: usage: custom-shell --connect <socket> -c <commands>");
+            return 2;
+        }
+        int status = Server::connect(argv[2], argv[4]);
+        if (status != -1) {
+            return status;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    // Finished background jobs are collected through a signalfd
+    JobTable::init();
+
+    // All standard output goes through OutputSink::standardOutput(); iostreams
+    // are only used for stdin and stderr and need no syncing or tie to cout
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+
+    // CUSTOM_SHELL_TRACE=<file> records where the time goes
+    Trace::init();
+
+    if (argc < 2) {
+        return interactive();
+    }
+
+    if (strcmp(argv[1], "--serve") == 0) {
+        if (argc < 3) {
+            Script::reportError("custom-shell: --serve: option requires an argument");
+            return 2;
+        }
+        return Server::serve(argv[2]);
+    }
+
+    int status;
+    if (strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            Script::reportError("custom-shell: -c: option requires an argument");
+            return 2;
+        }
+        status = Script::runString(argv[2], "-c");
+    } else {
+        status = Script::runFile(argv[1]);
+    }
+
+    Trace::Span span("phase", "output");
+    OutputSink::standardOutput().flush();
+    return status;
+}
@@ -0,0 +1,480 @@
+#include "stream.h"
+#include "session.h"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <cstdlib>
+#include <cstdint>
+
+// Upper bound on a single in-kernel transfer request
+static constexpr size_t kKernelChunk = 1 << 20;
+
+OutputSink::OutputSink(int fd, size_t capacity) : fd_(fd), buffer_(capacity) {}
+
+OutputSink::~OutputSink() {
+    flush();
+}
+
+// Destroyed (and therefore flushed) by exit(), including the one in quit
+OutputSink& OutputSink::standardOutput() {
+    // A server request's output goes to its client instead
+    Session* session = Session::current();
+    if (session && session->out) {
+        return *session->out;
+    }
+
+    static OutputSink sink(STDOUT_FILENO, 256 * 1024);
+    return sink;
+}
+
+/**
+ * @brief Append bytes to the sink, writing through once the buffer fills up
+ * @return false once the sink is broken (reader closed or write error)
+ */
+bool OutputSink::write(const char* data, size_t len) {
+    if (broken_) {
+        return false;
+    }
+
+    if (used_ + len <= buffer_.size()) {
+        memcpy(buffer_.data() + used_, data, len);
+        used_ += len;
+        return true;
+    }
+
+    if (!flush()) {
+        return false;
+    }
+
+    // Large writes bypass the buffer entirely
+    if (len >= buffer_.size()) {
+        return writeAll(data, len);
+    }
+
+    memcpy(buffer_.data(), data, len);
+    used_ = len;
+    return true;
+}
+
+bool OutputSink::write(const std::string& s) {
+    return write(s.data(), s.size());
+}
+
+bool OutputSink::put(char c) {
+    return write(&c, 1);
+}
+
+bool OutputSink::flush() {
+    if (broken_) {
+        return false;
+    }
+
+    size_t pending = used_;
+    used_ = 0;
+    return writeAll(buffer_.data(), pending);
+}
+
+bool OutputSink::writeAll(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd_, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            broken_ = true;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+ssize_t OutputSink::copyFrom(int inFd) {
+    // Anything already buffered has to reach the fd before the kernel copy
+    if (!flush()) {
+        return 0;
+    }
+
+    struct stat inSt, outSt;
+    if (fstat(inFd, &inSt) == -1 || fstat(fd_, &outSt) == -1) {
+        return copyBuffered(inFd, 0);
+    }
+
+    const bool inRegular = S_ISREG(inSt.st_mode);
+    const bool anyPipe = S_ISFIFO(inSt.st_mode) || S_ISFIFO(outSt.st_mode);
+    const bool outRegular = S_ISREG(outSt.st_mode);
+
+    ssize_t copied = 0;
+
+    while (true) {
+        ssize_t n;
+        if (inRegular && outRegular) {
+            n = copy_file_range(inFd, nullptr, fd_, nullptr, kKernelChunk, 0);
+        } else if (anyPipe) {
+            n = splice(inFd, nullptr, fd_, nullptr, kKernelChunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else if (inRegular) {
+            n = sendfile(fd_, inFd, nullptr, kKernelChunk);
+        } else {
+            return copyBuffered(inFd, copied);
+        }
+
+        if (n > 0) {
+            copied += n;
+            continue;
+        }
+
+        if (n == 0) {
+            return copied;
+        }
+
+        switch (errno) {
+            case EINTR:
+                continue;
+
+            case EPIPE:
+                broken_ = true;
+                return copied;
+
+            // The descriptor pair does not support this path (O_APPEND
+            // targets, ttys, old kernels, cross-filesystem copies...).
+            // File offsets have advanced normally, so the buffered loop
+            // simply picks up where the kernel stopped.
+            case EINVAL:
+            case ENOSYS:
+            case EXDEV:
+            case EOPNOTSUPP:
+            case EBADF:
+                return copyBuffered(inFd, copied);
+
+            default:
+                return -1;
+        }
+    }
+}
+
+bool OutputSink::feedsBack(int inFd, off_t offset) const {
+    struct stat inSt, outSt;
+    if (fstat(fd_, &outSt) == -1 || !S_ISREG(outSt.st_mode) ||
+        fstat(inFd, &inSt) == -1 || inSt.st_dev != outSt.st_dev || inSt.st_ino != outSt.st_ino) {
+        return false;
+    }
+
+    // "cat f > f" has already truncated f and has nothing to loop on
+    if (offset == -1) {
+        offset = lseek(inFd, 0, SEEK_CUR);
+    }
+    return offset < inSt.st_size;
+}
+
+ssize_t OutputSink::copyBuffered(int inFd, ssize_t copied) {
+    InputSource src(inFd);
+    const char* data;
+    ssize_t bytesRead;
+    while ((bytesRead = src.read(data)) > 0) {
+        if (!writeAll(data, bytesRead)) {
+            return copied;
+        }
+        copied += bytesRead;
+    }
+    return bytesRead == -1 ? -1 : copied;
+}
+
+char* TextArena::reserve(size_t n) {
+    if (used_ + n > buffer_.size()) {
+        buffer_.resize(std::max(buffer_.size() * 2, used_ + n + 4096));
+    }
+    return buffer_.data() + used_;
+}
+
+void TextArena::append(const char* data, size_t len) {
+    memcpy(reserve(len), data, len);
+    used_ += len;
+}
+
+void TextArena::put(char c) {
+    *reserve(1) = c;
+    ++used_;
+}
+
+void TextArena::appendNumber(unsigned long long value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    char* dst = reserve(n);
+    for (int i = 0; i < n; ++i) {
+        dst[i] = digits[n - 1 - i];
+    }
+    used_ += n;
+}
+
+/* --- MappedFile --- */
+
+MappedFile::~MappedFile() {
+    reset();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        reset();
+        base_ = other.base_;
+        length_ = other.length_;
+        data_ = other.data_;
+        size_ = other.size_;
+        other.base_ = nullptr;
+        other.length_ = 0;
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+void MappedFile::reset() {
+    if (base_) {
+        munmap(base_, length_);
+    }
+    base_ = nullptr;
+    length_ = 0;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+/**
+ * @brief Map fd from offset to its current end
+ * @param fd Open descriptor; it may be closed once this returns
+ * @param offset First byte of the view; need not be page-aligned
+ * @return true if the view is mapped
+ */
+bool MappedFile::map(int fd, off_t offset) {
+    reset();
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return false;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size <= offset) {
+        errno = EINVAL;
+        return false;
+    }
+
+    static const off_t pageSize = sysconf(_SC_PAGESIZE);
+    const off_t start = offset - offset % pageSize;
+    const size_t length = st.st_size - start;
+
+    void* base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, start);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    madvise(base, length, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    // Only takes effect where the kernel backs file mappings with huge pages
+    if (length >= kHugePageMin) {
+        madvise(base, length, MADV_HUGEPAGE);
+    }
+#endif
+
+    base_ = base;
+    length_ = length;
+    data_ = static_cast<const char*>(base) + (offset - start);
+    size_ = st.st_size - offset;
+    return true;
+}
+
+/* --- InputSource --- */
+
+// Read buffers outlive their InputSource so the next input on the thread skips the allocation
+static thread_local std::vector<char> spareBuffer;
+
+size_t InputSource::mapThreshold() {
+    static const size_t threshold = [] {
+        const char* env = getenv("CUSTOM_SHELL_MMAP_THRESHOLD");
+        if (env && strcmp(env, "off") == 0) {
+            return SIZE_MAX;
+        }
+        if (env) {
+            char* end = nullptr;
+            unsigned long long v = strtoull(env, &end, 10);
+            if (end != env && *end == '\0') {
+                return static_cast<size_t>(v);
+            }
+        }
+        return static_cast<size_t>(64 * 1024);
+    }();
+    return threshold;
+}
+
+InputSource::InputSource(int fd, size_t chunk) : fd_(fd), chunk_(chunk) {
+    mapIfLarge();
+}
+
+/**
+ * @brief Resume a file whose head was already read (e.g. by FileQueue)
+ * @param preloaded Bytes read from fd so far; copied, so they need not outlive the call
+ * @param complete Whether preloaded is the whole input; otherwise reading continues at fd's offset
+ */
+InputSource::InputSource(int fd, std::string_view preloaded, bool complete, size_t chunk)
+    : fd_(fd), chunk_(chunk), eof_(complete) {
+    if (preloaded.empty() && !complete) {
+        mapIfLarge();
+        return;
+    }
+
+    acquireBuffer();
+    if (buffer_.size() < preloaded.size()) {
+        buffer_.resize(preloaded.size());
+    }
+    memcpy(buffer_.data(), preloaded.data(), preloaded.size());
+    end_ = preloaded.size();
+}
+
+void InputSource::mapIfLarge() {
+    const size_t threshold = mapThreshold();
+    if (threshold == SIZE_MAX) {
+        return;
+    }
+
+    // Start where a read(2) would, so inherited and redirected descriptors behave the same
+    struct stat st;
+    off_t pos = lseek(fd_, 0, SEEK_CUR);
+    if (pos != -1 && fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size - pos >= static_cast<off_t>(std::max<size_t>(threshold, 1)) &&
+        map_.map(fd_, pos)) {
+        mapOffset_ = pos;
+    }
+}
+
+InputSource::~InputSource() {
+    if (map_.mapped()) {
+        lseek(fd_, mapOffset_ + static_cast<off_t>(mapPos_), SEEK_SET);
+    }
+    if (buffer_.size() > spareBuffer.size()) {
+        spareBuffer.swap(buffer_);
+    }
+}
+
+void InputSource::acquireBuffer() {
+    if (buffer_.empty()) {
+        buffer_.swap(spareBuffer);
+    }
+    if (buffer_.size() < chunk_) {
+        buffer_.resize(chunk_);
+    }
+}
+
+/**
+ * @brief Hand out the next chunk, as large as the mapping window or one read(2)
+ * @param chunk Receives the data; empty at end of input
+ * @return false on a read error, with errno set
+ */
+bool InputSource::next(std::string_view& chunk) {
+    if (map_.mapped()) {
+        std::string_view all = map_.view();
+        size_t n = std::min(chunk_, all.size() - mapPos_);
+        chunk = all.substr(mapPos_, n);
+        mapPos_ += n;
+        return true;
+    }
+
+    // Whatever nextLines() left behind comes first
+    if (begin_ < end_) {
+        chunk = std::string_view(buffer_.data() + begin_, end_ - begin_);
+        begin_ = end_ = 0;
+        return true;
+    }
+    if (eof_) {
+        chunk = std::string_view();
+        return true;
+    }
+
+    acquireBuffer();
+    ssize_t n;
+    do {
+        n = ::read(fd_, buffer_.data(), buffer_.size());
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        return false;
+    }
+    chunk = std::string_view(buffer_.data(), n);
+    return true;
+}
+
+/**
+ * @brief Hand out the next run of complete lines
+ * @param chunk Receives the data; empty at end of input. Only the final
+ *        chunk may lack a trailing newline.
+ * @return false on a read error, with errno set
+ */
+bool InputSource::nextLines(std::string_view& chunk) {
+    if (map_.mapped()) {
+        std::string_view all = map_.view();
+        size_t stop = mapPos_ + std::min(chunk_, all.size() - mapPos_);
+        if (stop < all.size()) {
+            const void* nl = memchr(all.data() + stop, '\n', all.size() - stop);
+            stop = nl ? static_cast<const char*>(nl) - all.data() + 1 : all.size();
+        }
+        chunk = all.substr(mapPos_, stop - mapPos_);
+        mapPos_ = stop;
+        return true;
+    }
+
+    acquireBuffer();
+
+    // Carry the partial line left over from the last call to the front
+    if (begin_ > 0) {
+        memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+
+    while (!eof_) {
+        if (end_ == buffer_.size()) {
+            buffer_.resize(buffer_.size() * 2);
+        }
+
+        ssize_t n = ::read(fd_, buffer_.data() + end_, buffer_.size() - end_);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) {
+            eof_ = true;
+            break;
+        }
+
+        const size_t searched = end_;
+        end_ += n;
+
+        const void* nl = memrchr(buffer_.data() + searched, '\n', n);
+        if (nl) {
+            begin_ = static_cast<const char*>(nl) - buffer_.data() + 1;
+            chunk = std::string_view(buffer_.data(), begin_);
+            return true;
+        }
+    }
+
+    chunk = std::string_view(buffer_.data(), end_);
+    begin_ = end_;
+    return true;
+}
+
+ssize_t InputSource::read(const char*& data) {
+    std::string_view chunk;
+    if (!next(chunk)) {
+        return -1;
+    }
+    data = chunk.data();
+    return static_cast<ssize_t>(chunk.size());
+}
@@ -0,0 +1,126 @@
+#include "trace.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool Trace::enabled_ = false;
+
+namespace {
+
+struct Event {
+    const char* category;
+    std::string name;
+    std::string detail;
+    long tid;
+    uint64_t start;
+    uint64_t end;
+};
+
+std::mutex eventMutex;
+std::vector<Event> events;
+std::string tracePath;
+
+long threadId() {
+    static thread_local long tid = syscall(SYS_gettid);
+    return tid;
+}
+
+void appendEscaped(std::string& out, const std::string& s) {
+    static const char hex[] = "0123456789abcdef";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 0xF];
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+}
+
+}  // namespace
+
+void Trace::init() {
+    const char* path = getenv("CUSTOM_SHELL_TRACE");
+    if (!path || !*path) {
+        return;
+    }
+
+    tracePath = path;
+    enabled_ = true;
+    atexit(write);
+}
+
+uint64_t Trace::now() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const char* category, std::string name, std::string detail, uint64_t start, uint64_t end) {
+    Event event{category, std::move(name), std::move(detail), threadId(), start, end};
+    std::lock_guard<std::mutex> lock(eventMutex);
+    events.push_back(std::move(event));
+}
+
+/**
+ * @brief Write every recorded event to the trace file as a JSON object
+ * Rewrites the whole file, so calling it again only adds the newer events.
+ */
+void Trace::write() {
+    if (tracePath.empty()) {
+        return;
+    }
+
+    std::string json = "{\"traceEvents\":[";
+    const std::string pid = std::to_string(getpid());
+    {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        for (size_t i = 0; i < events.size(); ++i) {
+            const Event& e = events[i];
+            if (i > 0) json += ",";
+            json += "\n{\"name\":\"";
+            appendEscaped(json, e.name);
+            json += "\",\"cat\":\"";
+            json += e.category;
+            json += "\",\"ph\":\"X\",\"ts\":" + std::to_string(e.start) +
+                    ",\"dur\":" + std::to_string(e.end - e.start) +
+                    ",\"pid\":" + pid + ",\"tid\":" + std::to_string(e.tid);
+            if (!e.detail.empty()) {
+                json += ",\"args\":{\"text\":\"";
+                appendEscaped(json, e.detail);
+                json += "\"}";
+            }
+            json += "}";
+        }
+    }
+    json += "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    FILE* f = fopen(tracePath.c_str(), "w");
+    if (!f) {
+        return;
+    }
+    fwrite(json.data(), 1, json.size(), f);
+    fclose(f);
+}
+
+Trace::Span::Span(const char* category, std::string_view name, std::string_view detail) : category_(category) {
+    if (!enabled_) {
+        return;
+    }
+    name_.assign(name);
+    detail_.assign(detail);
+    start_ = now();
+}
+
+Trace::Span::~Span() {
+    if (enabled_) {
+        record(category_, std::move(name_), std::move(detail_), start_, now());
+    }
+}
@@ -0,0 +1,462 @@
+#include "uring.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef CUSTOM_SHELL_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+IoRing::~IoRing() {
+    if (sqes_) munmap(sqes_, sqesSize_);
+    if (cqRing_ && cqRing_ != sqRing_) munmap(cqRing_, cqRingSize_);
+    if (sqRing_) munmap(sqRing_, sqRingSize_);
+    if (fd_ != -1) close(fd_);
+}
+
+/**
+ * @brief Create the ring and map its queues
+ * @param entries Submission queue size (rounded up to a power of two by the kernel)
+ * @return false when io_uring is unavailable, with errno set
+ */
+bool IoRing::init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ == -1) {
+        return false;
+    }
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels serve both rings from one mapping
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        sqRing_ = nullptr;
+        return false;
+    }
+
+    if (single) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            cqRing_ = nullptr;
+            return false;
+        }
+    }
+
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sqRing_);
+    sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqEntries_ = params.sq_entries;
+    sqLocalTail_ = *sqTail_;
+
+    char* cq = static_cast<char*>(cqRing_);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+struct io_uring_sqe* IoRing::sqe() {
+    unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    if (sqLocalTail_ - head >= sqEntries_) {
+        return nullptr;
+    }
+
+    unsigned index = sqLocalTail_ & sqMask_;
+    struct io_uring_sqe* entry = &sqes_[index];
+    memset(entry, 0, sizeof(*entry));
+    sqArray_[index] = index;
+
+    ++sqLocalTail_;
+    ++toSubmit_;
+    return entry;
+}
+
+bool IoRing::submit(bool wait) {
+    // Publish the new SQEs before the kernel looks at the tail
+    __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, fd_, toSubmit_, wait ? 1 : 0, flags, nullptr, 0);
+        if (n >= 0) {
+            toSubmit_ -= std::min<unsigned>(toSubmit_, static_cast<unsigned>(n));
+            return true;
+        }
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+bool IoRing::reap(struct io_uring_cqe& out) {
+    unsigned head = *cqHead_;
+    if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    out = cqes_[head & cqMask_];
+    __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif
+
+struct FileQueue::Slot {
+    // Queued -> [Statting -> Opening -> Reading] -> Ready; Deferred files are opened when reached
+    enum Stage { Queued, Statting, Opening, Reading, Deferred, Ready };
+
+    Stage stage = Queued;
+    int fd = -1;
+    int error = 0;
+    std::vector<char> data;
+    size_t requested = 0;
+    size_t got = 0;
+#ifdef CUSTOM_SHELL_IO_URING
+    struct statx info;
+#endif
+};
+
+#ifdef CUSTOM_SHELL_IO_URING
+struct FileQueue::Ring : IoRing {
+    size_t inFlight = 0;
+};
+
+// user_data is index << 2 | op; cancellations use a tag no index can produce
+static constexpr uint64_t kOpStat = 0;
+static constexpr uint64_t kOpOpen = 1;
+static constexpr uint64_t kOpRead = 2;
+static constexpr uint64_t kCancelTag = ~uint64_t(0);
+
+static uint64_t opTag(size_t index, uint64_t op) {
+    return (uint64_t(index) << 2) | op;
+}
+
+// Set once the kernel refuses io_uring_setup, so later commands skip straight to the fallback
+static std::atomic<bool> uringUnavailable{false};
+#else
+struct FileQueue::Ring {};
+#endif
+
+thread_local std::unique_ptr<FileQueue::Ring> FileQueue::spareRing_;
+
+size_t FileQueue::depth() {
+    static const size_t value = [] {
+        const char* env = getenv("CUSTOM_SHELL_IO_DEPTH");
+        if (env && *env) {
+            char* end = nullptr;
+            unsigned long n = strtoul(env, &end, 10);
+            if (end && *end == '\0') {
+                return std::min<size_t>(n, 256);
+            }
+        }
+        return size_t(8);
+    }();
+    return value;
+}
+
+bool FileQueue::uringEnabled() {
+#ifdef CUSTOM_SHELL_IO_URING
+    static const bool wanted = [] {
+        const char* env = getenv("CUSTOM_SHELL_IO_URING");
+        return !(env && strcmp(env, "0") == 0);
+    }();
+    return wanted && !uringUnavailable.load(std::memory_order_relaxed);
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Queue paths and start on the first depth() of them
+ * @param paths Operands; must outlive the queue
+ * @param prefetch Bytes of each small regular file to read ahead, 0 to only open
+ */
+FileQueue::FileQueue(const std::vector<std::string>& paths, size_t prefetch)
+    : paths_(paths), prefetch_(prefetch), depth_(depth()), slots_(paths.size()) {
+#ifdef CUSTOM_SHELL_IO_URING
+    // A single file has nothing to overlap with
+    if (depth_ > 0 && paths.size() > 1 && uringEnabled()) {
+        ring_ = std::move(spareRing_);
+        if (!ring_) {
+            // Room for one operation per file in flight plus as many cancellations
+            unsigned entries = 1;
+            while (entries < depth_ * 2) entries <<= 1;
+
+            ring_ = std::make_unique<Ring>();
+            if (!ring_->init(entries)) {
+                if (errno == ENOSYS || errno == EPERM || errno == EACCES) {
+                    uringUnavailable = true;
+                }
+                ring_.reset();
+            }
+        }
+    }
+#endif
+    fill();
+}
+
+FileQueue::~FileQueue() {
+#ifdef CUSTOM_SHELL_IO_URING
+    if (ring_) {
+        // Stopped early: nothing may be left writing into slots once they are freed
+        prefetch_ = 0;
+        for (size_t i = nextOut_; i < nextOpen_; ++i) {
+            const Slot::Stage stage = slots_[i].stage;
+            if (stage != Slot::Statting && stage != Slot::Opening && stage != Slot::Reading) continue;
+
+            struct io_uring_sqe* sqe = ring_->sqe();
+            if (!sqe) break;
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = opTag(i, stage == Slot::Statting ? kOpStat : stage == Slot::Opening ? kOpOpen : kOpRead);
+            sqe->user_data = kCancelTag;
+            ++ring_->inFlight;
+        }
+
+        while (ring_->inFlight > 0 && pump(true)) {}
+
+        if (ring_->inFlight == 0) {
+            spareRing_ = std::move(ring_);
+        } else {
+            // The kernel may still complete into the slots: leak them with the ring rather than free them
+            ring_.release();
+            new std::vector<Slot>(std::move(slots_));
+        }
+    }
+#endif
+
+    for (size_t i = nextOut_; i < slots_.size(); ++i) {
+        if (slots_[i].fd != -1) close(slots_[i].fd);
+    }
+}
+
+/**
+ * @brief Keep depth() files in flight ahead of the one handed out last
+ */
+void FileQueue::fill() {
+    while (nextOpen_ < slots_.size() && nextOpen_ - nextOut_ < depth_) {
+        const size_t index = nextOpen_;
+        Slot& slot = slots_[index];
+
+#ifdef CUSTOM_SHELL_IO_URING
+        if (ring_) {
+            // Stat first: only regular files may be opened early
+            struct io_uring_sqe* sqe = ring_->sqe();
+            if (!sqe) break;
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(paths_[index].c_str());
+            sqe->len = STATX_TYPE | STATX_SIZE;
+            sqe->off = reinterpret_cast<uint64_t>(&slot.info);
+            sqe->user_data = opTag(index, kOpStat);
+            ++ring_->inFlight;
+            slot.stage = Slot::Statting;
+            ++nextOpen_;
+            continue;
+        }
+#endif
+
+        // Opening a FIFO or a device early could block or have side effects
+        struct stat st;
+        if (stat(paths_[index].c_str(), &st) == -1 || !S_ISREG(st.st_mode)) {
+            slot.stage = Slot::Deferred;
+        } else {
+            openNow(index);
+            if (slot.fd != -1 && prefetch_ > 0) {
+                posix_fadvise(slot.fd, 0, static_cast<off_t>(prefetch_), POSIX_FADV_WILLNEED);
+            }
+        }
+        ++nextOpen_;
+    }
+
+#ifdef CUSTOM_SHELL_IO_URING
+    if (ring_) {
+        pump(false);
+    }
+#endif
+}
+
+void FileQueue::openNow(size_t index) {
+    Slot& slot = slots_[index];
+    do {
+        slot.fd = open(paths_[index].c_str(), O_RDONLY | O_CLOEXEC);
+    } while (slot.fd == -1 && errno == EINTR);
+    slot.error = slot.fd == -1 ? errno : 0;
+    slot.stage = Slot::Ready;
+}
+
+/**
+ * @brief Submit what is queued and process whatever has completed
+ * @param wait Block until at least one completion arrives
+ * @return false if the ring failed, with errno set
+ */
+bool FileQueue::pump(bool wait) {
+#ifdef CUSTOM_SHELL_IO_URING
+    if (!ring_->submit(wait)) {
+        return false;
+    }
+
+    bool queuedMore = false;
+    struct io_uring_cqe cqe;
+    while (ring_->reap(cqe)) {
+        --ring_->inFlight;
+        if (cqe.user_data == kCancelTag) continue;
+
+        const size_t index = cqe.user_data >> 2;
+        const uint64_t op = cqe.user_data & 3;
+        Slot& slot = slots_[index];
+
+        if (slot.stage == Slot::Ready) {
+            // Given up on after a ring failure
+            if (op == kOpOpen && cqe.res >= 0) close(cqe.res);
+            continue;
+        }
+
+        if (op == kOpRead) {
+            // A failed read is simply not preloaded; the caller's own read reports it
+            slot.got = cqe.res > 0 && slot.requested > 0 ? static_cast<size_t>(cqe.res) : 0;
+            slot.stage = Slot::Ready;
+            continue;
+        }
+
+        if (op == kOpStat) {
+            // Anything unusual, errors included, is left to a plain open(2) in turn
+            if (cqe.res < 0 || !S_ISREG(slot.info.stx_mode)) {
+                slot.stage = Slot::Deferred;
+                continue;
+            }
+
+            struct io_uring_sqe* sqe = ring_->sqe();
+            if (!sqe) {
+                slot.stage = Slot::Deferred;
+                continue;
+            }
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(paths_[index].c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = opTag(index, kOpOpen);
+            ++ring_->inFlight;
+            slot.stage = Slot::Opening;
+            queuedMore = true;
+            continue;
+        }
+
+        if (cqe.res < 0) {
+            slot.error = -cqe.res;
+            slot.stage = Slot::Ready;
+            continue;
+        }
+        slot.fd = cqe.res;
+
+        const uint64_t size = slot.info.stx_size;
+        struct io_uring_sqe* sqe = prefetch_ > 0 && size > 0 ? ring_->sqe() : nullptr;
+        if (!sqe) {
+            slot.stage = Slot::Ready;
+            continue;
+        }
+
+        if (size < prefetch_) {
+            // One byte past the size, so a short read proves the whole file arrived
+            slot.requested = static_cast<size_t>(size) + 1;
+            slot.data.resize(slot.requested);
+            sqe->opcode = IORING_OP_READ;
+            sqe->addr = reinterpret_cast<uint64_t>(slot.data.data());
+            sqe->len = static_cast<uint32_t>(slot.requested);
+        } else {
+            // Large files get mapped; just have the kernel start pulling in the head
+            sqe->opcode = IORING_OP_FADVISE;
+            sqe->len = static_cast<uint32_t>(prefetch_);
+            sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+        }
+        sqe->fd = slot.fd;
+        sqe->off = 0;
+        sqe->user_data = opTag(index, kOpRead);
+        ++ring_->inFlight;
+        slot.stage = Slot::Reading;
+        queuedMore = true;
+    }
+
+    return !queuedMore || ring_->submit(false);
+#else
+    (void)wait;
+    return true;
+#endif
+}
+
+/**
+ * @brief Hand out the next file, waiting for its open (and read) if needed
+ * @param file Receives the file; its fd now belongs to the caller
+ * @return false once every path has been handed out
+ */
+bool FileQueue::next(File& file) {
+    if (nextOut_ > 0) {
+        std::vector<char>().swap(slots_[nextOut_ - 1].data);
+    }
+    if (nextOut_ >= slots_.size()) {
+        return false;
+    }
+
+    const size_t index = nextOut_;
+    Slot& slot = slots_[index];
+
+    if (index >= nextOpen_) {
+        // Depth 0: nothing was started ahead
+        nextOpen_ = index + 1;
+        slot.stage = Slot::Deferred;
+    }
+
+#ifdef CUSTOM_SHELL_IO_URING
+    while (slot.stage != Slot::Ready && slot.stage != Slot::Deferred) {
+        if (!pump(true)) {
+            slot.stage = Slot::Deferred;
+        }
+    }
+#endif
+
+    if (slot.stage == Slot::Deferred) {
+        openNow(index);
+    }
+
+    file.path = &paths_[index];
+    file.fd = slot.fd;
+    file.error = slot.error;
+    file.preloaded = std::string_view(slot.data.data(), slot.got);
+    file.complete = slot.got > 0 && slot.got < slot.requested;
+
+    // The read was at offset 0; leave the descriptor where reading it would have
+    if (slot.got > 0 && !file.complete) {
+        lseek(slot.fd, static_cast<off_t>(slot.got), SEEK_SET);
+    }
+
+    slot.fd = -1;
+    ++nextOut_;
+    fill();
+    return true;
+}
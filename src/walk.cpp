@@ -0,0 +1,221 @@
+#include "walk.h"
+#include "listing.h"
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * A directory that was (or is about to be) entered. pending counts the
+ * node's own scan, its outstanding entry slices and every subdirectory
+ * still being walked; whoever drops it to zero calls leave and then
+ * releases the parent.
+ */
+struct TreeWalker::Node {
+    std::shared_ptr<Node> parent;
+    std::string name;
+    std::string path;
+    size_t depth = 0;
+    int fd = -1;
+    std::atomic<int> pending{1};
+    std::atomic<bool> failed{false};
+    std::shared_ptr<void> data;
+
+    ~Node() {
+        if (fd != -1) close(fd);
+    }
+};
+
+static const std::string kNoPath;
+static const std::shared_ptr<void> kNoData;
+
+std::string TreeWalker::Entry::path() const {
+    if (dirPath.empty()) return name;
+    if (dirPath.back() == '/') return dirPath + name;
+    return dirPath + "/" + name;
+}
+
+TreeWalker::TreeWalker(const Options& options) : options_(options), pool_(options.threads) {}
+
+void TreeWalker::fail(const std::string& what, const std::string& path, int err) {
+    std::string msg = what + " '" + path + "': " + strerror(err);
+    std::lock_guard<std::mutex> lock(errorMutex_);
+    errors_.push_back(std::move(msg));
+}
+
+void TreeWalker::fail(const Entry& entry, const std::string& what, int err) {
+    fail(what, entry.path(), err);
+    if (entry.owner) {
+        entry.owner->failed = true;
+    }
+}
+
+/**
+ * @brief Visit root and, if it is a directory, everything below it
+ * @param root Path as given by the user; it is printed back unchanged
+ * @return One message per failure, in no particular order
+ */
+std::vector<std::string> TreeWalker::run(const std::string& root) {
+    start(root);
+
+    // A callback that threw (bad_alloc mid-copy, say) left part of the tree undone
+    try {
+        pool_.wait();
+    } catch (const std::exception& ex) {
+        errors_.push_back("aborted walking '" + root + "': " + ex.what());
+    } catch (...) {
+        errors_.push_back("aborted walking '" + root + "'");
+    }
+
+    std::vector<std::string> errors;
+    errors.swap(errors_);
+    return errors;
+}
+
+void TreeWalker::start(const std::string& root) {
+    struct stat st;
+    int rc = options_.followRoot ? stat(root.c_str(), &st) : lstat(root.c_str(), &st);
+    if (rc == -1) {
+        fail("cannot access", root, errno);
+        return;
+    }
+
+    auto node = std::make_shared<Node>();
+    node->name = root;
+    node->path = root;
+
+    const unsigned char type = IFTODT(st.st_mode);
+    Entry entry{AT_FDCWD, root.c_str(), kNoPath, type, 0, kNoData,
+                type == DT_DIR ? &node->data : nullptr, nullptr};
+
+    bool descend = visit_ ? visit_(entry) : true;
+    if (type != DT_DIR || !descend || options_.maxDepth == 0) {
+        return;
+    }
+
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (options_.followRoot ? 0 : O_NOFOLLOW);
+    node->fd = open(root.c_str(), flags);
+    if (node->fd == -1) {
+        fail("cannot open directory", root, errno);
+        node->failed = true;
+        finish(node);
+        return;
+    }
+
+    pool_.submit([this, node] { scan(node); });
+}
+
+void TreeWalker::scan(const std::shared_ptr<Node>& node) {
+    if (node->fd == -1) {
+        node->fd = openat(node->parent->fd, node->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (node->fd == -1) {
+            fail("cannot open directory", node->path, errno);
+            node->failed = true;
+            finish(node);
+            return;
+        }
+    }
+
+    auto listing = std::make_shared<DirListing>();
+    if (!DirReader::read(node->fd, *listing)) {
+        fail("cannot read directory", node->path, errno);
+        node->failed = true;
+        finish(node);
+        return;
+    }
+
+    // Hand the tail of a wide directory to other workers, keep the head
+    const size_t n = listing->size();
+    for (size_t begin = kEntriesPerTask; begin < n; begin += kEntriesPerTask) {
+        size_t end = std::min(n, begin + kEntriesPerTask);
+        node->pending.fetch_add(1);
+        pool_.submit([this, node, listing, begin, end] { visitSlice(node, listing, begin, end); });
+    }
+
+    visitSlice(node, listing, 0, std::min(n, kEntriesPerTask));
+}
+
+void TreeWalker::visitSlice(const std::shared_ptr<Node>& node, const std::shared_ptr<const DirListing>& listing,
+                            size_t begin, size_t end) {
+    const size_t depth = node->depth + 1;
+
+    for (size_t i = begin; i < end; ++i) {
+        const char* name = listing->name(i).data();
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        unsigned char type = listing->entries[i].type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(node->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                Entry entry{node->fd, name, node->path, type, depth, node->data, nullptr, node.get()};
+                fail(entry, "cannot stat", errno);
+                continue;
+            }
+            type = IFTODT(st.st_mode);
+        }
+
+        std::shared_ptr<void> childData;
+        Entry entry{node->fd, name, node->path, type, depth, node->data,
+                    type == DT_DIR ? &childData : nullptr, node.get()};
+
+        bool descend = visit_ ? visit_(entry) : true;
+        if (type != DT_DIR || !descend || depth >= options_.maxDepth) {
+            continue;
+        }
+
+        auto child = std::make_shared<Node>();
+        child->parent = node;
+        child->name = name;
+        child->path = entry.path();
+        child->depth = depth;
+        child->data = std::move(childData);
+
+        node->pending.fetch_add(1);
+        pool_.submit([this, child] { scan(child); });
+    }
+
+    finish(node);
+}
+
+void TreeWalker::finish(std::shared_ptr<Node> node) {
+    while (node && node->pending.fetch_sub(1) == 1) {
+        // Everything below is done; leave may now remove or finalize the directory
+        if (node->fd != -1) {
+            close(node->fd);
+            node->fd = -1;
+        }
+
+        std::shared_ptr<Node> parent = node->parent;
+        if (leave_) {
+            Entry entry{parent ? parent->fd : AT_FDCWD, node->name.c_str(),
+                        parent ? parent->path : kNoPath, DT_DIR, node->depth,
+                        parent ? parent->data : kNoData, &node->data, parent.get()};
+            leave_(entry, node->failed);
+        }
+
+        if (node->failed && parent) {
+            parent->failed = true;
+        }
+
+        node = parent;
+    }
+}
+
+void TreeWalker::sortPaths(std::vector<std::string>& paths) {
+    // '/' ranks below every other byte, so a directory's subtree stays together
+    std::sort(paths.begin(), paths.end(), [](const std::string& a, const std::string& b) {
+        size_t n = std::min(a.size(), b.size());
+        for (size_t i = 0; i < n; ++i) {
+            unsigned char ca = a[i] == '/' ? 0 : static_cast<unsigned char>(a[i]);
+            unsigned char cb = b[i] == '/' ? 0 : static_cast<unsigned char>(b[i]);
+            if (ca != cb) return ca < cb;
+        }
+        return a.size() < b.size();
+    });
+}
@@ -0,0 +1,129 @@
+#include "workpool.h"
+
+// Which pool (if any) the current thread works for, and its queue index
+static thread_local const WorkPool* currentPool = nullptr;
+static thread_local size_t currentIndex = 0;
+
+size_t WorkPool::defaultThreads() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+WorkPool::WorkPool(size_t threads) {
+    if (threads == 0) {
+        threads = defaultThreads();
+    }
+
+    for (size_t i = 0; i < threads; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+
+    threads_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back(&WorkPool::workerLoop, this, i);
+    }
+}
+
+WorkPool::~WorkPool() {
+    {
+        // A failure nobody waited for has nowhere left to go
+        std::unique_lock<std::mutex> lock(mutex_);
+        allDone_.wait(lock, [this] { return pending_ == 0; });
+        stopping_ = true;
+    }
+    workAvailable_.notify_all();
+
+    for (std::thread& t : threads_) {
+        t.join();
+    }
+}
+
+void WorkPool::submit(Task task) {
+    {
+        // Counted before it is visible: a task stolen and finished at once
+        // must not take pending_ to zero while its parent is still running.
+        // Workers never lock mutex_ while holding a queue's, so this order is safe.
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t index = currentPool == this ? currentIndex : nextQueue_++ % queues_.size();
+        ++queued_;
+        ++pending_;
+
+        std::lock_guard<std::mutex> queueLock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    workAvailable_.notify_one();
+}
+
+void WorkPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    allDone_.wait(lock, [this] { return pending_ == 0; });
+
+    if (failure_) {
+        std::exception_ptr failure = std::move(failure_);
+        failure_ = nullptr;
+        std::rethrow_exception(failure);
+    }
+}
+
+bool WorkPool::popLocal(size_t index, Task& task) {
+    Queue& q = *queues_[index];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty()) {
+        return false;
+    }
+    task = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+}
+
+bool WorkPool::steal(size_t index, Task& task) {
+    const size_t n = queues_.size();
+    for (size_t k = 1; k < n; ++k) {
+        Queue& q = *queues_[(index + k) % n];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty()) {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkPool::workerLoop(size_t index) {
+    currentPool = this;
+    currentIndex = index;
+
+    while (true) {
+        Task task;
+        if (popLocal(index, task) || steal(index, task)) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --queued_;
+            }
+
+            // A failing task must not take the worker down with it; wait() reports it
+            std::exception_ptr failure;
+            try {
+                task();
+            } catch (...) {
+                failure = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (failure && !failure_) {
+                failure_ = std::move(failure);
+            }
+            if (--pending_ == 0) {
+                allDone_.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        workAvailable_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+        if (stopping_ && queued_ == 0) {
+            return;
+        }
+    }
+}